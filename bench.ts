@@ -0,0 +1,222 @@
+import { parseArgs } from "node:util";
+import { readFile, writeFile } from "node:fs/promises";
+import os from "node:os";
+
+import sd from "@lmagder/node-stable-diffusion-cpp";
+import type { JobTiming } from "@lmagder/node-stable-diffusion-cpp";
+
+const args = parseArgs({
+  options: {
+    model: { type: "string", short: "m" },
+    prompt: { type: "string", short: "p" },
+    sizes: { type: "string", default: "256x256,512x512" },
+    steps: { type: "string", default: "4,20" },
+    samplers: { type: "string", default: "EulerA" },
+    weightTypes: { type: "string", default: "F16" },
+    threads: { type: "string", default: String(sd.getNumPhysicalCores()) },
+    batch: { type: "string", default: "1" },
+    seed: { type: "string", default: "42" },
+    repeat: { type: "string", default: "3" },
+    warmup: { type: "string", default: "1" },
+    output: { type: "string", short: "o" },
+    baseline: { type: "string", short: "b" },
+    threshold: { type: "string", default: "0.1" },
+  },
+});
+
+if (!args.values.model) {
+  console.error("Missing model param");
+  process.exit(1);
+}
+
+const list = (value: string) => value.split(",").map((v) => v.trim()).filter((v) => v.length > 0);
+const numbers = (value: string) => list(value).map((v) => Number.parseInt(v));
+const enumValue = (e: Record<string, unknown>, name: string, what: string) => {
+  if (!(name in e)) {
+    console.error(`Unknown ${what} ${name}, expected one of ${Object.keys(e).join(", ")}`);
+    process.exit(1);
+  }
+  return e[name] as number;
+};
+
+const model = args.values.model;
+const prompt = args.values.prompt ?? "a picture of a dog";
+const sizes = list(args.values.sizes!).map((s) => s.split("x").map((v) => Number.parseInt(v)) as [number, number]);
+const stepCounts = numbers(args.values.steps!);
+const samplers = list(args.values.samplers!);
+const weightTypes = list(args.values.weightTypes!);
+const threadCounts = numbers(args.values.threads!);
+const batchCounts = numbers(args.values.batch!);
+const seed = Number.parseInt(args.values.seed!);
+const repeat = Math.max(1, Number.parseInt(args.values.repeat!));
+const warmup = Math.max(0, Number.parseInt(args.values.warmup!));
+const threshold = Number.parseFloat(args.values.threshold!);
+
+type Percentiles = { p50: number; p90: number; p99: number; mean: number };
+
+type BenchResult = {
+  key: string;
+  config: {
+    width: number;
+    height: number;
+    sampleSteps: number;
+    sampleMethod: string;
+    weightType: string;
+    numThreads: number;
+    batchCount: number;
+  };
+  loadMs: number;
+  firstStepMs: Percentiles;
+  stepMs: Percentiles;
+  imagesPerSec: number;
+  marshalMs: Percentiles;
+  peakRssBytes: number;
+};
+
+type BenchReport = {
+  meta: Record<string, string | number>;
+  results: BenchResult[];
+};
+
+const percentiles = (values: number[]): Percentiles => {
+  if (values.length === 0) {
+    return { p50: 0, p90: 0, p99: 0, mean: 0 };
+  }
+  const sorted = [...values].sort((a, b) => a - b);
+  const at = (p: number) => sorted[Math.min(sorted.length - 1, Math.floor(p * sorted.length))];
+  return { p50: at(0.5), p90: at(0.9), p99: at(0.99), mean: values.reduce((a, b) => a + b, 0) / values.length };
+};
+
+const peakRssBytes = () => process.resourceUsage().maxRSS * 1024;
+
+const results: BenchResult[] = [];
+for (const weightType of weightTypes) {
+  for (const numThreads of threadCounts) {
+    const loadStart = performance.now();
+    const ctx = await sd.createContext({
+      model,
+      weightType: enumValue(sd.Type, weightType, "weightType"),
+      numThreads,
+      shared: false,
+    });
+    const loadMs = performance.now() - loadStart;
+
+    for (const [width, height] of sizes) {
+      for (const sampleSteps of stepCounts) {
+        for (const sampler of samplers) {
+          for (const batchCount of batchCounts) {
+            const sampleMethod = enumValue(sd.SampleMethod, sampler, "sampler");
+            const timings: JobTiming[] = [];
+            let elapsedMs = 0;
+            for (let i = 0; i < warmup + repeat; i++) {
+              const start = performance.now();
+              const images = await ctx.txt2img({
+                prompt,
+                width,
+                height,
+                sampleSteps,
+                sampleMethod,
+                batchCount,
+                seed,
+                onTiming: (timing) => {
+                  if (i >= warmup) timings.push(timing);
+                },
+              });
+              if (i >= warmup) {
+                elapsedMs += performance.now() - start;
+              }
+              if (images.length !== batchCount) {
+                throw new Error(`Expected ${batchCount} images, got ${images.length}`);
+              }
+            }
+
+            const config = { width, height, sampleSteps, sampleMethod: sampler, weightType, numThreads, batchCount };
+            const result: BenchResult = {
+              key: `${width}x${height} steps=${sampleSteps} ${sampler} ${weightType} t=${numThreads} b=${batchCount}`,
+              config,
+              loadMs,
+              firstStepMs: percentiles(
+                timings.map(
+                  (t) => t.queueWaitMs + t.stages.setup + t.stages.encode + t.stages.conditioning + (t.stepMs[0] ?? 0),
+                ),
+              ),
+              stepMs: percentiles(timings.flatMap((t) => t.stepMs)),
+              imagesPerSec: (repeat * batchCount * 1000) / elapsedMs,
+              marshalMs: percentiles(timings.map((t) => t.stages.marshal)),
+              peakRssBytes: peakRssBytes(),
+            };
+            results.push(result);
+            console.info(
+              `${result.key}: ${result.imagesPerSec.toFixed(3)} img/s, step p50 ${result.stepMs.p50.toFixed(1)} ms, p90 ${result.stepMs.p90.toFixed(1)} ms`,
+            );
+          }
+        }
+      }
+    }
+
+    await ctx.dispose();
+  }
+}
+
+const report: BenchReport = {
+  meta: {
+    model,
+    prompt,
+    date: new Date().toISOString(),
+    node: process.version,
+    platform: `${os.platform()} ${os.arch()}`,
+    cpu: os.cpus()[0]?.model ?? "unknown",
+    systemInfo: sd.getSystemInfo().trim(),
+  },
+  results,
+};
+
+const json = JSON.stringify(report, null, 2);
+if (args.values.output) {
+  await writeFile(args.values.output, json);
+  console.info(`Wrote ${args.values.output}`);
+} else {
+  console.log(json);
+}
+
+if (args.values.baseline) {
+  const baseline = JSON.parse(await readFile(args.values.baseline, "utf8")) as BenchReport;
+  const baseByKey = new Map(baseline.results.map((r) => [r.key, r]));
+
+  // lower is better for every metric except throughput
+  const metrics: [string, (r: BenchResult) => number, boolean][] = [
+    ["loadMs", (r) => r.loadMs, false],
+    ["firstStepMs.p50", (r) => r.firstStepMs.p50, false],
+    ["stepMs.p50", (r) => r.stepMs.p50, false],
+    ["stepMs.p90", (r) => r.stepMs.p90, false],
+    ["marshalMs.p50", (r) => r.marshalMs.p50, false],
+    ["imagesPerSec", (r) => r.imagesPerSec, true],
+  ];
+
+  let regressions = 0;
+  for (const result of results) {
+    const base = baseByKey.get(result.key);
+    if (!base) {
+      console.info(`${result.key}: not in baseline`);
+      continue;
+    }
+
+    for (const [name, get, higherIsBetter] of metrics) {
+      const before = get(base);
+      const after = get(result);
+      if (before <= 0) continue;
+      const change = (after - before) / before;
+      const regressed = higherIsBetter ? change < -threshold : change > threshold;
+      if (regressed) {
+        regressions++;
+        console.error(`${result.key}: ${name} regressed ${before.toFixed(2)} -> ${after.toFixed(2)} (${(change * 100).toFixed(1)}%)`);
+      }
+    }
+  }
+
+  if (regressions > 0) {
+    console.error(`${regressions} regression(s) beyond ${(threshold * 100).toFixed(0)}%`);
+    process.exit(1);
+  }
+  console.info("No regressions against baseline");
+}
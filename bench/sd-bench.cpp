@@ -0,0 +1,295 @@
+// Native counterpart of bench.ts, runs the same sweep straight against stable-diffusion.cpp without Node
+// so binding overhead can be told apart from upstream changes. Writes the same JSON report to stdout.
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <stable-diffusion.h>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    const char* const sampleMethodNames[] = { "EulerA", "Euler", "Heun", "DPM2", "DPMPP2SA", "DPMPP2M", "DPMPP2Mv2", "LCM", "IPNDM", "IPNDM_V" };
+
+    struct Percentiles
+    {
+        double p50 = 0;
+        double p90 = 0;
+        double p99 = 0;
+        double mean = 0;
+    };
+
+    Percentiles percentiles(std::vector<double> values)
+    {
+        Percentiles ret;
+        if (values.empty())
+            return ret;
+
+        std::sort(values.begin(), values.end());
+        const auto at = [&](double p) { return values[std::min(values.size() - 1, size_t(p * values.size()))]; };
+        ret.p50 = at(0.5);
+        ret.p90 = at(0.9);
+        ret.p99 = at(0.99);
+        for (const auto v : values)
+            ret.mean += v;
+        ret.mean /= values.size();
+        return ret;
+    }
+
+    size_t peakRssBytes()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters{};
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.PeakWorkingSetSize;
+#else
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return size_t(usage.ru_maxrss);
+#else
+        return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+    }
+
+    std::vector<std::string> split(const std::string& value)
+    {
+        std::vector<std::string> ret;
+        size_t start = 0;
+        while (start <= value.size())
+        {
+            const auto end = std::min(value.find(',', start), value.size());
+            if (end > start)
+                ret.push_back(value.substr(start, end - start));
+            start = end + 1;
+        }
+        return ret;
+    }
+
+    std::vector<int> splitInts(const std::string& value)
+    {
+        std::vector<int> ret;
+        for (const auto& v : split(value))
+            ret.push_back(std::atoi(v.c_str()));
+        return ret;
+    }
+
+    bool equalsIgnoreCase(const std::string& a, const char* b)
+    {
+        return a.size() == strlen(b) && std::equal(a.begin(), a.end(), b, [](char x, char y) { return tolower(x) == tolower(y); });
+    }
+
+    int sampleMethodFromName(const std::string& name)
+    {
+        for (int i = 0; i < int(std::size(sampleMethodNames)); i++)
+        {
+            if (equalsIgnoreCase(name, sampleMethodNames[i]))
+                return i;
+        }
+        fprintf(stderr, "Unknown sampler %s\n", name.c_str());
+        exit(1);
+    }
+
+    int weightTypeFromName(const std::string& name)
+    {
+        for (int i = 0; i < SD_TYPE_COUNT; i++)
+        {
+            const auto typeName = sd_type_name(sd_type_t(i));
+            if (typeName && equalsIgnoreCase(name, typeName))
+                return i;
+        }
+        fprintf(stderr, "Unknown weightType %s\n", name.c_str());
+        exit(1);
+    }
+
+    void printPercentiles(const char* name, const Percentiles& p)
+    {
+        printf("      \"%s\": { \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"mean\": %.3f },\n", name, p.p50, p.p90, p.p99, p.mean);
+    }
+
+    std::string jsonEscape(const std::string& value)
+    {
+        std::string ret;
+        for (const auto c : value)
+        {
+            if (c == '"' || c == '\\')
+                ret += '\\';
+            if (c == '\n')
+                ret += "\\n";
+            else if (c != '\r')
+                ret += c;
+        }
+        return ret;
+    }
+
+    struct RunState
+    {
+        Clock::time_point start;
+        std::vector<double> firstStepMs;
+        std::vector<double> stepMs;
+        bool recording = false;
+        bool sawStep = false;
+    };
+
+    RunState state;
+
+    void onProgress(int step, int steps, float time, void*)
+    {
+        if (!state.recording || step <= 0)
+            return;
+
+        if (!state.sawStep)
+        {
+            state.sawStep = true;
+            state.firstStepMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - state.start).count());
+        }
+        state.stepMs.push_back(time * 1000.0);
+    }
+
+    void onLog(sd_log_level_t level, const char* text, void*)
+    {
+        if (level >= SD_LOG_WARN)
+            fputs(text, stderr);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string model;
+    std::string prompt = "a picture of a dog";
+    std::string sizes = "256x256,512x512";
+    std::string steps = "4,20";
+    std::string samplers = "EulerA";
+    std::string weightTypes = "F16";
+    std::string threads = std::to_string(get_num_physical_cores());
+    std::string batch = "1";
+    int64_t seed = 42;
+    int repeat = 3;
+    int warmup = 1;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+        if (arg == "--model") model = value;
+        else if (arg == "--prompt") prompt = value;
+        else if (arg == "--sizes") sizes = value;
+        else if (arg == "--steps") steps = value;
+        else if (arg == "--samplers") samplers = value;
+        else if (arg == "--weightTypes") weightTypes = value;
+        else if (arg == "--threads") threads = value;
+        else if (arg == "--batch") batch = value;
+        else if (arg == "--seed") seed = std::atoll(value.c_str());
+        else if (arg == "--repeat") repeat = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--warmup") warmup = std::max(0, std::atoi(value.c_str()));
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (model.empty())
+    {
+        fprintf(stderr, "Missing --model\n");
+        return 1;
+    }
+
+    sd_set_log_callback(&onLog, nullptr);
+    sd_set_progress_callback(&onProgress, nullptr);
+
+    printf("{\n  \"meta\": {\n");
+    printf("    \"model\": \"%s\",\n", jsonEscape(model).c_str());
+    printf("    \"prompt\": \"%s\",\n", jsonEscape(prompt).c_str());
+    printf("    \"runner\": \"sd-bench\",\n");
+    printf("    \"systemInfo\": \"%s\"\n", jsonEscape(sd_get_system_info()).c_str());
+    printf("  },\n  \"results\": [");
+
+    bool first = true;
+    for (const auto& weightType : split(weightTypes))
+    {
+        for (const auto numThreads : splitInts(threads))
+        {
+            const auto loadStart = Clock::now();
+            const auto sdCtx = new_sd_ctx(model.c_str(), "", "", "", "", "", "", "", "", "", "", false, false, false, numThreads,
+                sd_type_t(weightTypeFromName(weightType)), STD_DEFAULT_RNG, DEFAULT, false, false, false);
+            const auto loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+            if (!sdCtx)
+            {
+                fprintf(stderr, "Context creation failed\n");
+                return 1;
+            }
+
+            for (const auto& size : split(sizes))
+            {
+                const auto x = size.find('x');
+                const int width = std::atoi(size.substr(0, x).c_str());
+                const int height = x == std::string::npos ? width : std::atoi(size.substr(x + 1).c_str());
+                for (const auto sampleSteps : splitInts(steps))
+                {
+                    for (const auto& sampler : split(samplers))
+                    {
+                        for (const auto batchCount : splitInts(batch))
+                        {
+                            const auto sampleMethod = sample_method_t(sampleMethodFromName(sampler));
+                            state = {};
+                            double elapsedMs = 0;
+                            for (int i = 0; i < warmup + repeat; i++)
+                            {
+                                state.recording = i >= warmup;
+                                state.sawStep = false;
+                                state.start = Clock::now();
+                                const auto images = txt2img(sdCtx, prompt.c_str(), "", -1, 7.0f, 0.0f, width, height, sampleMethod, sampleSteps, seed, batchCount, nullptr, 0.0f, 20.0f, false, "");
+                                if (state.recording)
+                                    elapsedMs += std::chrono::duration<double, std::milli>(Clock::now() - state.start).count();
+
+                                if (!images)
+                                {
+                                    fprintf(stderr, "txt2img failed\n");
+                                    return 1;
+                                }
+                                for (int b = 0; b < batchCount; b++)
+                                    free(images[b].data);
+                                free(images);
+                            }
+
+                            printf("%s\n    {\n", first ? "" : ",");
+                            first = false;
+                            printf("      \"key\": \"%dx%d steps=%d %s %s t=%d b=%d\",\n", width, height, sampleSteps, sampler.c_str(), weightType.c_str(), numThreads, batchCount);
+                            printf("      \"config\": { \"width\": %d, \"height\": %d, \"sampleSteps\": %d, \"sampleMethod\": \"%s\", \"weightType\": \"%s\", \"numThreads\": %d, \"batchCount\": %d },\n",
+                                width, height, sampleSteps, sampler.c_str(), weightType.c_str(), numThreads, batchCount);
+                            printf("      \"loadMs\": %.3f,\n", loadMs);
+                            printPercentiles("firstStepMs", percentiles(state.firstStepMs));
+                            printPercentiles("stepMs", percentiles(state.stepMs));
+                            printf("      \"imagesPerSec\": %.5f,\n", repeat * batchCount * 1000.0 / elapsedMs);
+                            printPercentiles("marshalMs", {});
+                            printf("      \"peakRssBytes\": %zu\n    }", peakRssBytes());
+                            fflush(stdout);
+                        }
+                    }
+                }
+            }
+
+            free_sd_ctx(sdCtx);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
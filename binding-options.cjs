@@ -1,4 +1,6 @@
 module.exports = {
   name: "node-stable-diffusion-cpp",
   napi_versions: [9],
+  // prebuilt CPU tiers named <name>-<variant>, fastest first, the plain binary is the baseline
+  cpu_variants: ["avx512vnni", "avx512", "avx2"],
 };
@@ -62,61 +62,218 @@ declare module "@lmagder/node-stable-diffusion-cpp" {
     data: Buffer;
   }>;
 
+  export type EncodedImage = Readonly<{
+    width: number;
+    height: number;
+    channel: 3 | 4;
+    format: "png" | "jpeg" | "webp";
+    data: Buffer;
+  }>;
+
+  export type BatchLayout = "separate" | "contiguous" | "shared";
+
+  export type OutputOptions =
+    | { format: "raw"; layout?: BatchLayout }
+    | { format: "png"; layout?: "separate" | "contiguous" }
+    | { format: "jpeg"; quality?: number; layout?: "separate" | "contiguous" }
+    | { format: "webp"; quality?: number; lossless?: boolean; layout?: "separate" | "contiguous" };
+
+  export type OutputImage<P> = P extends { output: { format: "png" | "jpeg" | "webp" } } ? EncodedImage : Image;
+
+  export type PackedBatch<I> = Readonly<{
+    buffer: ArrayBuffer | SharedArrayBuffer;
+    stride: number;
+    images: ReadonlyArray<I>;
+  }>;
+
+  export type OutputBatch<P> = P extends { output: { layout: "contiguous" | "shared" } }
+    ? PackedBatch<OutputImage<P>>
+    : OutputImage<P>[];
+
+  export type Txt2ImgParams = {
+    prompt: string;
+    negativePrompt?: string;
+    clipSkip?: number;
+    cfgScale?: number;
+    guidance?: number;
+    width?: number;
+    height?: number;
+    sampleMethod?: SampleMethod;
+    sampleSteps?: number;
+    seed?: number;
+    batchCount?: number;
+    controlCond?: Image;
+    controlStrength?: number;
+    styleRatio?: number;
+    normalizeInput?: boolean;
+    inputIdImagesPath?: string;
+    copyInputs?: boolean;
+    signal?: AbortSignal;
+    priority?: number;
+    onTiming?: (timing: JobTiming) => void;
+    output?: OutputOptions;
+  };
+
+  export type Img2ImgParams = {
+    initImage: Image;
+    prompt: string;
+    negativePrompt?: string;
+    clipSkip?: number;
+    cfgScale?: number;
+    guidance?: number;
+    width?: number;
+    height?: number;
+    sampleMethod?: SampleMethod;
+    sampleSteps?: number;
+    strength?: number;
+    seed?: number;
+    batchCount?: number;
+    controlCond?: Image;
+    controlStrength?: number;
+    styleRatio?: number;
+    normalizeInput?: boolean;
+    inputIdImagesPath?: string;
+    copyInputs?: boolean;
+    signal?: AbortSignal;
+    priority?: number;
+    onTiming?: (timing: JobTiming) => void;
+    output?: OutputOptions;
+  };
+
+  export type Img2VidParams = {
+    initImage: Image;
+    width?: number;
+    height?: number;
+    videoFrames?: number;
+    motionBucketId?: number;
+    fps?: number;
+    augmentationLevel?: number;
+    minCfg?: number;
+    cfgScale?: number;
+    sampleMethod?: SampleMethod;
+    sampleSteps?: number;
+    strength?: number;
+    seed?: number;
+    copyInputs?: boolean;
+    signal?: AbortSignal;
+    priority?: number;
+    onTiming?: (timing: JobTiming) => void;
+    output?: OutputOptions;
+  };
+
+  export type TimingStage = "setup" | "encode" | "conditioning" | "sampling" | "decode" | "upscale" | "compress" | "marshal";
+
+  export type JobTiming = Readonly<{
+    kind: "createContext" | "createUpscaler" | "preload" | "dispose" | "transfer" | "autotune" | "warmup" | "preloadLoras" | "txt2img" | "img2img" | "img2vid" | "upscale";
+    status: "ok" | "error" | "aborted";
+    backend: "cpu" | "cuda" | "vulkan";
+    threads: number;
+    queueWaitMs: number;
+    runMs: number;
+    totalMs: number;
+    stages: Readonly<Record<TimingStage, number>>;
+    stepMs: number[];
+  }>;
+
+  export type WarmupShape = {
+    width?: number;
+    height?: number;
+    batchCount?: number;
+    sampleMethod?: SampleMethod;
+    controlNet?: boolean;
+  };
+
+  export type WarmupParams = {
+    shapes: WarmupShape[];
+    prompt?: string;
+    sampleSteps?: number;
+    signal?: AbortSignal;
+    priority?: number;
+    onTiming?: (timing: JobTiming) => void;
+  };
+
+  export type WarmupReport = Readonly<{
+    totalMs: number;
+    computeBytes: number;
+    shapes: readonly Readonly<{
+      width: number;
+      height: number;
+      batchCount: number;
+      sampleMethod: SampleMethod;
+      controlNet: boolean;
+      ms: number;
+      computeBytes: number;
+      components: Readonly<Record<string, number>>;
+    }>[];
+  }>;
+
+  export type LoraSet = Record<string, number>;
+
+  export type LoraCacheOptions = {
+    maxSets?: number;
+    memoryLimit?: number;
+  };
+
+  export type LoraCacheStats = Readonly<{
+    sets: readonly Readonly<LoraSet>[];
+    weightBytes: number;
+    hits: number;
+    misses: number;
+    loads: number;
+    maxSets: number;
+    memoryLimit: number;
+  }>;
+
+  export type StreamOptions = {
+    highWaterMark?: number;
+  };
+
+  export type PipelineUpscale = {
+    upscaler: Upscaler;
+    factor?: number;
+    tile?: { size?: number; overlap?: number };
+  };
+
+  export type LogLevel = "error" | "warn" | "info" | "debug";
+
+  export type LogOptions = {
+    logLevel?: LogLevel;
+    logFlushInterval?: number;
+    logBufferSize?: number;
+  };
+
+  export type LogStats = Readonly<{
+    delivered: number;
+    dropped: number;
+  }>;
+
+  export type ContextMemoryStats = Readonly<{
+    weightBytes: number;
+    measured: boolean;
+    weights: Readonly<Record<string, number>>;
+    computePeaks: Readonly<{ component: string; width: number; height: number; bytes: number }>[];
+  }>;
+
   export type Context = Readonly<{
+    getLogStats: () => LogStats | undefined;
+    getMemoryStats: () => ContextMemoryStats | undefined;
+    getLoraCacheStats: () => LoraCacheStats | undefined;
+    preloadLoras: (
+      sets: LoraSet[],
+      options?: { signal?: AbortSignal; priority?: number; onTiming?: (timing: JobTiming) => void }
+    ) => Promise<LoraCacheStats>;
     dispose: () => Promise<void>;
-    txt2img: (params: {
-      prompt: string;
-      negativePrompt?: string;
-      clipSkip?: number;
-      cfgScale?: number;
-      guidance?: number;
-      width?: number;
-      height?: number;
-      sampleMethod?: SampleMethod;
-      sampleSteps?: number;
-      seed?: number;
-      batchCount?: number;
-      controlCond?: Image;
-      controlStrength?: number;
-      styleRatio?: number;
-      normalizeInput?: boolean;
-      inputIdImagesPath?: string;
-    }) => Promise<Image[]>;
-    img2img: (params: {
-      initImage: Image;
-      prompt: string;
-      negativePrompt?: string;
-      clipSkip?: number;
-      cfgScale?: number;
-      guidance?: number;
-      width?: number;
-      height?: number;
-      sampleMethod?: SampleMethod;
-      sampleSteps?: number;
-      strength?: number;
-      seed?: number;
-      batchCount?: number;
-      controlCond?: Image;
-      controlStrength?: number;
-      styleRatio?: number;
-      normalizeInput?: boolean;
-      inputIdImagesPath?: string;
-    }) => Promise<Image[]>;
-    img2vid: (params: {
-      initImage: Image;
-      width?: number;
-      height?: number;
-      videoFrames?: number;
-      motionBucketId?: number;
-      fps?: number;
-      augmentationLevel?: number;
-      minCfg?: number;
-      cfgScale?: number;
-      sampleMethod?: SampleMethod;
-      sampleSteps?: number;
-      strength?: number;
-      seed?: number;
-    }) => Promise<Image[]>;
+    transfer: () => Promise<number>;
+    txt2img: <P extends Txt2ImgParams>(params: P) => Promise<OutputBatch<P>>;
+    txt2imgStream: <P extends Txt2ImgParams & StreamOptions>(params: P) => AsyncIterableIterator<OutputImage<P>>;
+    txt2imgPipeline: <P extends Txt2ImgParams & StreamOptions & { upscale?: PipelineUpscale }>(
+      params: P
+    ) => AsyncIterableIterator<OutputImage<P>>;
+    img2img: <P extends Img2ImgParams>(params: P) => Promise<OutputBatch<P>>;
+    img2imgStream: <P extends Img2ImgParams & StreamOptions>(params: P) => AsyncIterableIterator<OutputImage<P>>;
+    img2vid: <P extends Img2VidParams>(params: P) => Promise<OutputBatch<P>>;
+    warmup: (params: WarmupParams) => Promise<WarmupReport>;
+    img2vidStream: <P extends Img2VidParams & StreamOptions>(params: P) => AsyncIterableIterator<OutputImage<P>>;
   }>;
 
   export const createContext: (
@@ -135,32 +292,236 @@ declare module "@lmagder/node-stable-diffusion-cpp" {
       vaeDecodeOnly?: boolean;
       vaeTiling?: boolean;
       freeParamsImmediately?: boolean;
-      numThreads?: number;
+      numThreads?: number | "auto";
+      autotuneProfile?: string;
       weightType?: Type;
+      /**
+       * Directory that keeps the weights converted to weightType, keyed by a hash of the full source file. Later
+       * loads skip the conversion, but the converted file is still read completely into memory, it isn't mapped.
+       * The full hash is stored and reused while the source keeps its path, size and modification time and 16
+       * sampled blocks of it still match. Clear the directory if a model is replaced by one of the same size
+       * without a new modification time.
+       */
+      weightCache?: string;
+      /**
+       * Keeps up to maxSets LoRA sets merged at once. Each set beyond the first is held by a private copy of the
+       * model's weights, loaded the first time a prompt asks for the set while the copy fits into memoryLimit and
+       * the memory budget. Once full, a new set replaces the least recently used one.
+       */
+      loraCache?: LoraCacheOptions;
       cudaRng?: boolean;
       schedule?: Schedule;
       keepClipOnCpu?: boolean;
       keepControlNetOnCpu?: boolean;
       keepVaeOnCpu?: boolean;
-    },
-    logCallback?: (level: "error" | "warn" | "info" | "debug", msg: string) => void,
+      shared?: boolean;
+      cpuAffinity?: number[];
+      numaNode?: number;
+      /**
+       * Milliseconds to hold txt2img calls so they can share one batched run. Only calls with the same prompt,
+       * negative prompt and every other param except the seed are merged, and only when their seed ranges touch
+       * or overlap. Calls with a negative (random) seed or with different prompts are never batched together.
+       */
+      coalesceWindow?: number;
+      onTiming?: (timing: JobTiming) => void;
+    } & LogOptions,
+    logCallback?: (level: LogLevel, msg: string) => void,
     progressCallback?: (step: number, steps: number, time: number) => void
   ) => Promise<Context>;
 
+  export const adoptContext: (
+    token: number,
+    logCallback?: (level: LogLevel, msg: string) => void,
+    progressCallback?: (step: number, steps: number, time: number) => void,
+    options?: LogOptions & { coalesceWindow?: number; onTiming?: (timing: JobTiming) => void }
+  ) => Context;
+
+  export type ModelParams = Omit<Parameters<typeof createContext>[0], "onTiming" | "coalesceWindow" | "loraCache" | keyof LogOptions>;
+
+  export type ModelCacheStats = Readonly<{
+    entries: number;
+    inUse: number;
+    pinned: number;
+    bytes: number;
+    memoryBudget: number;
+    hits: number;
+    misses: number;
+    evictions: number;
+  }>;
+
+  export const preloadModel: (params: ModelParams) => Promise<void>;
+  export const evictModel: (params?: ModelParams) => number;
+  export const getModelCacheStats: () => ModelCacheStats;
+  export const configureModelCache: (params: { memoryBudget?: number }) => ModelCacheStats;
+
+  export type UpscaleOptions = {
+    copyInputs?: boolean;
+    signal?: AbortSignal;
+    priority?: number;
+    onTiming?: (timing: JobTiming) => void;
+    output?: OutputOptions;
+    tile?: { size?: number; overlap?: number };
+  };
+
+  export type ImageRows = Readonly<{
+    y: number;
+    width: number;
+    height: number;
+    channel: 3 | 4;
+    data: Buffer;
+  }>;
+
   export type Upscaler = Readonly<{
+    getLogStats: () => LogStats | undefined;
+    getMemoryStats: () => ContextMemoryStats | undefined;
     dispose: () => Promise<void>;
-    upscale: (inputImage: Image, upscaleFactor: number) => Promise<Image>;
+    transfer: () => Promise<number>;
+    upscale: <O extends UpscaleOptions = {}>(inputImage: Image, upscaleFactor: number, options?: O) => Promise<OutputImage<O>>;
+    upscaleBatch: <O extends Omit<UpscaleOptions, "tile"> = {}>(
+      inputImages: readonly Image[],
+      upscaleFactor: number,
+      options?: O
+    ) => Promise<OutputImage<O>[]>;
+    upscaleBatchStream: <O extends Omit<UpscaleOptions, "tile"> & StreamOptions & { chunkSize?: number } = {}>(
+      inputImages: readonly Image[],
+      upscaleFactor: number,
+      options?: O
+    ) => AsyncIterableIterator<OutputImage<O>>;
+    upscaleStream: (
+      inputImage: Image,
+      upscaleFactor: number,
+      options?: Omit<UpscaleOptions, "output"> & StreamOptions
+    ) => AsyncIterableIterator<ImageRows>;
   }>;
 
   export const createUpscaler: (
     esrganPath: string,
-    numThreads?: number,
+    numThreads?: number | "auto",
     weightType?: Type,
-    logCallback?: (level: "error" | "warn" | "info" | "debug", msg: string) => void,
-    progressCallback?: (step: number, steps: number, time: number) => void
+    logCallback?: (level: LogLevel, msg: string) => void,
+    progressCallback?: (step: number, steps: number, time: number) => void,
+    options?: LogOptions & { onTiming?: (timing: JobTiming) => void; autotuneProfile?: string; cpuAffinity?: number[]; numaNode?: number; lanes?: number }
   ) => Promise<Upscaler>;
 
+  export const adoptUpscaler: (
+    token: number,
+    logCallback?: (level: LogLevel, msg: string) => void,
+    progressCallback?: (step: number, steps: number, time: number) => void,
+    options?: LogOptions & { onTiming?: (timing: JobTiming) => void }
+  ) => Upscaler;
+
+  export type SchedulerStats = Readonly<{
+    workerThreads: number;
+    threadBudget: number;
+    threadsInUse: number;
+    running: number;
+    queued: number;
+    ready: number;
+    maxQueueDepth: number;
+    started: number;
+    rejected: number;
+    lastWaitMs: number;
+    meanWaitMs: number;
+    maxWaitMs: number;
+  }>;
+
+  export const getSchedulerStats: () => SchedulerStats;
+  export const configureScheduler: (params: {
+    workerThreads?: number;
+    threadBudget?: number;
+    maxQueueDepth?: number;
+  }) => SchedulerStats;
+
+  export type LatencyHistogram = Readonly<{
+    count: number;
+    sumMs: number;
+    meanMs: number;
+    p50: number;
+    p90: number;
+    p99: number;
+    p999: number;
+    maxMs: number;
+  }>;
+
+  export type JobOutcomes = Readonly<{ ok: number; error: number; aborted: number; rejected: number }>;
+
+  export type Metrics = Readonly<{
+    jobs: Readonly<Record<JobTiming["kind"] | "internal", JobOutcomes>>;
+    queueWaitMs: LatencyHistogram;
+    runMs: LatencyHistogram;
+    stepMs: LatencyHistogram;
+    images: number;
+    pixels: number;
+    imageBytes: Readonly<{ inputCopied: number; inputBorrowed: number; outputCopied: number; outputWrapped: number }>;
+    events: Readonly<{ logDelivered: number; progressDelivered: number; dropped: number }>;
+    contexts: readonly Readonly<{ id: number; queued: number; running: number }>[];
+  }>;
+
+  export const getMetrics: () => Metrics;
+  export const getPrometheusMetrics: () => string;
+
+  export const startTrace: (options?: { maxEventsPerThread?: number }) => void;
+  export const stopTrace: () => string;
+
+  export type MemoryStats = Readonly<{
+    weightBytes: number;
+    resultBytes: number;
+    reservedBytes: number;
+    budget: number;
+    overBudget: "wait" | "reject";
+    contexts: number;
+    delayed: number;
+    rejected: number;
+  }>;
+
+  export const getMemoryStats: () => MemoryStats;
+  export const configureMemory: (params: { budget?: number; overBudget?: "wait" | "reject" }) => MemoryStats;
+
+  export type ThreadMeasurement = Readonly<{
+    threads: number;
+    stepMs: number;
+    decodeMs: number;
+    upscaleMs: number;
+  }>;
+
+  export type ThreadProfile = Readonly<{
+    cpu: string;
+    weightType: string;
+    numThreads: number;
+    samplingThreads: number;
+    decodeThreads: number;
+    upscaleThreads: number;
+    measurements: readonly ThreadMeasurement[];
+  }>;
+
+  export type AutotuneParams = ModelParams &
+    LogOptions & {
+      upscaler?: string;
+      threads?: number[];
+      width?: number;
+      height?: number;
+      sampleSteps?: number;
+      targetSteps?: number;
+    };
+
+  export const autotune: (
+    params: AutotuneParams,
+    logCallback?: (level: LogLevel, msg: string) => void,
+    progressCallback?: (step: number, steps: number, time: number) => void
+  ) => Promise<ThreadProfile>;
+  export const getThreadProfile: (weightType: Type, autotuneProfile?: string) => ThreadProfile | undefined;
+
+  export type CpuTopology = Readonly<{
+    cpu: string;
+    logicalCpus: number;
+    physicalCores: number;
+    sockets: readonly Readonly<{ id: number; cpus: readonly number[] }>[];
+    numaNodes: readonly Readonly<{ id: number; cpus: readonly number[]; memoryBytes: number }>[];
+    cores: readonly Readonly<{ socket: number; numaNode: number; cpus: readonly number[] }>[];
+  }>;
+
   export const getSystemInfo: () => string;
   export const getNumPhysicalCores: () => number;
+  export const getCpuTopology: () => CpuTopology;
   export const weightTypeName: (weightType: number) => string;
 }
@@ -3,4 +3,23 @@ import { dirname } from "node:path";
 import { fileURLToPath } from "node:url";
 
 const require = createRequire(import.meta.url);
-export default require("pkg-prebuilds")(dirname(fileURLToPath(import.meta.url)), require("./binding-options.cjs"));
+const loadBinding = require("pkg-prebuilds");
+const baseDir = dirname(fileURLToPath(import.meta.url));
+const options = require("./binding-options.cjs");
+
+// Each CPU tier refuses to load on a host that can't run it, so the first one that loads is the fastest that fits.
+// NODE_SD_CPU_VARIANT picks one explicitly, an empty value the plain binary.
+const load = () => {
+  const forced = process.env.NODE_SD_CPU_VARIANT;
+  const variants = forced === undefined ? options.cpu_variants : forced ? [forced] : [];
+  for (const variant of variants) {
+    try {
+      return loadBinding(baseDir, { ...options, name: `${options.name}-${variant}` });
+    } catch (e) {
+      if (forced) throw e;
+    }
+  }
+  return loadBinding(baseDir, options);
+};
+
+export default load();
@@ -0,0 +1,26 @@
+// Copies the addon in build/Release into prebuilds/ under the name of its CPU tier, see NODE_SD_CPU_VARIANT in
+// CMakeLists.txt. A build without a tier is tuned to the machine that built it and is refused.
+const { execFileSync } = require("node:child_process");
+const { readFileSync } = require("node:fs");
+const path = require("node:path");
+const options = require("./binding-options.cjs");
+
+const baseDir = path.join("build", "Release");
+let variant;
+try {
+  variant = readFileSync(path.join(baseDir, "cpu_variant.txt"), "utf8").trim();
+} catch {
+  variant = "native";
+}
+
+if (variant !== "baseline" && !options.cpu_variants.includes(variant)) {
+  console.error(`Refusing to package a ${variant} build, configure it with NODE_SD_CPU_VARIANT set to baseline or one of ${options.cpu_variants.join(", ")}`);
+  process.exit(1);
+}
+
+const name = variant === "baseline" ? options.name : `${options.name}-${variant}`;
+execFileSync(
+  "npx",
+  ["pkg-prebuilds-copy", "--baseDir", baseDir, "--source", `${name}.node`, `--name=${name}`, "--strip", `--napi_version=${options.napi_versions[0]}`, "--extraFiles=cuda_version.json"],
+  { stdio: "inherit", shell: process.platform === "win32" }
+);
@@ -1,261 +1,5982 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <random>
+#include <regex>
+#include <thread>
 #include <type_traits>
+#include <unordered_map>
 
 #include <napi.h>
 #include <ggml.h>
 #include <stable-diffusion.h>
 
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+#include <json.hpp>
+
+#ifdef NODE_SD_WEBP
+#include <webp/encode.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef NODE_SD_BACKEND
+#define NODE_SD_BACKEND "cpu"
+#endif
+
+// Set for the prebuilt CPU tiers, see NODE_SD_CPU_VARIANT in CMakeLists.txt
+#ifndef NODE_SD_CPU_VARIANT
+#define NODE_SD_CPU_VARIANT "native"
+#endif
+
+#ifdef NODE_SD_WRAP_GGML_INIT
+// Resolved by the linker through --wrap, see CMakeLists.txt
+extern "C" ggml_context* __real_ggml_init(ggml_init_params params);
+extern "C" void __real_ggml_free(ggml_context* ctx);
+#endif
+
 namespace
 {
 
-    struct callJsLogArgs
+    using Clock = std::chrono::steady_clock;
+
+    // Bounded multi producer, single consumer queue. Every slot carries a sequence number that tells producers
+    // whether it is free for their lap around the ring, so pushing never takes a lock and fails when full.
+    template <typename T>
+    class MpscRing
     {
-        sd_log_level_t level = SD_LOG_DEBUG;
-        std::string text;
+        struct Slot
+        {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Slot[]> slots;
+        size_t mask;
+        alignas(64) std::atomic<size_t> head = 0;
+        alignas(64) size_t tail = 0;
+
+    public:
+        explicit MpscRing(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+
+            slots = std::make_unique<Slot[]>(size);
+            mask = size - 1;
+            for (size_t i = 0; i < size; i++)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        bool TryPush(T&& value)
+        {
+            auto pos = head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                auto& slot = slots[pos & mask];
+                const auto diff = intptr_t(slot.sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.value = std::move(value);
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Only ever called from one thread
+        bool TryPop(T& value)
+        {
+            auto& slot = slots[tail & mask];
+            if (intptr_t(slot.sequence.load(std::memory_order_acquire)) - intptr_t(tail + 1) < 0)
+                return false;
+
+            value = std::move(slot.value);
+            slot.sequence.store(tail + mask + 1, std::memory_order_release);
+            tail++;
+            return true;
+        }
     };
 
-    void callJsLog(Napi::Env env, Napi::Function callback, std::nullptr_t*, callJsLogArgs* data)
+    // A thread safe function is freed with its env, which for a worker thread can happen while jobs are still
+    // running. Calls from other threads go through the gate, which the finalizer closes before that happens.
+    class TsfnGate
     {
-        auto dataPtr = std::unique_ptr<callJsLogArgs>(data);
-        Napi::HandleScope hs(env);
-        Napi::String logLevel;
-        switch (dataPtr->level)
+        std::mutex mutex;
+        bool open = true;
+
+    public:
+        template <typename F>
+        void Call(F&& call)
         {
-            case SD_LOG_ERROR: logLevel = Napi::String::From(env, "error"); break;
-            case SD_LOG_WARN: logLevel = Napi::String::From(env, "warn"); break;
-            case SD_LOG_INFO: logLevel = Napi::String::From(env, "info"); break;
-            case SD_LOG_DEBUG:
-            default: logLevel = Napi::String::From(env, "debug"); break;
+            std::lock_guard lock(mutex);
+            if (open)
+                call();
         }
-        dataPtr->text.erase(dataPtr->text.find_last_not_of("\n\r") + 1);
-        auto text = Napi::String::From(env, dataPtr->text);
-        callback.Call({ logLevel, text });
-    }
 
-    struct callJsProgressArgs
-    {
-        int step = 0;
-        int steps = 0;
-        float time = 0;
+        template <typename Context>
+        static void Close(Napi::Env, std::shared_ptr<TsfnGate>* gate, Context*)
+        {
+            {
+                std::lock_guard lock((*gate)->mutex);
+                (*gate)->open = false;
+            }
+            delete gate;
+        }
     };
 
-    void callJsProgress(Napi::Env env, Napi::Function callback, std::nullptr_t*, callJsProgressArgs* data)
+    // Chrome trace event recorder behind startTrace/stopTrace. Every thread appends to a buffer of its own that
+    // only the collector locks as well, so recording is an uncontended lock and a push and nothing at all while no
+    // trace runs. Timestamps are steady clock microseconds, the monotonic clock V8 stamps --cpu-prof samples with.
+    class Tracer
     {
-        auto dataPtr = std::unique_ptr<callJsProgressArgs>(data);
-        Napi::HandleScope hs(env);
-        callback.Call({ Napi::Number::From(env, dataPtr->step), Napi::Number::From(env, dataPtr->steps) , Napi::Number::From(env, dataPtr->time) });
-    }
+    public:
+        struct Event
+        {
+            // names are always string literals or other static strings
+            const char* name = nullptr;
+            const char* category = nullptr;
+            char phase = 'X';
+            int64_t ts = 0;
+            int64_t dur = 0;
+            uint64_t id = 0;
+            const char* argName = nullptr;
+            int64_t arg = 0;
+        };
 
-    struct CPPContextData : public std::enable_shared_from_this<CPPContextData>
-    {
-        std::shared_ptr<sd_ctx_t> sdCtx;
-        std::shared_ptr<upscaler_ctx_t> upscalerCtx;
-        Napi::TypedThreadSafeFunction<std::nullptr_t, callJsLogArgs, callJsLog> logCallback;
-        Napi::TypedThreadSafeFunction<std::nullptr_t, callJsProgressArgs, callJsProgress> progressCallback;
-        std::vector<std::unique_ptr<Napi::AsyncWorker>> pendingTasks;
+    private:
+        struct ThreadBuffer
+        {
+            std::mutex mutex;
+            uint64_t tid = 0;
+            const char* name = nullptr;
+            std::vector<Event> events;
+            uint64_t dropped = 0;
+        };
 
-        CPPContextData() = default;
-        CPPContextData(const CPPContextData& ctx) = delete;
-        CPPContextData(CPPContextData&& ctx) = delete;
-        CPPContextData& operator=(const CPPContextData& ctx) = delete;
-        CPPContextData& operator=(CPPContextData&& ctx) = delete;
+        std::atomic<bool> enabled = false;
+        std::atomic<size_t> maxEventsPerThread = 0;
+        std::atomic<uint64_t> nextId = 1;
+        std::mutex mutex;
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
 
-        ~CPPContextData()
+        Tracer() = default;
+
+        static uint64_t threadId()
         {
-            reset();
+#ifdef _WIN32
+            return GetCurrentThreadId();
+#elif defined(__linux__)
+            return uint64_t(syscall(SYS_gettid));
+#elif defined(__APPLE__)
+            uint64_t tid = 0;
+            pthread_threadid_np(nullptr, &tid);
+            return tid;
+#else
+            return std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
         }
 
-        void nextTask()
+        static uint64_t processId()
         {
-            if (!pendingTasks.empty())
-            {
-                auto begin = pendingTasks.begin();
-                begin->release()->Queue();
-                pendingTasks.erase(begin);
-            }
+#ifdef _WIN32
+            return GetCurrentProcessId();
+#else
+            return uint64_t(getpid());
+#endif
         }
 
-        void reset()
+        ThreadBuffer& threadBuffer()
         {
-            sdCtx.reset();
-            upscalerCtx.reset();
-
-            if (progressCallback)
+            // the list shares ownership so events of a thread that exits mid trace are still collected
+            thread_local std::shared_ptr<ThreadBuffer> buffer;
+            if (!buffer)
             {
-                progressCallback.Abort();
-                progressCallback = {};
+                buffer = std::make_shared<ThreadBuffer>();
+                buffer->tid = threadId();
+                std::lock_guard lock(mutex);
+                buffers.push_back(buffer);
             }
+            return *buffer;
+        }
 
-            if (logCallback)
+        void record(Event&& event)
+        {
+            auto& buffer = threadBuffer();
+            std::lock_guard lock(buffer.mutex);
+            if (buffer.events.size() >= maxEventsPerThread.load(std::memory_order_relaxed))
             {
-                logCallback.Abort();
-                logCallback = {};
+                buffer.dropped++;
+                return;
             }
+            buffer.events.push_back(std::move(event));
         }
-    };
 
-    constinit thread_local CPPContextData* tl_current = nullptr;
+    public:
+        static Tracer& instance()
+        {
+            static auto tracer = new Tracer();
+            return *tracer;
+        }
 
-    void stableDiffusionLogFunc(enum sd_log_level_t level, const char* text, void* data)
-    {
-        const auto ctx = tl_current;
-        if (ctx && ctx->logCallback)
+        static int64_t Micros(Clock::time_point t)
         {
-            ctx->logCallback.BlockingCall(new callJsLogArgs{ .level = level, .text = text });
+            return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
         }
-    }
 
-    void stableDiffusionProgressFunc(int step, int steps, float time, void* data)
-    {
-        const auto ctx = tl_current;
-        if (ctx && ctx->progressCallback)
+        // Pairs the async begin and end of one job across the threads it passes through
+        uint64_t NextId()
         {
-            ctx->progressCallback.BlockingCall(new callJsProgressArgs{ .step = step, .steps = steps, .time = time });
+            return nextId.fetch_add(1, std::memory_order_relaxed);
         }
-    }
 
+        bool Enabled() const
+        {
+            return enabled.load(std::memory_order_relaxed);
+        }
 
-    class freeSdImageList
+        void NameThread(const char* name)
+        {
+            auto& buffer = threadBuffer();
+            std::lock_guard lock(buffer.mutex);
+            buffer.name = name;
+        }
+
+        void Complete(const char* category, const char* name, Clock::time_point start, Clock::time_point end, const char* argName = nullptr, int64_t arg = 0)
+        {
+            if (Enabled())
+                record({ .name = name, .category = category, .phase = 'X', .ts = Micros(start), .dur = Micros(end) - Micros(start), .argName = argName, .arg = arg });
+        }
+
+        void Instant(const char* category, const char* name, const char* argName = nullptr, int64_t arg = 0)
+        {
+            if (Enabled())
+                record({ .name = name, .category = category, .phase = 'i', .ts = Micros(Clock::now()), .argName = argName, .arg = arg });
+        }
+
+        void AsyncBegin(const char* category, const char* name, uint64_t id, Clock::time_point at)
+        {
+            if (Enabled())
+                record({ .name = name, .category = category, .phase = 'b', .ts = Micros(at), .id = id });
+        }
+
+        void AsyncEnd(const char* category, const char* name, uint64_t id)
+        {
+            if (Enabled())
+                record({ .name = name, .category = category, .phase = 'e', .ts = Micros(Clock::now()), .id = id });
+        }
+
+        bool Start(size_t maxEvents)
+        {
+            std::lock_guard lock(mutex);
+            if (Enabled())
+                return false;
+
+            // buffers only the list still holds belong to threads that are gone
+            std::erase_if(buffers, [](const auto& buffer) { return buffer.use_count() == 1; });
+            for (const auto& buffer : buffers)
+            {
+                std::lock_guard bufferLock(buffer->mutex);
+                buffer->events.clear();
+                buffer->dropped = 0;
+            }
+            maxEventsPerThread = maxEvents;
+            enabled = true;
+            return true;
+        }
+
+        // Trace event JSON as Perfetto and chrome://tracing load it, null if no trace was running
+        std::optional<std::string> Stop()
+        {
+            std::lock_guard lock(mutex);
+            if (!enabled.exchange(false))
+                return std::nullopt;
+
+            const auto pid = processId();
+            auto events = nlohmann::json::array();
+            uint64_t dropped = 0;
+            for (const auto& buffer : buffers)
+            {
+                std::lock_guard bufferLock(buffer->mutex);
+                if (buffer->name)
+                    events.push_back({ { "name", "thread_name" }, { "ph", "M" }, { "pid", pid }, { "tid", buffer->tid }, { "args", { { "name", buffer->name } } } });
+
+                for (const auto& e : buffer->events)
+                {
+                    nlohmann::json event = { { "name", e.name }, { "cat", e.category }, { "ph", std::string(1, e.phase) }, { "ts", e.ts }, { "pid", pid }, { "tid", buffer->tid } };
+                    if (e.phase == 'X')
+                        event["dur"] = e.dur;
+                    else if (e.phase == 'i')
+                        event["s"] = "t";
+                    else
+                        event["id"] = e.id;
+                    if (e.argName)
+                        event["args"] = { { e.argName, e.arg } };
+                    events.push_back(std::move(event));
+                }
+                dropped += buffer->dropped;
+                buffer->events = {};
+            }
+
+            const nlohmann::json trace = { { "traceEvents", std::move(events) }, { "displayTimeUnit", "ms" }, { "otherData", { { "droppedEvents", dropped } } } };
+            return trace.dump();
+        }
+    };
+
+    // Latency histogram in microseconds with eight linear buckets per power of two, so like a low precision
+    // HdrHistogram every value lands in a bucket at most 12.5% wide. Recording is a few relaxed atomic adds.
+    class LatencyHistogram
     {
-        size_t imageCount;
     public:
-        freeSdImageList(size_t imageCount) noexcept : imageCount(imageCount) {};
+        static constexpr int subBuckets = 8;
+        static constexpr int bucketCount = subBuckets + (64 - 3) * subBuckets;
 
-
-        void operator()(sd_image_t* ptr) const
+        struct Snapshot
         {
-            if (ptr)
+            std::vector<uint64_t> counts;
+            uint64_t count = 0;
+            uint64_t sumUs = 0;
+            uint64_t maxUs = 0;
+
+            // Middle of the bucket holding the value at rank q, in milliseconds
+            double QuantileMs(double q) const
             {
-                for (size_t i = 0; i < imageCount; i++)
+                const auto rank = uint64_t(std::ceil(q * double(count)));
+                uint64_t seen = 0;
+                for (int i = 0; i < bucketCount; i++)
                 {
-                    free(ptr[i].data);
+                    seen += counts[i];
+                    if (seen >= std::max<uint64_t>(1, rank))
+                        return std::min(double(LowerBound(i) + UpperBound(i)) / 2.0, double(maxUs)) / 1000.0;
                 }
+                return 0;
+            }
 
-                free(ptr);
+            // Exact for powers of two, which is all the Prometheus buckets use
+            uint64_t CountBelow(uint64_t us) const
+            {
+                uint64_t ret = 0;
+                for (int i = 0; i < bucketCount && UpperBound(i) <= us; i++)
+                    ret += counts[i];
+                return ret;
             }
+        };
+
+    private:
+        std::array<std::atomic<uint64_t>, bucketCount> counts{};
+        std::atomic<uint64_t> count = 0;
+        std::atomic<uint64_t> sumUs = 0;
+        std::atomic<uint64_t> maxUs = 0;
+
+    public:
+        static int BucketOf(uint64_t us)
+        {
+            if (us < subBuckets)
+                return int(us);
+
+            const int exponent = std::bit_width(us) - 1;
+            return subBuckets + (exponent - 3) * subBuckets + int((us >> (exponent - 3)) & (subBuckets - 1));
+        }
+
+        static uint64_t LowerBound(int bucket)
+        {
+            if (bucket < subBuckets)
+                return uint64_t(bucket);
+
+            const int exponent = (bucket - subBuckets) / subBuckets + 3;
+            return uint64_t(subBuckets + (bucket - subBuckets) % subBuckets) << (exponent - 3);
+        }
+
+        static uint64_t UpperBound(int bucket)
+        {
+            return bucket + 1 < bucketCount ? LowerBound(bucket + 1) : UINT64_MAX;
+        }
+
+        void Record(Clock::duration d)
+        {
+            const auto us = uint64_t(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+            counts[BucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sumUs.fetch_add(us, std::memory_order_relaxed);
+            for (auto max = maxUs.load(std::memory_order_relaxed); us > max && !maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed);)
+                ;
         }
 
+        Snapshot Read() const
+        {
+            Snapshot ret;
+            ret.counts.resize(bucketCount);
+            for (int i = 0; i < bucketCount; i++)
+            {
+                ret.counts[i] = counts[i].load(std::memory_order_relaxed);
+                ret.count += ret.counts[i];
+            }
+            ret.sumUs = sumUs.load(std::memory_order_relaxed);
+            ret.maxUs = maxUs.load(std::memory_order_relaxed);
+            return ret;
+        }
     };
 
-    class freeSdImage
+    const char* const metricJobKinds[] = { "txt2img", "img2img", "img2vid", "upscale", "createContext", "createUpscaler", "preload", "dispose", "transfer", "autotune", "warmup", "preloadLoras", "internal" };
+    const char* const metricJobOutcomes[] = { "ok", "error", "aborted", "rejected" };
+
+    // Pending and running jobs of one context, owned by the context and listed by Metrics while it lives
+    struct QueueGauge
+    {
+        uint64_t id = 0;
+        std::atomic<size_t> queued = 0;
+        std::atomic<size_t> running = 0;
+    };
+
+    // Process wide counters behind getMetrics, kept with relaxed atomics on whatever thread the event happens
+    class Metrics
     {
+        std::array<std::atomic<uint64_t>, std::size(metricJobKinds) * std::size(metricJobOutcomes)> jobs{};
+        std::mutex mutex;
+        std::vector<std::weak_ptr<QueueGauge>> queues;
+        uint64_t nextQueueId = 1;
+
+        Metrics() = default;
+
+        template <size_t N>
+        static size_t indexOf(const char* const (&names)[N], const char* name)
+        {
+            for (size_t i = 0; i < N; i++)
+            {
+                if (strcmp(names[i], name) == 0)
+                    return i;
+            }
+            return N - 1;
+        }
+
     public:
-        void operator()(sd_image_t* ptr) const
+        LatencyHistogram queueWait;
+        LatencyHistogram run;
+        LatencyHistogram step;
+        std::atomic<uint64_t> images = 0;
+        std::atomic<uint64_t> pixels = 0;
+        std::atomic<uint64_t> inputBytesCopied = 0;
+        std::atomic<uint64_t> inputBytesBorrowed = 0;
+        std::atomic<uint64_t> outputBytesCopied = 0;
+        std::atomic<uint64_t> outputBytesWrapped = 0;
+        std::atomic<uint64_t> logsDelivered = 0;
+        std::atomic<uint64_t> progressDelivered = 0;
+        std::atomic<uint64_t> eventsDropped = 0;
+
+        static Metrics& instance()
         {
-            if (ptr)
+            static auto metrics = new Metrics();
+            return *metrics;
+        }
+
+        static void Add(std::atomic<uint64_t>& counter, uint64_t n = 1)
+        {
+            counter.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        void JobSettled(const char* kind, const char* outcome)
+        {
+            Add(jobs[indexOf(metricJobKinds, kind) * std::size(metricJobOutcomes) + indexOf(metricJobOutcomes, outcome)]);
+        }
+
+        uint64_t Jobs(size_t kind, size_t outcome) const
+        {
+            return jobs[kind * std::size(metricJobOutcomes) + outcome].load(std::memory_order_relaxed);
+        }
+
+        std::shared_ptr<QueueGauge> TrackQueue()
+        {
+            auto gauge = std::make_shared<QueueGauge>();
+            std::lock_guard lock(mutex);
+            gauge->id = nextQueueId++;
+            std::erase_if(queues, [](const auto& queue) { return queue.expired(); });
+            queues.push_back(gauge);
+            return gauge;
+        }
+
+        std::vector<std::shared_ptr<QueueGauge>> Queues()
+        {
+            std::vector<std::shared_ptr<QueueGauge>> ret;
+            std::lock_guard lock(mutex);
+            std::erase_if(queues, [](const auto& queue) { return queue.expired(); });
+            for (const auto& queue : queues)
             {
-                free(ptr->data);
-                free(ptr);
+                if (auto gauge = queue.lock())
+                    ret.push_back(std::move(gauge));
             }
+            return ret;
+        }
+    };
+
+    struct ContextEvent
+    {
+        enum class Kind : uint8_t { Log, Progress };
+
+        Kind kind = Kind::Log;
+        sd_log_level_t level = SD_LOG_DEBUG;
+        int step = 0;
+        int steps = 0;
+        float time = 0;
+        std::string text;
+    };
+
+    const char* logLevelName(sd_log_level_t level)
+    {
+        switch (level)
+        {
+            case SD_LOG_ERROR: return "error";
+            case SD_LOG_WARN: return "warn";
+            case SD_LOG_INFO: return "info";
+            case SD_LOG_DEBUG:
+            default: return "debug";
         }
+    }
+
+    struct EventChannelOptions
+    {
+        sd_log_level_t logLevel = SD_LOG_INFO;
+        int flushIntervalMs = 16;
+        size_t bufferSize = 1024;
+
+        static EventChannelOptions From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            EventChannelOptions options;
+            const auto logLevel = (tmp = params.Get("logLevel"), tmp.IsUndefined() ? "info" : tmp.ToString().Utf8Value());
+            options.flushIntervalMs = std::max(0, (tmp = params.Get("logFlushInterval"), tmp.IsUndefined() ? 16 : tmp.ToNumber().Int32Value()));
+            options.bufferSize = std::max<size_t>(2, (tmp = params.Get("logBufferSize"), tmp.IsUndefined() ? 1024 : tmp.ToNumber().Uint32Value()));
 
+            if (logLevel == "error")
+                options.logLevel = SD_LOG_ERROR;
+            else if (logLevel == "warn")
+                options.logLevel = SD_LOG_WARN;
+            else if (logLevel == "info")
+                options.logLevel = SD_LOG_INFO;
+            else if (logLevel == "debug")
+                options.logLevel = SD_LOG_DEBUG;
+            else
+                throw Napi::Error::New(params.Env(), "Invalid logLevel");
+
+            return options;
+        }
     };
 
-    using SdImageList = std::unique_ptr<sd_image_t[], freeSdImageList>;
-    using SdImage = std::unique_ptr<sd_image_t, freeSdImage>;
+    class EventChannel;
+    void onEventsPending(Napi::Env env, Napi::Function, EventChannel* channel, void*);
 
-    Napi::Object wrapSdImage(Napi::Env env, const sd_image_t& img)
+    // Carries log lines and progress ticks from the job threads to the JS callbacks. Producers never block, when the
+    // ring is full the event is counted as dropped. The JS thread is woken at most once per flush interval and then
+    // delivers everything queued so far in one go, and whatever is left is delivered before a job settles.
+    class EventChannel : public std::enable_shared_from_this<EventChannel>
     {
-        auto imgObj = Napi::Object::New(env);
-        imgObj.DefineProperties({
-                Napi::PropertyDescriptor::Value("width",  Napi::Number::From(env, img.width)),
-                Napi::PropertyDescriptor::Value("height",  Napi::Number::From(env, img.height)),
-                Napi::PropertyDescriptor::Value("channel",  Napi::Number::From(env, img.channel)),
-                Napi::PropertyDescriptor::Value("data",  Napi::Buffer<uint8_t>::Copy(env, img.data, size_t(img.width) * img.height * img.channel))
-            });
+        Napi::Env env;
+        Napi::FunctionReference logFn;
+        Napi::FunctionReference progressFn;
+        sd_log_level_t minLevel;
+        Clock::duration flushInterval;
+        MpscRing<ContextEvent> ring;
+        std::atomic<bool> wakePending = false;
+        std::atomic<uint64_t> dropped = 0;
+        uint64_t delivered = 0;
+        Clock::time_point lastDrain;
+        bool timerPending = false;
+        Napi::TypedThreadSafeFunction<EventChannel, void, onEventsPending> tsfn;
+        std::shared_ptr<TsfnGate> gate = std::make_shared<TsfnGate>();
+
+        void push(ContextEvent&& event)
+        {
+            const auto name = event.kind == ContextEvent::Kind::Log ? "log" : "progress";
+            if (!ring.TryPush(std::move(event)))
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                Metrics::Add(Metrics::instance().eventsDropped);
+                Tracer::instance().Instant("events", "dropped");
+                return;
+            }
+            Tracer::instance().Instant("events", name);
+
+            if (!wakePending.exchange(true))
+                gate->Call([this] { tsfn.NonBlockingCall(); });
+        }
+
+        void deliver(ContextEvent& event)
+        {
+            Napi::HandleScope hs(env);
+            try
+            {
+                if (event.kind == ContextEvent::Kind::Log)
+                {
+                    if (logFn.IsEmpty())
+                        return;
+
+                    event.text.erase(event.text.find_last_not_of("\n\r") + 1);
+                    logFn.Call({ Napi::String::New(env, logLevelName(event.level)), Napi::String::New(env, event.text) });
+                    Metrics::Add(Metrics::instance().logsDelivered);
+                }
+                else
+                {
+                    if (progressFn.IsEmpty())
+                        return;
+
+                    progressFn.Call({ Napi::Number::From(env, event.step), Napi::Number::From(env, event.steps), Napi::Number::From(env, event.time) });
+                    Metrics::Add(Metrics::instance().progressDelivered);
+                }
+                delivered++;
+            }
+            catch (const Napi::Error& e)
+            {
+                // same as a throwing event listener, there's no caller to hand it to
+                napi_fatal_exception(env, e.Value());
+            }
+        }
+
+    public:
+        EventChannel(Napi::Env env, Napi::Value logCallback, Napi::Value progressCallback, const EventChannelOptions& options) :
+            env(env), minLevel(options.logLevel), flushInterval(std::chrono::milliseconds(options.flushIntervalMs)), ring(options.bufferSize)
+        {
+            if (!logCallback.IsUndefined())
+                logFn = Napi::Persistent(logCallback.As<Napi::Function>());
+            if (!progressCallback.IsUndefined())
+                progressFn = Napi::Persistent(progressCallback.As<Napi::Function>());
+
+            tsfn = decltype(tsfn)::New(env, "node-stable-diffusion-cpp-events", 0, 1, this, &TsfnGate::Close<EventChannel>, new std::shared_ptr<TsfnGate>(gate));
+            tsfn.Unref(env);
+        }
+
+        EventChannel(const EventChannel&) = delete;
+        EventChannel& operator=(const EventChannel&) = delete;
+
+        ~EventChannel()
+        {
+            gate->Call([this] { tsfn.Abort(); });
+        }
+
+        static std::shared_ptr<EventChannel> Create(Napi::Env env, Napi::Value logCallback, Napi::Value progressCallback, const EventChannelOptions& options)
+        {
+            if (!logCallback.IsUndefined())
+                Napi::Function::CheckCast(env, logCallback);
+            if (!progressCallback.IsUndefined())
+                Napi::Function::CheckCast(env, progressCallback);
+
+            if (logCallback.IsUndefined() && progressCallback.IsUndefined())
+                return nullptr;
+
+            return std::make_shared<EventChannel>(env, logCallback, progressCallback, options);
+        }
+
+        // Checked before the message is copied so filtered lines never leave the job thread
+        void Log(sd_log_level_t level, const char* text)
+        {
+            if (level < minLevel || logFn.IsEmpty())
+                return;
+
+            push({ .kind = ContextEvent::Kind::Log, .level = level, .text = text });
+        }
+
+        void Progress(int step, int steps, float time)
+        {
+            if (progressFn.IsEmpty())
+                return;
+
+            push({ .kind = ContextEvent::Kind::Progress, .step = step, .steps = steps, .time = time });
+        }
+
+        void OnWake()
+        {
+            if (timerPending)
+                return;
+
+            const auto wait = lastDrain + flushInterval - Clock::now();
+            if (wait <= Clock::duration::zero())
+                return Drain();
+
+            timerPending = true;
+            auto flush = Napi::Function::New(env, [weak = weak_from_this()](const Napi::CallbackInfo&)
+            {
+                if (const auto channel = weak.lock())
+                {
+                    channel->timerPending = false;
+                    channel->Drain();
+                }
+            }, "flushEvents");
+            const auto delayMs = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+            auto timer = env.Global().Get("setTimeout").As<Napi::Function>().Call({ flush, Napi::Number::New(env, double(delayMs)) }).ToObject();
+            timer.Get("unref").As<Napi::Function>().Call(timer, {});
+        }
+
+        void Drain()
+        {
+            // cleared first, anything pushed after this point wakes us again
+            wakePending.exchange(false);
+            lastDrain = Clock::now();
+
+            ContextEvent event;
+            int64_t count = 0;
+            for (; ring.TryPop(event); count++)
+                deliver(event);
+
+            if (count > 0)
+                Tracer::instance().Complete("events", "deliver", lastDrain, Clock::now(), "events", count);
+        }
+
+        Napi::Object Stats() const
+        {
+            auto stats = Napi::Object::New(env);
+            stats["delivered"] = Napi::Number::New(env, double(delivered));
+            stats["dropped"] = Napi::Number::New(env, double(dropped.load(std::memory_order_relaxed)));
+            return stats;
+        }
+    };
+
+    void onEventsPending(Napi::Env env, Napi::Function, EventChannel* channel, void*)
+    {
+        if (!env)
+            return;
+
+        Napi::HandleScope hs(env);
+        channel->OnWake();
+    }
+
+    struct CPPContextData;
+
+    // Unit of work run on the scheduler threads, its completion is handed back to the JS thread that queued it
+    class ScheduledJob
+    {
+    public:
+        int priority = 0;
+        int threads = 1;
+        Clock::time_point queuedAt = Clock::now();
+        uint64_t sequence = 0;
+        // Jobs with the same key never run at the same time, used for native contexts shared between JS contexts
+        const void* exclusive = nullptr;
+        // Estimated working set, held against the memory budget while the job runs
+        size_t memoryBytes = 0;
+        bool heldForMemory = false;
+        const uint64_t traceId = Tracer::instance().NextId();
+
+        virtual ~ScheduledJob() = default;
+
+        virtual void Execute() = 0;
+        virtual void PostCompletion() = 0;
+        virtual void OnComplete() = 0;
+    };
+
+    class JobCompletionQueue;
+    void onJobComplete(Napi::Env env, Napi::Function, JobCompletionQueue* queue, ScheduledJob* job);
+
+    // One per env, keeps the event loop alive only while that env has jobs in flight. Contexts share ownership
+    // so a job that finishes after its env was torn down still has somewhere to post to.
+    class JobCompletionQueue
+    {
+        Napi::Env env;
+        Napi::TypedThreadSafeFunction<JobCompletionQueue, ScheduledJob, onJobComplete> tsfn;
+        std::shared_ptr<TsfnGate> gate = std::make_shared<TsfnGate>();
+        size_t inFlight = 0;
+
+    public:
+        JobCompletionQueue(Napi::Env env) : env(env)
+        {
+            tsfn = decltype(tsfn)::New(env, "node-stable-diffusion-cpp-job-complete", 0, 1, this, &TsfnGate::Close<JobCompletionQueue>, new std::shared_ptr<TsfnGate>(gate));
+            tsfn.Unref(env);
+        }
+
+        JobCompletionQueue(const JobCompletionQueue&) = delete;
+        JobCompletionQueue& operator=(const JobCompletionQueue&) = delete;
+
+        void Started()
+        {
+            if (inFlight++ == 0)
+                tsfn.Ref(env);
+        }
+
+        void Finished()
+        {
+            if (--inFlight == 0)
+                tsfn.Unref(env);
+        }
+
+        // If the env is already gone the job is leaked, it can hold references that have to die on its JS thread
+        void Post(ScheduledJob* job)
+        {
+            gate->Call([&] { tsfn.NonBlockingCall(job); });
+        }
+    };
+
+    // What a native context holds. stable-diffusion.cpp logs the size of every weight and compute buffer it
+    // allocates at debug level, until it did the size of the weight files stands in for the weights.
+    class MemoryFootprint
+    {
+    public:
+        struct ComputePeak
+        {
+            std::string component;
+            int width = 0;
+            int height = 0;
+            size_t bytes = 0;
+        };
+
+    private:
+        mutable std::mutex mutex;
+        size_t estimatedWeightBytes;
+        std::vector<std::pair<std::string, size_t>> weights;
+        std::vector<ComputePeak> computePeaks;
+
+    public:
+        MemoryFootprint(size_t estimatedWeightBytes) : estimatedWeightBytes(estimatedWeightBytes) {}
+
+        // "<component> params backend buffer size = <MB> MB(RAM)" or "<component> compute buffer size: <MB> MB(RAM)"
+        void OnLog(const char* text, int width, int height)
+        {
+            const char* marker = strstr(text, " params backend buffer size = ");
+            const bool compute = !marker;
+            if (compute && !(marker = strstr(text, " compute buffer size: ")))
+                return;
+
+            const char* start = marker;
+            while (start > text && start[-1] != ' ')
+                start--;
+            const std::string component(start, marker);
+            const auto bytes = size_t(strtod(strchr(marker + 1, compute ? ':' : '=') + 1, nullptr) * 1024 * 1024);
+
+            std::lock_guard lock(mutex);
+            if (compute)
+            {
+                const auto it = std::find_if(computePeaks.begin(), computePeaks.end(), [&](const auto& peak) { return peak.component == component && peak.width == width && peak.height == height; });
+                if (it != computePeaks.end())
+                    it->bytes = std::max(it->bytes, bytes);
+                else
+                    computePeaks.push_back({ component, width, height, bytes });
+            }
+            else
+            {
+                // CLIP-L and CLIP-G both report as clip
+                const auto it = std::find_if(weights.begin(), weights.end(), [&](const auto& weight) { return weight.first == component; });
+                if (it != weights.end())
+                    it->second += bytes;
+                else
+                    weights.emplace_back(component, bytes);
+            }
+        }
+
+        bool Measured() const
+        {
+            std::lock_guard lock(mutex);
+            return !weights.empty();
+        }
+
+        size_t WeightBytes() const
+        {
+            std::lock_guard lock(mutex);
+            if (weights.empty())
+                return estimatedWeightBytes;
+
+            size_t bytes = 0;
+            for (const auto& [component, size] : weights)
+                bytes += size;
+            return bytes;
+        }
+
+        std::vector<std::pair<std::string, size_t>> Weights() const
+        {
+            std::lock_guard lock(mutex);
+            return weights;
+        }
+
+        std::vector<ComputePeak> ComputePeaks() const
+        {
+            std::lock_guard lock(mutex);
+            return computePeaks;
+        }
+
+        // Components run one after another so the largest compute buffer is what a run adds on top of the weights.
+        // Unseen resolutions scale the closest measurement by pixel count, with nothing measured yet VAE decode
+        // at roughly 4KB per output pixel dominates.
+        size_t EstimateRunBytes(int width, int height, int images) const
+        {
+            const auto pixels = size_t(std::max(width, 0)) * size_t(std::max(height, 0));
+            size_t compute = 0;
+            {
+                std::lock_guard lock(mutex);
+                bool exact = false;
+                for (const auto& peak : computePeaks)
+                {
+                    if (peak.width == width && peak.height == height)
+                    {
+                        compute = exact ? std::max(compute, peak.bytes) : peak.bytes;
+                        exact = true;
+                    }
+                    else if (!exact && peak.width > 0 && peak.height > 0)
+                    {
+                        compute = std::max(compute, size_t(double(peak.bytes) * pixels / (double(peak.width) * peak.height)));
+                    }
+                }
+                if (computePeaks.empty())
+                    compute = pixels * 4096;
+            }
+            return compute + pixels * 4 * size_t(std::max(images, 1));
+        }
+    };
+
+    struct MemoryStats
+    {
+        size_t weightBytes = 0;
+        size_t resultBytes = 0;
+        size_t reservedBytes = 0;
+        size_t budget = 0;
+        bool rejectOverBudget = false;
+        size_t contexts = 0;
+        uint64_t delayed = 0;
+        uint64_t rejected = 0;
+    };
+
+    // Process wide view of the footprints of every live native context and the result buffers handed to JS
+    class MemoryAccounting
+    {
+        std::mutex mutex;
+        std::vector<std::weak_ptr<MemoryFootprint>> footprints;
+        std::atomic<size_t> resultBytes = 0;
+
+        MemoryAccounting() = default;
+
+    public:
+        static MemoryAccounting& instance()
+        {
+            static auto accounting = new MemoryAccounting();
+            return *accounting;
+        }
+
+        std::shared_ptr<MemoryFootprint> Track(size_t estimatedWeightBytes)
+        {
+            auto footprint = std::make_shared<MemoryFootprint>(estimatedWeightBytes);
+            std::lock_guard lock(mutex);
+            std::erase_if(footprints, [](const auto& weak) { return weak.expired(); });
+            footprints.push_back(footprint);
+            return footprint;
+        }
+
+        // Weights of every live context and how many there are
+        std::pair<size_t, size_t> WeightBytes()
+        {
+            std::lock_guard lock(mutex);
+            size_t bytes = 0;
+            size_t count = 0;
+            for (const auto& weak : footprints)
+            {
+                if (const auto footprint = weak.lock())
+                {
+                    bytes += footprint->WeightBytes();
+                    count++;
+                }
+            }
+            return { bytes, count };
+        }
+
+        void ResultAllocated(size_t bytes) { resultBytes += bytes; }
+        void ResultFreed(size_t bytes) { resultBytes -= bytes; }
+        size_t ResultBytes() const { return resultBytes; }
+
+        size_t ResidentBytes()
+        {
+            return WeightBytes().first + ResultBytes();
+        }
+    };
+
+    struct SchedulerStats
+    {
+        size_t workerThreads = 0;
+        int threadBudget = 0;
+        int threadsInUse = 0;
+        size_t running = 0;
+        size_t queued = 0;
+        size_t ready = 0;
+        size_t maxQueueDepth = 0;
+        uint64_t started = 0;
+        uint64_t rejected = 0;
+        double lastWaitMs = 0;
+        double meanWaitMs = 0;
+        double maxWaitMs = 0;
+    };
+
+    // Process wide pool that runs jobs from every context and env on its own threads, so long generations
+    // never occupy the libuv threadpool. A job may start when the ggml threads it uses fit into the budget,
+    // or when nothing else is running so a single oversized job can't stall the queue forever. The memory
+    // budget works the same way with the estimated working set of a job on top of what is already resident.
+    class JobScheduler
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<ScheduledJob*> ready;
+        std::vector<const void*> busy;
+        size_t workerThreads = 4;
+        size_t liveWorkers = 0;
+        int threadBudget = int(std::max(1u, std::thread::hardware_concurrency()));
+        int threadsInUse = 0;
+        size_t running = 0;
+        size_t queued = 0;
+        size_t maxQueueDepth = 0;
+        uint64_t nextSequence = 0;
+        uint64_t started = 0;
+        uint64_t rejected = 0;
+        double totalWaitMs = 0;
+        double lastWaitMs = 0;
+        double maxWaitMs = 0;
+        size_t memoryBudget = 0;
+        bool rejectOverBudget = false;
+        size_t reservedBytes = 0;
+        uint64_t memoryDelayed = 0;
+        uint64_t memoryRejected = 0;
+
+        JobScheduler() = default;
+
+        bool fitsMemory(size_t bytes)
+        {
+            return memoryBudget == 0 || bytes == 0 || MemoryAccounting::instance().ResidentBytes() + reservedBytes + bytes <= memoryBudget;
+        }
+
+        // Jobs waiting on a busy native context are skipped, otherwise only the first job may start so a large
+        // one can't be starved by smaller ones queued behind it
+        std::vector<ScheduledJob*>::iterator nextDispatchable()
+        {
+            for (auto it = ready.begin(); it != ready.end(); ++it)
+            {
+                const auto job = *it;
+                if (job->exclusive && std::find(busy.begin(), busy.end(), job->exclusive) != busy.end())
+                    continue;
+
+                if (running > 0 && !fitsMemory(job->memoryBytes))
+                {
+                    if (!std::exchange(job->heldForMemory, true))
+                        memoryDelayed++;
+                    return ready.end();
+                }
+
+                return threadsInUse == 0 || threadsInUse + job->threads <= threadBudget ? it : ready.end();
+            }
+            return ready.end();
+        }
+
+        bool canDispatch()
+        {
+            return nextDispatchable() != ready.end();
+        }
+
+        void spawnWorkers()
+        {
+            for (; liveWorkers < workerThreads; liveWorkers++)
+                std::thread(&JobScheduler::workerMain, this).detach();
+        }
+
+        void workerMain()
+        {
+            Tracer::instance().NameThread("sd-job-worker");
+            std::unique_lock lock(mutex);
+            while (true)
+            {
+                cv.wait(lock, [this] { return liveWorkers > workerThreads || canDispatch(); });
+                if (liveWorkers > workerThreads)
+                {
+                    liveWorkers--;
+                    return;
+                }
+
+                const auto next = nextDispatchable();
+                auto job = *next;
+                ready.erase(next);
+                const int threads = job->threads;
+                const auto memoryBytes = job->memoryBytes;
+                const auto exclusive = job->exclusive;
+                if (exclusive)
+                    busy.push_back(exclusive);
+                const double waitMs = std::chrono::duration<double, std::milli>(Clock::now() - job->queuedAt).count();
+                queued--;
+                running++;
+                started++;
+                threadsInUse += threads;
+                reservedBytes += memoryBytes;
+                totalWaitMs += waitMs;
+                lastWaitMs = waitMs;
+                maxWaitMs = std::max(maxWaitMs, waitMs);
+                lock.unlock();
+
+                job->Execute();
+                job->PostCompletion();
+
+                lock.lock();
+                running--;
+                threadsInUse -= threads;
+                reservedBytes -= memoryBytes;
+                if (exclusive)
+                    busy.erase(std::find(busy.begin(), busy.end(), exclusive));
+                cv.notify_all();
+            }
+        }
+
+    public:
+        static JobScheduler& instance()
+        {
+            // leaked on purpose, detached workers may still be inside a job when the process exits
+            static auto scheduler = new JobScheduler();
+            return *scheduler;
+        }
+
+        enum class Admission { Admitted, QueueFull, OverBudget };
+
+        // Counts a job as queued from the moment it is accepted by a context, limited jobs are refused once the queue
+        // is full. A job that can't fit into the memory budget even on its own is refused as well, with the reject
+        // policy so is one that doesn't fit next to what is running right now.
+        Admission admit(bool limited, size_t memoryBytes)
+        {
+            std::lock_guard lock(mutex);
+            if (limited && maxQueueDepth > 0 && queued >= maxQueueDepth)
+            {
+                rejected++;
+                return Admission::QueueFull;
+            }
+            if (memoryBudget > 0 && memoryBytes > 0)
+            {
+                const auto resident = MemoryAccounting::instance().ResidentBytes();
+                if (resident + memoryBytes > memoryBudget || (rejectOverBudget && resident + reservedBytes + memoryBytes > memoryBudget))
+                {
+                    memoryRejected++;
+                    return Admission::OverBudget;
+                }
+            }
+            queued++;
+            return Admission::Admitted;
+        }
+
+        // Job was dropped before it ever reached the scheduler
+        void withdraw()
+        {
+            std::lock_guard lock(mutex);
+            queued--;
+        }
+
+        void submit(ScheduledJob* job)
+        {
+            std::lock_guard lock(mutex);
+            job->sequence = nextSequence++;
+            const auto pos = std::upper_bound(ready.begin(), ready.end(), job, [](const ScheduledJob* a, const ScheduledJob* b)
+            {
+                return a->priority != b->priority ? a->priority > b->priority : a->sequence < b->sequence;
+            });
+            ready.insert(pos, job);
+            spawnWorkers();
+            cv.notify_all();
+        }
+
+        void configure(std::optional<size_t> newWorkerThreads, std::optional<int> newThreadBudget, std::optional<size_t> newMaxQueueDepth)
+        {
+            std::lock_guard lock(mutex);
+            if (newWorkerThreads)
+                workerThreads = std::max<size_t>(1, *newWorkerThreads);
+            if (newThreadBudget)
+                threadBudget = std::max(1, *newThreadBudget);
+            if (newMaxQueueDepth)
+                maxQueueDepth = *newMaxQueueDepth;
+
+            if (!ready.empty())
+                spawnWorkers();
+            cv.notify_all();
+        }
+
+        void configureMemory(std::optional<size_t> newMemoryBudget, std::optional<bool> newRejectOverBudget)
+        {
+            std::lock_guard lock(mutex);
+            if (newMemoryBudget)
+                memoryBudget = *newMemoryBudget;
+            if (newRejectOverBudget)
+                rejectOverBudget = *newRejectOverBudget;
+            cv.notify_all();
+        }
+
+        // Resident memory went down, a job held for the budget may fit now
+        void memoryReleased()
+        {
+            std::lock_guard lock(mutex);
+            if (memoryBudget > 0 && running > 0)
+                cv.notify_all();
+        }
+
+        // Whether bytes more fit into the budget next to what is resident and held for running jobs
+        bool FitsMemory(size_t bytes)
+        {
+            std::lock_guard lock(mutex);
+            return fitsMemory(bytes);
+        }
+
+        MemoryStats memoryStats()
+        {
+            std::lock_guard lock(mutex);
+            const auto [weightBytes, contexts] = MemoryAccounting::instance().WeightBytes();
+            return {
+                .weightBytes = weightBytes,
+                .resultBytes = MemoryAccounting::instance().ResultBytes(),
+                .reservedBytes = reservedBytes,
+                .budget = memoryBudget,
+                .rejectOverBudget = rejectOverBudget,
+                .contexts = contexts,
+                .delayed = memoryDelayed,
+                .rejected = memoryRejected,
+            };
+        }
+
+        SchedulerStats stats()
+        {
+            std::lock_guard lock(mutex);
+            return {
+                .workerThreads = workerThreads,
+                .threadBudget = threadBudget,
+                .threadsInUse = threadsInUse,
+                .running = running,
+                .queued = queued,
+                .ready = ready.size(),
+                .maxQueueDepth = maxQueueDepth,
+                .started = started,
+                .rejected = rejected,
+                .lastWaitMs = lastWaitMs,
+                .meanWaitMs = started > 0 ? totalWaitMs / started : 0,
+                .maxWaitMs = maxWaitMs,
+            };
+        }
+    };
+
+    // Thrown at job boundaries, and out of the progress hook where the ggml work context can be freed after
+    // unwinding, to end a job that was aborted
+    struct JobAborted {};
+
+    enum class TimingStage { Setup, Encode, Conditioning, Sampling, Decode, Upscale, Compress, Marshal, Count };
+
+    const char* timingStageName(TimingStage stage)
+    {
+        switch (stage)
+        {
+            case TimingStage::Setup: return "setup";
+            case TimingStage::Encode: return "encode";
+            case TimingStage::Conditioning: return "conditioning";
+            case TimingStage::Sampling: return "sampling";
+            case TimingStage::Decode: return "decode";
+            case TimingStage::Upscale: return "upscale";
+            case TimingStage::Compress: return "compress";
+            case TimingStage::Marshal:
+            default: return "marshal";
+        }
+    }
+
+    double toMs(Clock::duration d)
+    {
+        return std::chrono::duration<double, std::milli>(d).count();
+    }
+
+    // Wall clock spans of one job. stable-diffusion.cpp has no stage hooks, the boundaries are taken from the
+    // log lines it prints as each stage completes and time after the last one goes to the stage that follows.
+    struct JobTiming
+    {
+        Clock::time_point startedAt;
+        Clock::time_point finishedAt;
+        Clock::time_point lastMark;
+        TimingStage current = TimingStage::Setup;
+        std::array<double, size_t(TimingStage::Count)> stageMs{};
+        std::vector<float> stepMs;
+
+        void Start(TimingStage first)
+        {
+            startedAt = lastMark = Clock::now();
+            current = first;
+        }
+
+        void Mark(TimingStage done, TimingStage next)
+        {
+            const auto now = Clock::now();
+            stageMs[size_t(done)] += toMs(now - lastMark);
+            Tracer::instance().Complete("stage", timingStageName(done), lastMark, now);
+            lastMark = now;
+            current = next;
+        }
+
+        void Finish()
+        {
+            Mark(current, current);
+            finishedAt = lastMark;
+        }
+
+        void OnLog(const char* text)
+        {
+            if (strstr(text, "apply_loras completed"))
+                Mark(TimingStage::Setup, TimingStage::Conditioning);
+            else if (strstr(text, "encode_first_stage completed"))
+                Mark(TimingStage::Encode, TimingStage::Conditioning);
+            else if (strstr(text, "get_learned_condition completed"))
+                Mark(TimingStage::Conditioning, TimingStage::Sampling);
+            else if (strstr(text, "generating image:"))
+                Mark(current, TimingStage::Sampling);
+            else if (strstr(text, "sampling completed"))
+                Mark(TimingStage::Sampling, TimingStage::Decode);
+            else if (strstr(text, "decode_first_stage completed"))
+                Mark(TimingStage::Decode, TimingStage::Decode);
+        }
+
+        // Upstream reports the duration of each step itself, tiled VAE and ESRGAN progress isn't a step
+        void OnProgress(int step, float time)
+        {
+            if (current != TimingStage::Sampling)
+                return;
+
+            stepMs.push_back(time * 1000.0f);
+            const auto now = Clock::now();
+            const auto duration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(time));
+            Metrics::instance().step.Record(duration);
+            Tracer::instance().Complete("sampler", "step", now - duration, now, "step", step);
+        }
+    };
+
+    struct JobState
+    {
+        std::atomic<bool> aborted = false;
+        // The first ggml context stable-diffusion.cpp creates during a call holds its latents, remember
+        // it so an aborted job can free it since unwinding skips the cleanup at the end of the call
+        bool trackWorkCtx = false;
+        ggml_context* workCtx = nullptr;
+        JobTiming timing;
+        // Where buffer sizes logged during the job are recorded, compute buffers under the job's output size
+        std::shared_ptr<MemoryFootprint> memory;
+        int width = 0;
+        int height = 0;
+    };
+
+    constinit thread_local CPPContextData* tl_current = nullptr;
+    constinit thread_local JobState* tl_job = nullptr;
+
+    // stable-diffusion.cpp has one log and one progress hook for the whole process. They are installed once for
+    // every env that loads the addon and route each call by the job running on the calling thread. Calls from
+    // threads ggml started itself can only be attributed while no more than one job is running.
+    class NativeHooks
+    {
+        std::mutex mutex;
+        std::vector<std::pair<JobState*, CPPContextData*>> running;
+
+        NativeHooks() = default;
+
+    public:
+        static NativeHooks& instance()
+        {
+            static auto hooks = new NativeHooks();
+            return *hooks;
+        }
+
+        static void Install(sd_log_cb_t logFunc, sd_progress_cb_t progressFunc)
+        {
+            static std::once_flag once;
+            std::call_once(once, [&]
+            {
+                sd_set_log_callback(logFunc, nullptr);
+                sd_set_progress_callback(progressFunc, nullptr);
+            });
+        }
+
+        void Enter(JobState* job, CPPContextData* ctx)
+        {
+            std::lock_guard lock(mutex);
+            running.emplace_back(job, ctx);
+        }
+
+        void Leave(JobState* job)
+        {
+            std::lock_guard lock(mutex);
+            std::erase_if(running, [&](const auto& entry) { return entry.first == job; });
+        }
+
+        // Runs under the lock so the job can't finish meanwhile
+        template <typename F>
+        void WithSoleJob(F&& func)
+        {
+            std::lock_guard lock(mutex);
+            if (running.size() == 1)
+                func(*running.front().first, *running.front().second);
+        }
+    };
+
+    struct CpuTopology
+    {
+        struct Core
+        {
+            int socket = 0;
+            int numaNode = 0;
+            std::vector<int> cpus;
+        };
+
+        struct NumaNode
+        {
+            int id = 0;
+            std::vector<int> cpus;
+            // 0 where the platform doesn't say
+            uint64_t memoryBytes = 0;
+        };
+
+        int logicalCpus = 0;
+        std::vector<Core> cores;
+        std::vector<NumaNode> numaNodes;
+
+        const NumaNode* FindNode(int id) const
+        {
+            const auto it = std::find_if(numaNodes.begin(), numaNodes.end(), [&](const auto& node) { return node.id == id; });
+            return it == numaNodes.end() ? nullptr : &*it;
+        }
+
+        bool HasCpu(int cpu) const
+        {
+            return std::any_of(cores.begin(), cores.end(), [&](const auto& core) { return std::find(core.cpus.begin(), core.cpus.end(), cpu) != core.cpus.end(); });
+        }
+    };
+
+#ifdef __linux__
+    std::string readFirstLine(const std::filesystem::path& path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    // sysfs cpu lists look like "0-3,8-11"
+    std::vector<int> parseCpuList(const std::string& list)
+    {
+        std::vector<int> ret;
+        size_t start = 0;
+        while (start < list.size())
+        {
+            const auto end = std::min(list.find(',', start), list.size());
+            const auto range = list.substr(start, end - start);
+            const auto dash = range.find('-');
+            const auto first = std::atoi(range.c_str());
+            const auto last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; cpu++)
+                ret.push_back(cpu);
+            start = end + 1;
+        }
+        return ret;
+    }
+#endif
+
+    // Read once, CPUs going on or offline while the process runs isn't worth tracking
+    const CpuTopology& cpuTopology()
+    {
+        static const auto topology = []
+        {
+            CpuTopology t;
+#ifdef __linux__
+            const std::filesystem::path cpuRoot = "/sys/devices/system/cpu";
+            std::map<std::pair<int, int>, size_t> coreIndex;
+            for (const auto cpu : parseCpuList(readFirstLine(cpuRoot / "online")))
+            {
+                const auto topologyDir = cpuRoot / ("cpu" + std::to_string(cpu)) / "topology";
+                const auto socket = std::atoi(readFirstLine(topologyDir / "physical_package_id").c_str());
+                const auto core = std::atoi(readFirstLine(topologyDir / "core_id").c_str());
+                const auto [it, added] = coreIndex.try_emplace({ socket, core }, t.cores.size());
+                if (added)
+                    t.cores.push_back({ .socket = socket });
+                t.cores[it->second].cpus.push_back(cpu);
+                t.logicalCpus++;
+            }
+
+            std::error_code ec;
+            for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec))
+            {
+                const auto name = entry.path().filename().string();
+                if (!name.starts_with("node") || name.size() == 4 || !std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                    continue;
+
+                CpuTopology::NumaNode node{ .id = std::atoi(name.c_str() + 4), .cpus = parseCpuList(readFirstLine(entry.path() / "cpulist")) };
+                std::ifstream meminfo(entry.path() / "meminfo");
+                for (std::string line; std::getline(meminfo, line);)
+                {
+                    // "Node 0 MemTotal:       65843068 kB"
+                    if (const auto pos = line.find("MemTotal:"); pos != std::string::npos)
+                    {
+                        node.memoryBytes = std::strtoull(line.c_str() + pos + 9, nullptr, 10) * 1024;
+                        break;
+                    }
+                }
+                t.numaNodes.push_back(std::move(node));
+            }
+            std::sort(t.numaNodes.begin(), t.numaNodes.end(), [](const auto& a, const auto& b) { return a.id < b.id; });
+#elif defined(_WIN32)
+            DWORD length = 0;
+            GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+            std::vector<uint8_t> buffer(length);
+            if (GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &length))
+            {
+                const auto cpusOf = [](const GROUP_AFFINITY& affinity)
+                {
+                    std::vector<int> cpus;
+                    for (int bit = 0; bit < int(sizeof(KAFFINITY) * 8); bit++)
+                    {
+                        if (affinity.Mask & (KAFFINITY(1) << bit))
+                            cpus.push_back(affinity.Group * int(sizeof(KAFFINITY) * 8) + bit);
+                    }
+                    return cpus;
+                };
+
+                std::vector<std::vector<int>> packages;
+                for (size_t offset = 0; offset < length;)
+                {
+                    const auto info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buffer.data() + offset);
+                    if (info->Relationship == RelationProcessorCore)
+                    {
+                        t.cores.push_back({ .cpus = cpusOf(info->Processor.GroupMask[0]) });
+                        t.logicalCpus += int(t.cores.back().cpus.size());
+                    }
+                    else if (info->Relationship == RelationProcessorPackage)
+                    {
+                        std::vector<int> cpus;
+                        for (WORD i = 0; i < info->Processor.GroupCount; i++)
+                        {
+                            const auto groupCpus = cpusOf(info->Processor.GroupMask[i]);
+                            cpus.insert(cpus.end(), groupCpus.begin(), groupCpus.end());
+                        }
+                        packages.push_back(std::move(cpus));
+                    }
+                    else if (info->Relationship == RelationNumaNode)
+                    {
+                        t.numaNodes.push_back({ .id = int(info->NumaNode.NodeNumber), .cpus = cpusOf(info->NumaNode.GroupMask) });
+                    }
+                    offset += info->Size;
+                }
+
+                for (auto& core : t.cores)
+                {
+                    for (size_t i = 0; i < packages.size(); i++)
+                    {
+                        if (std::find(packages[i].begin(), packages[i].end(), core.cpus.front()) != packages[i].end())
+                            core.socket = int(i);
+                    }
+                }
+            }
+#endif
+            if (t.cores.empty())
+            {
+                // no topology to go by, every logical CPU counts as a core of its own
+                t.logicalCpus = std::max(1, int(std::thread::hardware_concurrency()));
+                for (int cpu = 0; cpu < t.logicalCpus; cpu++)
+                    t.cores.push_back({ .cpus = { cpu } });
+            }
+
+            if (t.numaNodes.empty())
+            {
+                CpuTopology::NumaNode node;
+                for (const auto& core : t.cores)
+                    node.cpus.insert(node.cpus.end(), core.cpus.begin(), core.cpus.end());
+                std::sort(node.cpus.begin(), node.cpus.end());
+                t.numaNodes.push_back(std::move(node));
+            }
+
+            for (auto& core : t.cores)
+            {
+                for (const auto& node : t.numaNodes)
+                {
+                    if (std::find(node.cpus.begin(), node.cpus.end(), core.cpus.front()) != node.cpus.end())
+                        core.numaNode = node.id;
+                }
+            }
+            return t;
+        }();
+        return topology;
+    }
+
+    // Where the compute of a context runs and which NUMA node its memory comes from. Either may be left out,
+    // a node without CPUs given runs on all of that node's CPUs.
+    struct Placement
+    {
+        std::vector<int> cpus;
+        int numaNode = -1;
+
+        static Placement From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            Placement p;
+            p.numaNode = (tmp = params.Get("numaNode"), tmp.IsUndefined() ? -1 : tmp.ToNumber().Int32Value());
+            if (tmp = params.Get("cpuAffinity"), !tmp.IsUndefined())
+            {
+                const auto cpus = tmp.As<Napi::Array>();
+                for (uint32_t i = 0; i < cpus.Length(); i++)
+                    p.cpus.push_back(cpus.Get(i).ToNumber().Int32Value());
+            }
+
+            if (p.Empty())
+                return p;
+
+#if !defined(__linux__) && !defined(_WIN32)
+            throw Napi::Error::New(params.Env(), "cpuAffinity and numaNode are not supported on this platform");
+#endif
+            const auto& topology = cpuTopology();
+            if (p.numaNode >= 0)
+            {
+                const auto node = topology.FindNode(p.numaNode);
+                if (!node)
+                    throw Napi::Error::New(params.Env(), "Invalid numaNode");
+
+                if (p.cpus.empty())
+                    p.cpus = node->cpus;
+            }
+
+            std::sort(p.cpus.begin(), p.cpus.end());
+            p.cpus.erase(std::unique(p.cpus.begin(), p.cpus.end()), p.cpus.end());
+            if (p.cpus.empty() || !std::all_of(p.cpus.begin(), p.cpus.end(), [&](int cpu) { return topology.HasCpu(cpu); }))
+                throw Napi::Error::New(params.Env(), "Invalid cpuAffinity");
+
+            return p;
+        }
+
+        bool Empty() const
+        {
+            return cpus.empty() && numaNode < 0;
+        }
+
+        std::string Key() const
+        {
+            std::string key = std::to_string(numaNode);
+            for (const auto cpu : cpus)
+                key += ',' + std::to_string(cpu);
+            return key;
+        }
+    };
+
+    // Applies a placement to the job thread while a job runs. ggml starts its compute threads from the job
+    // thread, so they inherit the CPU mask, and the memory policy makes pages the job touches first, the
+    // weights while loading, come from the node. Windows has no per thread policy, but allocates from the
+    // node of the CPU that touches a page first, which the mask already decides.
+    class PlacementScope
+    {
+#ifdef __linux__
+        cpu_set_t previous;
+        bool pinned = false;
+        bool bound = false;
+#elif defined(_WIN32)
+        GROUP_AFFINITY previous{};
+        bool pinned = false;
+#endif
+
+    public:
+        explicit PlacementScope(const Placement& placement)
+        {
+            if (placement.Empty())
+                return;
+
+#ifdef __linux__
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            for (const auto cpu : placement.cpus)
+                CPU_SET(cpu, &mask);
+            pinned = sched_getaffinity(0, sizeof(previous), &previous) == 0 && sched_setaffinity(0, sizeof(mask), &mask) == 0;
+
+            if (placement.numaNode >= 0)
+            {
+                std::array<unsigned long, 16> nodes{};
+                constexpr auto bits = nodes.size() * sizeof(unsigned long) * 8;
+                if (size_t(placement.numaNode) < bits)
+                {
+                    nodes[placement.numaNode / (sizeof(unsigned long) * 8)] |= 1ul << (placement.numaNode % (sizeof(unsigned long) * 8));
+                    // the kernel counts one bit less than maxnode
+                    bound = syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes.data(), bits + 1) == 0;
+                }
+            }
+#elif defined(_WIN32)
+            GROUP_AFFINITY affinity{};
+            constexpr int groupSize = int(sizeof(KAFFINITY) * 8);
+            affinity.Group = WORD(placement.cpus.front() / groupSize);
+            for (const auto cpu : placement.cpus)
+            {
+                // a thread can only run in one processor group
+                if (cpu / groupSize == affinity.Group)
+                    affinity.Mask |= KAFFINITY(1) << (cpu % groupSize);
+            }
+            pinned = SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous) != 0;
+#endif
+        }
+
+        ~PlacementScope()
+        {
+#ifdef __linux__
+            if (bound)
+                syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+            if (pinned)
+                sched_setaffinity(0, sizeof(previous), &previous);
+#elif defined(_WIN32)
+            if (pinned)
+                SetThreadGroupAffinity(GetCurrentThread(), &previous, nullptr);
+#endif
+        }
+
+        PlacementScope(const PlacementScope&) = delete;
+        PlacementScope& operator=(const PlacementScope&) = delete;
+    };
+
+    struct JobOptions
+    {
+        Napi::Value signal;
+        int priority = 0;
+        // Subject to the scheduler's max queue depth, context creation and disposal never are
+        bool limited = false;
+        const char* kind = "internal";
+        Napi::Value onTiming;
+        // Output size and image count of a generation, or the weights a load is expected to add
+        int width = 0;
+        int height = 0;
+        int images = 0;
+        size_t loadBytes = 0;
+
+        static JobOptions From(Napi::Object params, const char* kind)
+        {
+            Napi::Value tmp;
+            return {
+                .signal = params.Get("signal"),
+                .priority = (tmp = params.Get("priority"), tmp.IsUndefined() ? 0 : tmp.ToNumber().Int32Value()),
+                .limited = true,
+                .kind = kind,
+                .onTiming = params.Get("onTiming"),
+            };
+        }
+
+        JobOptions WithWorkload(int outputWidth, int outputHeight, int imageCount) const
+        {
+            auto ret = *this;
+            ret.width = outputWidth;
+            ret.height = outputHeight;
+            ret.images = imageCount;
+            return ret;
+        }
+    };
+
+    class ContextWorker : public ScheduledJob
+    {
+        Napi::Env env;
+        std::optional<std::string> error;
+        const char* kind;
+        const char* status = "ok";
+        Napi::FunctionReference onTiming;
+
+        void ReportTiming();
+
+    protected:
+        //copy this on purpose to snapshot it
+        std::shared_ptr<CPPContextData> ctx;
+        Napi::Promise::Deferred def;
+        Napi::ObjectReference signal;
+        Napi::FunctionReference abortListener;
+        JobState job;
+
+        ContextWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, const JobOptions& options);
+
+        virtual void Run() = 0;
+        virtual Napi::Value Convert(Napi::Env env) = 0;
+
+        Napi::Env Env() const { return env; }
+        void SetError(const std::string& message) { error = message; }
+        void OnOK();
+        void OnError(const Napi::Error& e);
+
+        Napi::Value AbortReason() const { return signal.Value().Get("reason"); }
+
+    public:
+        Napi::Promise Promise() const { return def.Promise(); }
+
+        void Execute() override;
+        void PostCompletion() override;
+        void OnComplete() override;
+
+        void ListenForAbort(Napi::Object signalObj);
+        void StopListeningForAbort();
+        void OnAbortSignal();
+    };
+
+    class LoraVariants;
+
+    struct CPPContextData : public std::enable_shared_from_this<CPPContextData>
+    {
+        std::shared_ptr<sd_ctx_t> sdCtx;
+        // further copies of sdCtx with other LoRA sets merged, only with loraCache
+        std::shared_ptr<LoraVariants> loras;
+        std::shared_ptr<upscaler_ctx_t> upscalerCtx;
+        // further upscalers on the same weights that tiled upscales run tiles on, upscalerCtx is the first lane
+        std::vector<std::shared_ptr<upscaler_ctx_t>> upscalerLanes;
+        int numThreads = GGML_DEFAULT_N_THREADS;
+        Placement placement;
+        int coalesceWindowMs = 0;
+        std::shared_ptr<JobCompletionQueue> completion;
+        std::shared_ptr<EventChannel> events;
+        std::shared_ptr<MemoryFootprint> memory;
+        Napi::FunctionReference onTiming;
+        std::vector<std::unique_ptr<ContextWorker>> pendingTasks;
+        ContextWorker* runningTask = nullptr;
+        std::shared_ptr<QueueGauge> queueGauge = Metrics::instance().TrackQueue();
+
+        CPPContextData() = default;
+        CPPContextData(const CPPContextData& ctx) = delete;
+        CPPContextData(CPPContextData&& ctx) = delete;
+        CPPContextData& operator=(const CPPContextData& ctx) = delete;
+        CPPContextData& operator=(CPPContextData&& ctx) = delete;
+
+        ~CPPContextData()
+        {
+            sdCtx.reset();
+            loras.reset();
+            upscalerCtx.reset();
+            upscalerLanes.clear();
+        }
+
+        // The native context a generation with this prompt runs on, base unless a LoRA variant holds its set
+        sd_ctx_t* SdCtxFor(const std::shared_ptr<sd_ctx_t>& base, const std::string& prompt);
+
+        void queueTask(std::unique_ptr<ContextWorker>&& task)
+        {
+            const auto pos = std::find_if(pendingTasks.begin(), pendingTasks.end(), [&](const auto& pending) { return pending->priority < task->priority; });
+            pendingTasks.emplace(pos, std::move(task));
+            if (!runningTask)
+                nextTask();
+            publishQueue();
+        }
+
+        void nextTask()
+        {
+            runningTask = nullptr;
+            if (!pendingTasks.empty())
+            {
+                auto begin = pendingTasks.begin();
+                runningTask = begin->release();
+                pendingTasks.erase(begin);
+                Tracer::instance().Instant("scheduler", "submit", "job", int64_t(runningTask->traceId));
+                completion->Started();
+                JobScheduler::instance().submit(runningTask);
+            }
+            publishQueue();
+        }
+
+        // Only the JS thread touches the queue, getMetrics may read the gauge from any other
+        void publishQueue()
+        {
+            queueGauge->queued.store(pendingTasks.size(), std::memory_order_relaxed);
+            queueGauge->running.store(runningTask ? 1 : 0, std::memory_order_relaxed);
+        }
+
+        void reset()
+        {
+            sdCtx.reset();
+            loras.reset();
+            upscalerCtx.reset();
+            upscalerLanes.clear();
+            memory.reset();
+
+            if (events)
+            {
+                events->Drain();
+                events.reset();
+            }
+        }
+    };
+
+    void onJobComplete(Napi::Env env, Napi::Function, JobCompletionQueue* queue, ScheduledJob* job)
+    {
+        if (!env)
+            return;
+
+        Napi::HandleScope hs(env);
+        queue->Finished();
+        std::unique_ptr<ScheduledJob>(job)->OnComplete();
+    }
+
+    ContextWorker::ContextWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, const JobOptions& options) : env(env), kind(options.kind), ctx(ctx), def(env)
+    {
+        priority = options.priority;
+        threads = ctx->numThreads;
+        exclusive = ctx->sdCtx ? static_cast<const void*>(ctx->sdCtx.get()) : ctx->upscalerCtx.get();
+        job.memory = ctx->memory;
+        job.width = options.width;
+        job.height = options.height;
+
+        if (!options.onTiming.IsEmpty() && !options.onTiming.IsUndefined())
+        {
+            Napi::Function::CheckCast(env, options.onTiming);
+            onTiming = Napi::Persistent(options.onTiming.As<Napi::Function>());
+        }
+
+        Tracer::instance().AsyncBegin("job", kind, traceId, queuedAt);
+    }
+
+    void ContextWorker::PostCompletion()
+    {
+        ctx->completion->Post(this);
+    }
+
+    void ContextWorker::OnComplete()
+    {
+        const auto start = Clock::now();
+        // everything the job logged is delivered before it settles
+        if (ctx->events)
+            ctx->events->Drain();
+
+        if (error)
+        {
+            OnError(Napi::Error::New(env, *error));
+        }
+        else
+        {
+            try
+            {
+                OnOK();
+            }
+            catch (const Napi::Error& e)
+            {
+                OnError(e);
+            }
+        }
+
+        ReportTiming();
+        Metrics::instance().JobSettled(kind, status);
+        Tracer::instance().Complete("main", "complete", start, Clock::now(), "job", int64_t(traceId));
+        Tracer::instance().AsyncEnd("job", kind, traceId);
+    }
+
+    void ContextWorker::ReportTiming()
+    {
+        const auto& callback = onTiming.IsEmpty() ? ctx->onTiming : onTiming;
+        if (callback.IsEmpty())
+            return;
+
+        const auto& timing = job.timing;
+        auto stages = Napi::Object::New(env);
+        for (size_t i = 0; i < timing.stageMs.size(); i++)
+            stages[timingStageName(TimingStage(i))] = Napi::Number::New(env, timing.stageMs[i]);
+
+        auto steps = Napi::Array::New(env, timing.stepMs.size());
+        for (size_t i = 0; i < timing.stepMs.size(); i++)
+            steps[i] = Napi::Number::New(env, timing.stepMs[i]);
+
+        auto record = Napi::Object::New(env);
+        record["kind"] = Napi::String::New(env, kind);
+        record["status"] = Napi::String::New(env, status);
+        record["backend"] = Napi::String::New(env, NODE_SD_BACKEND);
+        record["threads"] = Napi::Number::New(env, threads);
+        record["queueWaitMs"] = Napi::Number::New(env, toMs(timing.startedAt - queuedAt));
+        record["runMs"] = Napi::Number::New(env, toMs(timing.finishedAt - timing.startedAt));
+        record["totalMs"] = Napi::Number::New(env, toMs(Clock::now() - queuedAt));
+        record["stages"] = stages;
+        record["stepMs"] = steps;
+
+        try
+        {
+            callback.Call({ record });
+        }
+        catch (const Napi::Error& e)
+        {
+            napi_fatal_exception(env, e.Value());
+        }
+    }
+
+    void ContextWorker::Execute()
+    {
+        struct CurrentScope
+        {
+            CPPContextData* prevCtx;
+            JobState* prevJob;
+            ~CurrentScope()
+            {
+                NativeHooks::instance().Leave(tl_job);
+                tl_current = prevCtx;
+                tl_job = prevJob;
+            }
+        } scope{ std::exchange(tl_current, ctx.get()), std::exchange(tl_job, &job) };
+        NativeHooks::instance().Enter(&job, ctx.get());
+        const PlacementScope placement(ctx->placement);
+
+        job.timing.Start(strcmp(kind, "upscale") == 0 ? TimingStage::Upscale : TimingStage::Setup);
+        try
+        {
+            if (job.aborted)
+                throw JobAborted();
+
+            Run();
+        }
+        catch (const JobAborted&)
+        {
+#ifdef NODE_SD_WRAP_GGML_INIT
+            if (job.workCtx)
+                __real_ggml_free(std::exchange(job.workCtx, nullptr));
+#endif
+            SetError("The operation was aborted");
+        }
+        catch (const std::exception& e)
+        {
+            SetError(e.what());
+        }
+        catch (...)
+        {
+            SetError("Unknown error");
+        }
+        job.timing.Finish();
+        Metrics::instance().queueWait.Record(job.timing.startedAt - queuedAt);
+        Metrics::instance().run.Record(job.timing.finishedAt - job.timing.startedAt);
+        Tracer::instance().Complete("job", kind, job.timing.startedAt, job.timing.finishedAt, "job", int64_t(traceId));
+    }
+
+    void ContextWorker::OnOK()
+    {
+        // An abort that raced with the last step still rejects, the result is freed with the worker
+        if (job.aborted && !signal.IsEmpty())
+        {
+            status = "aborted";
+            def.Reject(AbortReason());
+        }
+        else
+        {
+            const auto marshalStart = Clock::now();
+            const auto value = Convert(Env());
+            const auto marshalEnd = Clock::now();
+            job.timing.stageMs[size_t(TimingStage::Marshal)] = toMs(marshalEnd - marshalStart);
+            Tracer::instance().Complete("stage", timingStageName(TimingStage::Marshal), marshalStart, marshalEnd, "job", int64_t(traceId));
+            def.Resolve(value);
+        }
+
+        StopListeningForAbort();
+        ctx->nextTask();
+    }
+
+    void ContextWorker::OnError(const Napi::Error& e)
+    {
+        status = job.aborted ? "aborted" : "error";
+        if (job.aborted && !signal.IsEmpty())
+            def.Reject(AbortReason());
+        else
+            def.Reject(e.Value());
+
+        StopListeningForAbort();
+        ctx->nextTask();
+    }
+
+    void ContextWorker::ListenForAbort(Napi::Object signalObj)
+    {
+        job.trackWorkCtx = true;
+        auto listener = Napi::Function::New(Env(), [this](const Napi::CallbackInfo&) { OnAbortSignal(); }, "onAbort");
+        signalObj.Get("addEventListener").As<Napi::Function>().Call(signalObj, { Napi::String::New(Env(), "abort"), listener });
+        signal = Napi::Persistent(signalObj);
+        abortListener = Napi::Persistent(listener);
+    }
+
+    void ContextWorker::StopListeningForAbort()
+    {
+        if (signal.IsEmpty())
+            return;
+
+        auto signalObj = signal.Value();
+        signalObj.Get("removeEventListener").As<Napi::Function>().Call(signalObj, { Napi::String::New(Env(), "abort"), abortListener.Value() });
+        signal.Reset();
+        abortListener.Reset();
+    }
+
+    void ContextWorker::OnAbortSignal()
+    {
+        job.aborted = true;
+
+        // A running job notices the flag at its next progress tick, or when it returns without NODE_SD_WRAP_GGML_INIT,
+        // a queued one is dropped right away
+        auto& pending = ctx->pendingTasks;
+        const auto it = std::find_if(pending.begin(), pending.end(), [this](const auto& task) { return task.get() == this; });
+        if (it != pending.end())
+        {
+            auto self = std::move(*it);
+            pending.erase(it);
+            JobScheduler::instance().withdraw();
+            ctx->publishQueue();
+            Metrics::instance().JobSettled(kind, "aborted");
+            Tracer::instance().AsyncEnd("job", kind, traceId);
+            def.Reject(AbortReason());
+            StopListeningForAbort();
+        }
+    }
+
+    void stableDiffusionLogFunc(enum sd_log_level_t level, const char* text, void* data)
+    {
+        const auto job = tl_job;
+        if (!job)
+        {
+            // only the event channel and footprint are safe to touch from another thread
+            NativeHooks::instance().WithSoleJob([&](JobState& job, CPPContextData& ctx)
+            {
+                if (job.memory && level == SD_LOG_DEBUG)
+                    job.memory->OnLog(text, job.width, job.height);
+                if (ctx.events)
+                    ctx.events->Log(level, text);
+            });
+            return;
+        }
+
+        if (level == SD_LOG_INFO)
+            job->timing.OnLog(text);
+        if (job->memory && level == SD_LOG_DEBUG)
+            job->memory->OnLog(text, job->width, job->height);
+
+        const auto ctx = tl_current;
+        if (ctx && ctx->events)
+        {
+            ctx->events->Log(level, text);
+        }
+    }
+
+    void stableDiffusionProgressFunc(int step, int steps, float time, void* data)
+    {
+        const auto job = tl_job;
+        if (!job)
+        {
+            // never unwind a thread that isn't running the job, the abort is noticed at the next tick on the job's own thread
+            NativeHooks::instance().WithSoleJob([&](JobState&, CPPContextData& ctx)
+            {
+                if (ctx.events)
+                    ctx.events->Progress(step, steps, time);
+            });
+            return;
+        }
+
+        // Unwinding stable-diffusion.cpp skips the cleanup at the end of the call, so it's only done where the work
+        // context can be freed afterwards. Elsewhere the run finishes and OnOK rejects it as aborted.
+#ifdef NODE_SD_WRAP_GGML_INIT
+        if (job->aborted)
+            throw JobAborted();
+#endif
+
+        job->timing.OnProgress(step, time);
+
+        const auto ctx = tl_current;
+        if (ctx && ctx->events)
+        {
+            ctx->events->Progress(step, steps, time);
+        }
+    }
+
+
+    class freeSdImageList
+    {
+        size_t imageCount;
+    public:
+        freeSdImageList(size_t imageCount) noexcept : imageCount(imageCount) {};
+
+
+        void operator()(sd_image_t* ptr) const
+        {
+            if (ptr)
+            {
+                for (size_t i = 0; i < imageCount; i++)
+                {
+                    free(ptr[i].data);
+                }
+
+                free(ptr);
+            }
+        }
+
+    };
+
+    class freeSdImage
+    {
+    public:
+        void operator()(sd_image_t* ptr) const
+        {
+            if (ptr)
+            {
+                free(ptr->data);
+                free(ptr);
+            }
+        }
+
+    };
+
+    using SdImageList = std::unique_ptr<sd_image_t[], freeSdImageList>;
+    using SdImage = std::unique_ptr<sd_image_t, freeSdImage>;
+
+    // Result buffers count as resident memory until JS lets go of them
+    Napi::Buffer<uint8_t> wrapResultBuffer(Napi::Env env, uint8_t* data, size_t size)
+    {
+        Metrics::Add(Metrics::instance().outputBytesWrapped, size);
+        MemoryAccounting::instance().ResultAllocated(size);
+        return Napi::Buffer<uint8_t>::NewOrCopy(env, data, size, [size](Napi::Env, uint8_t* ptr)
+        {
+            free(ptr);
+            MemoryAccounting::instance().ResultFreed(size);
+            JobScheduler::instance().memoryReleased();
+        });
+    }
+
+    // Hands the image memory over to JS without copying, the Buffer finalizer frees it
+    Napi::Object wrapSdImage(Napi::Env env, sd_image_t& img)
+    {
+        const size_t size = size_t(img.width) * img.height * img.channel;
+        auto data = wrapResultBuffer(env, std::exchange(img.data, nullptr), size);
+
+        auto imgObj = Napi::Object::New(env);
+        imgObj.DefineProperties({
+                Napi::PropertyDescriptor::Value("width",  Napi::Number::From(env, img.width)),
+                Napi::PropertyDescriptor::Value("height",  Napi::Number::From(env, img.height)),
+                Napi::PropertyDescriptor::Value("channel",  Napi::Number::From(env, img.channel)),
+                Napi::PropertyDescriptor::Value("data",  data)
+            });
+
+        imgObj.Freeze();
+        return imgObj;
+    }
+
+    Napi::Object copySdImage(Napi::Env env, const sd_image_t& img)
+    {
+        const size_t size = size_t(img.width) * img.height * img.channel;
+        auto copy = img;
+        copy.data = static_cast<uint8_t*>(malloc(size));
+        memcpy(copy.data, img.data, size);
+        Metrics::Add(Metrics::instance().outputBytesCopied, size);
+        return wrapSdImage(env, copy);
+    }
+
+    enum class ImageFormat { Raw, Png, Jpeg, Webp };
+
+    const char* imageFormatName(ImageFormat format)
+    {
+        switch (format)
+        {
+            case ImageFormat::Png: return "png";
+            case ImageFormat::Jpeg: return "jpeg";
+            case ImageFormat::Webp: return "webp";
+            case ImageFormat::Raw:
+            default: return "raw";
+        }
+    }
+
+    // How the images of a batch reach JS, one Buffer each or all in one ArrayBuffer or SharedArrayBuffer
+    enum class BatchLayout { Separate, Contiguous, Shared };
+
+    struct OutputFormat
+    {
+        ImageFormat format = ImageFormat::Raw;
+        int quality = 90;
+        bool lossless = false;
+        BatchLayout layout = BatchLayout::Separate;
+
+        static OutputFormat From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            OutputFormat output;
+            if (tmp = params.Get("output"), tmp.IsUndefined())
+                return output;
+
+            const auto outputObj = tmp.ToObject();
+            const auto format = (tmp = outputObj.Get("format"), tmp.IsUndefined() ? std::string("raw") : tmp.ToString().Utf8Value());
+            output.quality = std::clamp((tmp = outputObj.Get("quality"), tmp.IsUndefined() ? 90 : tmp.ToNumber().Int32Value()), 1, 100);
+            output.lossless = (tmp = outputObj.Get("lossless"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+
+            if (format == "raw")
+                output.format = ImageFormat::Raw;
+            else if (format == "png")
+                output.format = ImageFormat::Png;
+            else if (format == "jpeg")
+                output.format = ImageFormat::Jpeg;
+            else if (format == "webp")
+                output.format = ImageFormat::Webp;
+            else
+                throw Napi::Error::New(params.Env(), "Invalid output format");
+
+            const auto layout = (tmp = outputObj.Get("layout"), tmp.IsUndefined() ? std::string("separate") : tmp.ToString().Utf8Value());
+            if (layout == "separate")
+                output.layout = BatchLayout::Separate;
+            else if (layout == "contiguous")
+                output.layout = BatchLayout::Contiguous;
+            else if (layout == "shared")
+                output.layout = BatchLayout::Shared;
+            else
+                throw Napi::Error::New(params.Env(), "Invalid output layout");
+
+            // the shared buffer is sized before the job runs, compressed sizes aren't known by then
+            if (output.layout == BatchLayout::Shared && output.format != ImageFormat::Raw)
+                throw Napi::Error::New(params.Env(), "The shared layout needs raw output");
+
+#ifndef NODE_SD_WEBP
+            if (output.format == ImageFormat::Webp)
+                throw Napi::Error::New(params.Env(), "WebP output is not supported by this build");
+#endif
+            return output;
+        }
+    };
+
+    // Compressed image, the data is malloc'd so it can be handed to a Buffer the same way raw images are
+    struct EncodedImage
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t channel = 0;
+        uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+        bool failed = false;
+
+        EncodedImage() = default;
+        EncodedImage(EncodedImage&& other) noexcept : width(other.width), height(other.height), channel(other.channel),
+            data(std::exchange(other.data, nullptr)), size(std::exchange(other.size, 0)), capacity(std::exchange(other.capacity, 0)), failed(other.failed) {}
+        EncodedImage& operator=(EncodedImage&& other) noexcept
+        {
+            std::swap(width, other.width);
+            std::swap(height, other.height);
+            std::swap(channel, other.channel);
+            std::swap(data, other.data);
+            std::swap(size, other.size);
+            std::swap(capacity, other.capacity);
+            std::swap(failed, other.failed);
+            return *this;
+        }
+        ~EncodedImage() { free(data); }
+
+        // stb hands the jpeg writer output over in small chunks
+        static void append(void* context, void* chunk, int chunkSize)
+        {
+            auto& self = *static_cast<EncodedImage*>(context);
+            if (self.failed)
+                return;
+            if (self.size + chunkSize > self.capacity)
+            {
+                const auto capacity = std::max(self.size + chunkSize, self.capacity * 2);
+                const auto data = static_cast<uint8_t*>(realloc(self.data, capacity));
+                if (!data)
+                {
+                    self.failed = true;
+                    return;
+                }
+                self.data = data;
+                self.capacity = capacity;
+            }
+            memcpy(self.data + self.size, chunk, chunkSize);
+            self.size += chunkSize;
+        }
+    };
+
+    EncodedImage encodeImage(const sd_image_t& img, const OutputFormat& output)
+    {
+        EncodedImage ret;
+        ret.width = img.width;
+        ret.height = img.height;
+        ret.channel = img.channel;
+
+        const int width = int(img.width);
+        const int height = int(img.height);
+        const int channel = int(img.channel);
+        bool ok = false;
+        switch (output.format)
+        {
+            case ImageFormat::Png:
+                ok = stbi_write_png_to_func(&EncodedImage::append, &ret, width, height, channel, img.data, width * channel) != 0;
+                break;
+            case ImageFormat::Jpeg:
+                ok = stbi_write_jpg_to_func(&EncodedImage::append, &ret, width, height, channel, img.data, output.quality) != 0;
+                break;
+#ifdef NODE_SD_WEBP
+            case ImageFormat::Webp:
+            {
+                if (channel != 3 && channel != 4)
+                    break;
+
+                uint8_t* webp = nullptr;
+                const auto stride = width * channel;
+                size_t size = 0;
+                if (output.lossless)
+                    size = channel == 4 ? WebPEncodeLosslessRGBA(img.data, width, height, stride, &webp) : WebPEncodeLosslessRGB(img.data, width, height, stride, &webp);
+                else
+                    size = channel == 4 ? WebPEncodeRGBA(img.data, width, height, stride, float(output.quality), &webp) : WebPEncodeRGB(img.data, width, height, stride, float(output.quality), &webp);
+
+                if (size > 0)
+                {
+                    EncodedImage::append(&ret, webp, int(size));
+                    ok = true;
+                }
+                WebPFree(webp);
+                break;
+            }
+#endif
+            default:
+                break;
+        }
+
+        if (!ok || ret.failed)
+            throw std::runtime_error("Image encoding failed");
+
+        return ret;
+    }
+
+    // Image passed into a native call. Unless a copy is requested this borrows the JS Buffer
+    // memory and holds a reference to it until the job that owns it is destroyed on the main thread.
+    class SdInputImage
+    {
+        sd_image_t img = {};
+        SdImage copy;
+        Napi::Reference<Napi::Buffer<uint8_t>> borrowed;
+    public:
+        SdInputImage() = default;
+        SdInputImage(SdImage&& copy) noexcept : img(*copy), copy(std::move(copy)) {}
+        SdInputImage(const sd_image_t& img, Napi::Buffer<uint8_t> data) : img(img), borrowed(Napi::Reference<Napi::Buffer<uint8_t>>::New(data, 1)) {}
+
+        explicit operator bool() const noexcept { return img.data != nullptr; }
+        const sd_image_t* get() const noexcept { return img.data ? &img : nullptr; }
+        const sd_image_t& operator*() const noexcept { return img; }
+        const sd_image_t* operator->() const noexcept { return &img; }
+    };
+
+    SdInputImage extractSdImage(Napi::Object imgObj, bool copyData)
+    {
+        const auto width = imgObj.Get("width").ToNumber().Int32Value();
+        const auto height = imgObj.Get("height").ToNumber().Int32Value();
+        const auto channel = imgObj.Get("channel").ToNumber().Int32Value();
+        Napi::Buffer<uint8_t>::CheckCast(imgObj.Env(), imgObj.Get("data"));
+        const auto data = imgObj.Get("data").As<Napi::Buffer<uint8_t>>();
+
+        if (width <= 0 || height <= 0 || channel <= 0)
+        {
+            throw Napi::Error::New(imgObj.Env(), "Invalid size");
+        }
+
+        const size_t expectedSize = size_t(width) * height * channel;
+        if (expectedSize != data.Length())
+        {
+            throw Napi::Error::New(imgObj.Env(), "Invalid size");
+        }
+
+        if (!copyData)
+        {
+            Metrics::Add(Metrics::instance().inputBytesBorrowed, expectedSize);
+            return SdInputImage(sd_image_t{ .width = uint32_t(width), .height = uint32_t(height), .channel = uint32_t(channel), .data = data.Data() }, data);
+        }
+
+        auto img = (sd_image_t*)calloc(1, sizeof(sd_image_t));
+        img->width = width;
+        img->height = height;
+        img->channel = channel;
+        img->data = (uint8_t*)malloc(expectedSize);
+        memcpy(img->data, data.Data(), data.Length());
+        Metrics::Add(Metrics::instance().inputBytesCopied, expectedSize);
+
+        return SdImage(img);
+    }
+
+
+    // Brand string of the CPU, thread counts measured on one model carry over to every machine with the same one
+    const std::string& cpuModelName()
+    {
+        static const auto name = []
+        {
+            std::string ret;
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+            int regs[12]{};
+            __cpuid(regs, 0x80000000);
+            if (unsigned(regs[0]) >= 0x80000004)
+            {
+                for (int i = 0; i < 3; i++)
+                    __cpuid(regs + i * 4, 0x80000002 + i);
+                ret.assign((const char*)regs, strnlen((const char*)regs, sizeof(regs)));
+            }
+#elif defined(__x86_64__) || defined(__i386__)
+            unsigned regs[12]{};
+            if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004)
+            {
+                for (unsigned i = 0; i < 3; i++)
+                    __get_cpuid(0x80000002 + i, &regs[i * 4], &regs[i * 4 + 1], &regs[i * 4 + 2], &regs[i * 4 + 3]);
+                ret.assign((const char*)regs, strnlen((const char*)regs, sizeof(regs)));
+            }
+#elif defined(__APPLE__)
+            char buffer[256]{};
+            size_t size = sizeof(buffer) - 1;
+            if (sysctlbyname("machdep.cpu.brand_string", buffer, &size, nullptr, 0) == 0)
+                ret = buffer;
+#else
+            std::ifstream cpuinfo("/proc/cpuinfo");
+            for (std::string line; ret.empty() && std::getline(cpuinfo, line);)
+            {
+                // arm kernels print no model name, the part number is the closest thing
+                if (line.starts_with("model name") || line.starts_with("CPU part"))
+                    ret = line.substr(line.find(':') + 1);
+            }
+#endif
+            const auto first = ret.find_first_not_of(" \t");
+            const auto last = ret.find_last_not_of(" \t");
+            return first == std::string::npos ? std::string("unknown") : ret.substr(first, last - first + 1);
+        }();
+        return name;
+    }
+
+    // SIMD extensions both the CPU and the OS support, the OS has to save the wider registers or using them faults
+    struct CpuFeatures
+    {
+        bool avx = false;
+        bool avx2 = false;
+        bool fma = false;
+        bool f16c = false;
+        bool avx512 = false;
+        bool avx512vbmi = false;
+        bool avx512vnni = false;
+    };
+
+    CpuFeatures cpuFeatures()
+    {
+        CpuFeatures ret;
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+#ifdef _MSC_VER
+        const auto cpuid = [](unsigned leaf, unsigned (&regs)[4]) { __cpuidex((int*)regs, int(leaf), 0); };
+        const auto xcr0 = [] { return uint64_t(_xgetbv(0)); };
+#else
+        const auto cpuid = [](unsigned leaf, unsigned (&regs)[4]) { __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]); };
+        const auto xcr0 = []
+        {
+            uint32_t eax, edx;
+            __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            return uint64_t(edx) << 32 | eax;
+        };
+#endif
+        unsigned regs[4]{};
+        cpuid(0, regs);
+        const auto maxLeaf = regs[0];
+        cpuid(1, regs);
+        const auto xcr = regs[2] & (1u << 27) ? xcr0() : 0;
+        const bool ymm = (xcr & 0x6) == 0x6;
+        const bool zmm = (xcr & 0xe6) == 0xe6;
+        ret.avx = ymm && (regs[2] & (1u << 28));
+        ret.fma = ymm && (regs[2] & (1u << 12));
+        ret.f16c = ymm && (regs[2] & (1u << 29));
+
+        if (maxLeaf >= 7)
+        {
+            cpuid(7, regs);
+            ret.avx2 = ret.avx && (regs[1] & (1u << 5));
+            // F, DQ, CD, BW and VL, what GGML_AVX512 compiles for
+            const unsigned avx512Bits = (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+            ret.avx512 = zmm && (regs[1] & avx512Bits) == avx512Bits;
+            ret.avx512vbmi = ret.avx512 && (regs[2] & (1u << 1));
+            ret.avx512vnni = ret.avx512 && (regs[2] & (1u << 11));
+        }
+#endif
+        return ret;
+    }
+
+    // Whether this host can run the ggml kernels of a CPU tier, anything not x86 only ever has the one build
+    bool cpuRunsVariant(const std::string& variant)
+    {
+        const auto f = cpuFeatures();
+        const bool avx2 = f.avx2 && f.fma && f.f16c;
+        if (variant == "avx2")
+            return avx2;
+        if (variant == "avx512")
+            return avx2 && f.avx512;
+        if (variant == "avx512vnni")
+            return avx2 && f.avx512 && f.avx512vbmi && f.avx512vnni;
+        return true;
+    }
+
+    constexpr const char* defaultThreadProfilePath = "sd-autotune.json";
+
+    struct ThreadMeasurement
+    {
+        int threads = 0;
+        double stepMs = 0;
+        double decodeMs = 0;
+        double upscaleMs = 0;
+    };
+
+    // Fastest thread counts autotune found for one CPU model and weight type. stable-diffusion.cpp takes a single
+    // thread count per context, so numThreads is the one that finishes a whole generation soonest.
+    struct ThreadProfile
+    {
+        std::string cpu;
+        std::string weightType;
+        int numThreads = 0;
+        int samplingThreads = 0;
+        int decodeThreads = 0;
+        int upscaleThreads = 0;
+        std::vector<ThreadMeasurement> measurements;
+    };
+
+    // Profiles are kept in a JSON file grouped by CPU model and then weight type, so one file can serve a mixed fleet
+    class ThreadProfiles
+    {
+        std::mutex mutex;
+
+        ThreadProfiles() = default;
+
+        static nlohmann::json Read(const std::string& path)
+        {
+            std::ifstream file(path);
+            if (!file)
+                return nlohmann::json::object();
+
+            auto json = nlohmann::json::parse(file, nullptr, false);
+            return json.is_object() ? json : nlohmann::json::object();
+        }
+
+    public:
+        static ThreadProfiles& instance()
+        {
+            static auto profiles = new ThreadProfiles();
+            return *profiles;
+        }
+
+        std::optional<ThreadProfile> Find(const std::string& path, sd_type_t weightType)
+        {
+            std::lock_guard lock(mutex);
+            const auto json = Read(path);
+            try
+            {
+                ThreadProfile profile{ .cpu = cpuModelName(), .weightType = sd_type_name(weightType) };
+                const auto& entry = json.at("profiles").at(profile.cpu).at(profile.weightType);
+                profile.numThreads = entry.at("numThreads").get<int>();
+                profile.samplingThreads = entry.value("samplingThreads", profile.numThreads);
+                profile.decodeThreads = entry.value("decodeThreads", profile.numThreads);
+                profile.upscaleThreads = entry.value("upscaleThreads", 0);
+                for (const auto& m : entry.value("measurements", nlohmann::json::array()))
+                    profile.measurements.push_back({ m.value("threads", 0), m.value("stepMs", 0.0), m.value("decodeMs", 0.0), m.value("upscaleMs", 0.0) });
+
+                if (profile.numThreads <= 0)
+                    return std::nullopt;
+
+                return profile;
+            }
+            catch (const nlohmann::json::exception&)
+            {
+                // missing or hand edited into something else, either way there is nothing to reuse
+                return std::nullopt;
+            }
+        }
+
+        // Several hosts may calibrate into the same file at once. Each writes a file of its own and renames it over
+        // the old one, then reads back whether its entry survived and merges again if another save replaced it
+        // in between. A profile that can't be written only costs the next start its calibration, not this one.
+        void Save(const std::string& path, const ThreadProfile& profile)
+        {
+            std::lock_guard lock(mutex);
+            auto measurements = nlohmann::json::array();
+            for (const auto& m : profile.measurements)
+                measurements.push_back({ { "threads", m.threads }, { "stepMs", m.stepMs }, { "decodeMs", m.decodeMs }, { "upscaleMs", m.upscaleMs } });
+
+            const nlohmann::json entry = {
+                { "numThreads", profile.numThreads },
+                { "samplingThreads", profile.samplingThreads },
+                { "decodeThreads", profile.decodeThreads },
+                { "upscaleThreads", profile.upscaleThreads },
+                { "measurements", std::move(measurements) },
+            };
+
+            for (int attempt = 0; attempt < 3; attempt++)
+            {
+                auto json = Read(path);
+                json["version"] = 1;
+                if (!json["profiles"].is_object())
+                    json["profiles"] = nlohmann::json::object();
+                if (!json["profiles"][profile.cpu].is_object())
+                    json["profiles"][profile.cpu] = nlohmann::json::object();
+                json["profiles"][profile.cpu][profile.weightType] = entry;
+
+                // written aside and renamed over the old one so a context starting meanwhile never reads half a file
+                std::error_code ec;
+                const auto tmpPath = path + ".tmp" + std::to_string(std::random_device()());
+                {
+                    std::ofstream file(tmpPath, std::ios::trunc);
+                    file << json.dump(2);
+                    if (!file)
+                    {
+                        std::filesystem::remove(tmpPath, ec);
+                        return;
+                    }
+                }
+                std::filesystem::rename(tmpPath, path, ec);
+                if (ec)
+                {
+                    std::filesystem::remove(tmpPath, ec);
+                    continue;
+                }
+
+                const auto saved = Read(path);
+                const auto profiles = saved.find("profiles");
+                if (profiles != saved.end() && profiles->is_object() && profiles->contains(profile.cpu) && (*profiles)[profile.cpu].is_object() &&
+                    (*profiles)[profile.cpu].value(profile.weightType, nlohmann::json()) == entry)
+                    return;
+            }
+        }
+    };
+
+    // numThreads may be "auto", which takes what autotune saved for this CPU and weight type, or the number of
+    // physical cores when it never ran here. Nothing is calibrated on the spot.
+    int resolveNumThreads(Napi::Value value, const std::string& profilePath, sd_type_t weightType, bool upscaler)
+    {
+        if (value.IsUndefined())
+            return GGML_DEFAULT_N_THREADS;
+
+        if (value.IsString())
+        {
+            if (value.As<Napi::String>().Utf8Value() != "auto")
+                throw Napi::Error::New(value.Env(), "Invalid numThreads");
+
+            const auto profile = ThreadProfiles::instance().Find(profilePath, weightType);
+            const auto threads = profile ? (upscaler ? profile->upscaleThreads : profile->numThreads) : 0;
+            return threads > 0 ? threads : get_num_physical_cores();
+        }
+
+        return value.ToNumber().Int32Value();
+    }
+
+    // XXH64, fed in blocks of any size
+    class Xxh64
+    {
+        static constexpr uint64_t prime1 = 11400714785074694791ull;
+        static constexpr uint64_t prime2 = 14029467366897019727ull;
+        static constexpr uint64_t prime3 = 1609587929392839161ull;
+        static constexpr uint64_t prime4 = 9650029242287828579ull;
+        static constexpr uint64_t prime5 = 2870177450012600261ull;
+
+        uint64_t seed;
+        uint64_t lanes[4];
+        uint64_t total = 0;
+        uint8_t buffer[32];
+        size_t buffered = 0;
+
+        // the weight files are little endian and so are the hosts that load them
+        static uint64_t read64(const uint8_t* p)
+        {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static uint64_t mix(uint64_t acc, uint64_t input)
+        {
+            return std::rotl(acc + input * prime2, 31) * prime1;
+        }
+
+        void stripe(const uint8_t* p)
+        {
+            for (int i = 0; i < 4; i++)
+                lanes[i] = mix(lanes[i], read64(p + i * 8));
+        }
+
+    public:
+        explicit Xxh64(uint64_t seed = 0) : seed(seed), lanes{ seed + prime1 + prime2, seed + prime2, seed, seed - prime1 } {}
+
+        void Update(const uint8_t* data, size_t n)
+        {
+            total += n;
+            if (buffered + n < sizeof(buffer))
+            {
+                memcpy(buffer + buffered, data, n);
+                buffered += n;
+                return;
+            }
+            if (buffered > 0)
+            {
+                const auto fill = sizeof(buffer) - buffered;
+                memcpy(buffer + buffered, data, fill);
+                stripe(buffer);
+                data += fill;
+                n -= fill;
+                buffered = 0;
+            }
+            for (; n >= sizeof(buffer); data += sizeof(buffer), n -= sizeof(buffer))
+                stripe(data);
+            memcpy(buffer, data, n);
+            buffered = n;
+        }
+
+        uint64_t Digest() const
+        {
+            uint64_t h = seed + prime5;
+            if (total >= sizeof(buffer))
+            {
+                h = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) + std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+                for (const auto lane : lanes)
+                    h = (h ^ mix(0, lane)) * prime1 + prime4;
+            }
+            h += total;
+
+            const uint8_t* p = buffer;
+            auto n = buffered;
+            for (; n >= 8; p += 8, n -= 8)
+                h = std::rotl(h ^ mix(0, read64(p)), 27) * prime1 + prime4;
+            if (n >= 4)
+            {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                h = std::rotl(h ^ (uint64_t(v) * prime1), 23) * prime2 + prime3;
+                p += 4;
+                n -= 4;
+            }
+            for (; n > 0; p++, n--)
+                h = std::rotl(h ^ (uint64_t(*p) * prime5), 11) * prime1;
+
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            return h;
+        }
+    };
+
+    // XXH64 of the whole weight file. Reading several gigabytes takes a while, so the digest is kept in cacheDir
+    // under the file's path, size and modification time, along with a hash of 16 blocks of 64 KiB spread over
+    // the file. It is computed again when any of those change. A file replaced by one of the same size under
+    // the same modification time, as builds with a fixed SOURCE_DATE_EPOCH or flattened container layers do,
+    // is only told apart by the sampled blocks.
+    std::string weightFileDigest(const std::string& cacheDir, const std::string& path)
+    {
+        std::error_code ec;
+        const auto size = uint64_t(std::filesystem::file_size(path, ec));
+        if (ec)
+            throw std::runtime_error("Failed to open " + path);
+
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Failed to open " + path);
+
+        const auto hex = [](uint64_t hash)
+        {
+            char digest[17];
+            snprintf(digest, sizeof(digest), "%016llx", (unsigned long long)hash);
+            return std::string(digest);
+        };
+
+        constexpr uint64_t sampleSize = 64 * 1024;
+        constexpr int samples = 16;
+        std::vector<uint8_t> block(4 * 1024 * 1024);
+        Xxh64 sampled;
+        for (int i = 0; i < samples; i++)
+        {
+            file.clear();
+            file.seekg(std::streamoff(size > sampleSize ? (size - sampleSize) * i / (samples - 1) : 0));
+            file.read((char*)block.data(), std::streamsize(sampleSize));
+            sampled.Update(block.data(), size_t(file.gcount()));
+        }
+        const auto sample = hex(sampled.Digest());
+
+        const auto canonical = std::filesystem::weakly_canonical(path, ec).string();
+        const auto mtime = int64_t(std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+        const auto stamp = canonical + '\n' + std::to_string(size) + '\n' + std::to_string(mtime);
+        Xxh64 stampHash;
+        stampHash.Update((const uint8_t*)stamp.data(), stamp.size());
+        const auto stampPath = std::filesystem::path(cacheDir) / (std::filesystem::path(path).stem().string() + '-' + hex(stampHash.Digest()) + ".digest");
+        {
+            std::ifstream stored(stampPath);
+            std::string digest;
+            std::string storedSample;
+            if (stored >> digest >> storedSample && digest.size() == 16 && storedSample == sample)
+                return digest;
+        }
+
+        file.clear();
+        file.seekg(0);
+        Xxh64 hash;
+        while (file)
+        {
+            file.read((char*)block.data(), std::streamsize(block.size()));
+            hash.Update(block.data(), size_t(file.gcount()));
+        }
+        const auto digest = hex(hash.Digest());
+
+        // written like the converted files, a digest that can't be stored is only computed again next time
+        std::filesystem::create_directories(cacheDir, ec);
+        const auto tmpPath = stampPath.string() + ".tmp" + std::to_string(std::random_device()());
+        if (std::ofstream(tmpPath) << digest << ' ' << sample << '\n')
+        {
+            std::filesystem::rename(tmpPath, stampPath, ec);
+            if (ec)
+                std::filesystem::remove(tmpPath, ec);
+        }
+        return digest;
+    }
+
+    // Converts a weight file to weightType once and returns the GGUF kept in cacheDir, loading that reads the
+    // converted tensors as they are instead of converting them again. new_sd_ctx still reads the whole file
+    // into its buffers, there is no mmap, so this saves the conversion and not the I/O.
+    std::string cachedWeightFile(const std::string& cacheDir, const std::string& path, sd_type_t weightType)
+    {
+        if (path.empty())
+            return path;
+
+        const auto name = std::filesystem::path(path).stem().string() + '-' + weightFileDigest(cacheDir, path) + '-' + sd_type_name(weightType) + ".gguf";
+        const auto cached = std::filesystem::path(cacheDir) / name;
+        std::error_code ec;
+        if (std::filesystem::exists(cached, ec))
+            return cached.string();
+
+        std::filesystem::create_directories(cacheDir, ec);
+
+        // replicas sharing the directory may convert the same file at once, each writes its own and renames it in place
+        const auto tmpPath = cached.string() + ".tmp" + std::to_string(std::random_device()());
+        if (!convert(path.c_str(), "", tmpPath.c_str(), weightType))
+        {
+            std::filesystem::remove(tmpPath, ec);
+            throw std::runtime_error("Failed to convert " + path);
+        }
+
+        std::filesystem::rename(tmpPath, cached, ec);
+        if (ec)
+        {
+            // Windows won't rename over the file another replica just finished
+            std::filesystem::remove(tmpPath, ec);
+            if (!std::filesystem::exists(cached, ec))
+                throw std::runtime_error("Failed to write " + cached.string());
+        }
+        return cached.string();
+    }
+
+    struct ContextParams
+    {
+        std::string model;
+        std::string clipL;
+        std::string clipG;
+        std::string t5xxl;
+        std::string diffusionModel;
+        std::string vae;
+        std::string taesd;
+        std::string controlNet;
+        std::string loraDir;
+        std::string embedDir;
+        std::string stackedIdEmbedDir;
+        bool vaeDecodeOnly = false;
+        bool vaeTiling = false;
+        bool freeParamsImmediately = false;
+        int numThreads = GGML_DEFAULT_N_THREADS;
+        sd_type_t weightType = SD_TYPE_F32;
+        bool cudaRng = false;
+        schedule_t schedule = DEFAULT;
+        bool keepClipOnCpu = false;
+        bool keepControlNetOnCpu = false;
+        bool keepVaeOnCpu = false;
+        bool shared = true;
+        Placement placement;
+        std::string weightCache;
+
+        static ContextParams From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            ContextParams p;
+            p.model = (tmp = params.Get("model"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.clipL = (tmp = params.Get("clipL"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.clipG = (tmp = params.Get("clipG"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.t5xxl = (tmp = params.Get("t5xxl"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.diffusionModel = (tmp = params.Get("diffusionModel"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.vae = (tmp = params.Get("vae"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.taesd = (tmp = params.Get("taesd"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.controlNet = (tmp = params.Get("controlNet"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.loraDir = (tmp = params.Get("loraDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.embedDir = (tmp = params.Get("embedDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.stackedIdEmbedDir = (tmp = params.Get("stackedIdEmbedDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.vaeDecodeOnly = (tmp = params.Get("vaeDecodeOnly"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.vaeTiling = (tmp = params.Get("vaeTiling"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.freeParamsImmediately = (tmp = params.Get("freeParamsImmediately"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.weightType = (tmp = params.Get("weightType"), tmp.IsUndefined() ? SD_TYPE_F32 : sd_type_t(tmp.ToNumber().Uint32Value()));
+            p.cudaRng = (tmp = params.Get("cudaRng"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.schedule = (tmp = params.Get("schedule"), tmp.IsUndefined() ? DEFAULT : schedule_t(tmp.ToNumber().Uint32Value()));
+            p.keepClipOnCpu = (tmp = params.Get("keepClipOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.keepControlNetOnCpu = (tmp = params.Get("keepControlNetOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.keepVaeOnCpu = (tmp = params.Get("keepVaeOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.shared = (tmp = params.Get("shared"), tmp.IsUndefined() ? true : tmp.ToBoolean().Value());
+            p.placement = Placement::From(params);
+            p.weightCache = (tmp = params.Get("weightCache"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+
+            if (p.weightType >= SD_TYPE_COUNT)
+                throw Napi::Error::New(params.Env(), "Invalid weightType");
+
+            const auto profilePath = (tmp = params.Get("autotuneProfile"), tmp.IsUndefined() ? defaultThreadProfilePath : tmp.ToString().Utf8Value());
+            p.numThreads = resolveNumThreads(params.Get("numThreads"), profilePath, p.weightType, false);
+
+            if (p.schedule >= N_SCHEDULES)
+                throw Napi::Error::New(params.Env(), "Invalid schedule");
+
+            return p;
+        }
+
+        // A context that frees its weights after the first run can't be handed to anyone else
+        bool Cacheable() const
+        {
+            return shared && !freeParamsImmediately;
+        }
+
+        std::string Key() const
+        {
+            const auto path = [](const std::string& p)
+            {
+                std::error_code ec;
+                const auto canonical = p.empty() ? std::filesystem::path() : std::filesystem::weakly_canonical(p, ec);
+                return ec ? p : canonical.string();
+            };
+
+            std::string key;
+            for (const auto& part : { path(model), path(clipL), path(clipG), path(t5xxl), path(diffusionModel), path(vae), path(taesd), path(controlNet), path(loraDir), path(embedDir), path(stackedIdEmbedDir) })
+            {
+                key += part;
+                key += '\n';
+            }
+            key += std::to_string(vaeDecodeOnly) + std::to_string(vaeTiling) + std::to_string(cudaRng) + std::to_string(keepClipOnCpu) + std::to_string(keepControlNetOnCpu) + std::to_string(keepVaeOnCpu);
+            key += '\n' + std::to_string(numThreads) + '\n' + std::to_string(weightType) + '\n' + std::to_string(schedule);
+            // weights are placed on the node that loaded them
+            key += '\n' + placement.Key();
+            return key;
+        }
+
+        // Size of the weight files, a rough guess of what the loaded context holds
+        size_t EstimateBytes() const
+        {
+            size_t bytes = 0;
+            for (const auto& file : { model, clipL, clipG, t5xxl, diffusionModel, vae, taesd, controlNet })
+            {
+                if (file.empty())
+                    continue;
+
+                std::error_code ec;
+                const auto size = std::filesystem::file_size(file, ec);
+                if (!ec)
+                    bytes += size_t(size);
+            }
+            return bytes;
+        }
+
+        // The same parameters with the main weights swapped for their converted copies in weightCache, the first
+        // load converts and writes them. The small VAE, TAESD and ControlNet files are read as they are.
+        ContextParams Cached() const
+        {
+            auto p = *this;
+            p.weightCache.clear();
+            for (auto file : { &p.model, &p.clipL, &p.clipG, &p.t5xxl, &p.diffusionModel })
+                *file = cachedWeightFile(weightCache, *file, weightType);
+            return p;
+        }
+
+        sd_ctx_t* Create() const
+        {
+            if (!weightCache.empty())
+            {
+                // a cache that can't be written (read only, disk full) costs the speedup, not the context
+                ContextParams p;
+                try
+                {
+                    p = Cached();
+                }
+                catch (const std::exception&)
+                {
+                    p = *this;
+                    p.weightCache.clear();
+                }
+                return p.Create();
+            }
+
+            return new_sd_ctx(
+                model.c_str(),
+                clipL.c_str(),
+                clipG.c_str(),
+                t5xxl.c_str(),
+                diffusionModel.c_str(),
+                vae.c_str(),
+                taesd.c_str(),
+                controlNet.c_str(),
+                loraDir.c_str(),
+                embedDir.c_str(),
+                stackedIdEmbedDir.c_str(),
+                vaeDecodeOnly,
+                vaeTiling,
+                freeParamsImmediately,
+                numThreads,
+                weightType,
+                cudaRng ? CUDA_RNG : STD_DEFAULT_RNG,
+                schedule,
+                keepClipOnCpu,
+                keepControlNetOnCpu,
+                keepVaeOnCpu
+            );
+        }
+    };
+
+    struct ModelCacheStats
+    {
+        size_t entries = 0;
+        size_t inUse = 0;
+        size_t pinned = 0;
+        size_t bytes = 0;
+        size_t memoryBudget = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Process wide cache of loaded models so contexts created with the same parameters share one sd_ctx_t. Every
+    // handle counts as a user, idle entries stay loaded while they fit into the memory budget and are evicted
+    // least recently used first. The scheduler keeps jobs on a shared sd_ctx_t from running concurrently.
+    class ModelCache
+    {
+        struct Entry
+        {
+            sd_ctx_t* sdCtx = nullptr;
+            bool loading = true;
+            bool pinned = false;
+            size_t users = 0;
+            size_t bytes = 0;
+            Clock::time_point lastUsed;
+            std::shared_ptr<MemoryFootprint> memory;
+        };
+
+        std::mutex mutex;
+        std::condition_variable loaded;
+        std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+        size_t memoryBudget = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+
+        ModelCache() = default;
+
+        size_t loadedBytes() const
+        {
+            size_t bytes = 0;
+            for (const auto& [key, entry] : entries)
+                bytes += entry->loading ? 0 : entry->bytes;
+            return bytes;
+        }
+
+        // Returns the contexts to free, that happens outside the lock
+        std::vector<sd_ctx_t*> trim()
+        {
+            std::vector<sd_ctx_t*> evicted;
+            auto bytes = loadedBytes();
+            while (true)
+            {
+                auto victim = entries.end();
+                for (auto it = entries.begin(); it != entries.end(); ++it)
+                {
+                    const auto& entry = *it->second;
+                    if (entry.loading || entry.pinned || entry.users > 0)
+                        continue;
+                    if (victim == entries.end() || entry.lastUsed < victim->second->lastUsed)
+                        victim = it;
+                }
+
+                if (victim == entries.end() || bytes <= memoryBudget)
+                    break;
+
+                bytes -= victim->second->bytes;
+                evicted.push_back(victim->second->sdCtx);
+                entries.erase(victim);
+                evictions++;
+            }
+            return evicted;
+        }
+
+        static void freeEvicted(std::vector<sd_ctx_t*>&& evicted)
+        {
+            for (const auto sdCtx : evicted)
+                free_sd_ctx(sdCtx);
+        }
+
+        void release(const std::shared_ptr<Entry>& entry)
+        {
+            std::unique_lock lock(mutex);
+            entry->users--;
+            entry->lastUsed = Clock::now();
+            auto evicted = trim();
+            lock.unlock();
+            freeEvicted(std::move(evicted));
+        }
+
+    public:
+        static ModelCache& instance()
+        {
+            static auto cache = new ModelCache();
+            return *cache;
+        }
+
+        bool Contains(const std::string& key)
+        {
+            std::lock_guard lock(mutex);
+            return entries.contains(key);
+        }
+
+        // Blocks while another caller loads the same model, returns null if loading failed
+        std::shared_ptr<sd_ctx_t> Acquire(const ContextParams& params, bool pin = false, std::shared_ptr<MemoryFootprint>* memory = nullptr)
+        {
+            const auto key = params.Key();
+            std::unique_lock lock(mutex);
+            std::shared_ptr<Entry> entry;
+            while (!entry)
+            {
+                const auto it = entries.find(key);
+                if (it == entries.end())
+                {
+                    misses++;
+                    entry = entries.emplace(key, std::make_shared<Entry>()).first->second;
+                    entry->memory = MemoryAccounting::instance().Track(params.EstimateBytes());
+                    lock.unlock();
+                    // buffer sizes logged while loading go to the entry
+                    if (tl_job)
+                        tl_job->memory = entry->memory;
+                    // a load that throws (out of memory, an abort) must not leave waiters on an entry that never loads
+                    const auto failed = [&]
+                    {
+                        lock.lock();
+                        entries.erase(key);
+                        entry->memory.reset();
+                        if (tl_job)
+                            tl_job->memory.reset();
+                        loaded.notify_all();
+                    };
+                    sd_ctx_t* sdCtx = nullptr;
+                    try
+                    {
+                        sdCtx = params.Create();
+                    }
+                    catch (...)
+                    {
+                        failed();
+                        throw;
+                    }
+                    if (!sdCtx)
+                    {
+                        failed();
+                        return nullptr;
+                    }
+                    const auto bytes = entry->memory->WeightBytes();
+                    lock.lock();
+
+                    loaded.notify_all();
+                    entry->sdCtx = sdCtx;
+                    entry->bytes = bytes;
+                    entry->loading = false;
+                }
+                else if (it->second->loading)
+                {
+                    // wait for the other load to finish, if it fails this caller tries itself
+                    loaded.wait(lock);
+                }
+                else
+                {
+                    hits++;
+                    entry = it->second;
+                }
+            }
+
+            entry->users++;
+            entry->pinned |= pin;
+            entry->lastUsed = Clock::now();
+            auto evicted = trim();
+            lock.unlock();
+            freeEvicted(std::move(evicted));
+
+            if (memory)
+                *memory = entry->memory;
+            return std::shared_ptr<sd_ctx_t>(entry->sdCtx, [entry](sd_ctx_t*) { instance().release(entry); });
+        }
+
+        // Unpins the matching entries, or every entry without a key, and frees the ones that are idle
+        size_t Evict(const std::optional<std::string>& key)
+        {
+            std::unique_lock lock(mutex);
+            std::vector<sd_ctx_t*> evicted;
+            for (auto it = entries.begin(); it != entries.end();)
+            {
+                auto& entry = *it->second;
+                if (key && it->first != *key)
+                {
+                    ++it;
+                    continue;
+                }
+
+                entry.pinned = false;
+                if (!entry.loading && entry.users == 0)
+                {
+                    evicted.push_back(entry.sdCtx);
+                    it = entries.erase(it);
+                    evictions++;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            lock.unlock();
+
+            const auto count = evicted.size();
+            freeEvicted(std::move(evicted));
+            return count;
+        }
+
+        void Configure(size_t newMemoryBudget)
+        {
+            std::unique_lock lock(mutex);
+            memoryBudget = newMemoryBudget;
+            auto evicted = trim();
+            lock.unlock();
+            freeEvicted(std::move(evicted));
+        }
+
+        ModelCacheStats Stats()
+        {
+            std::lock_guard lock(mutex);
+            ModelCacheStats stats{ .bytes = loadedBytes(), .memoryBudget = memoryBudget, .hits = hits, .misses = misses, .evictions = evictions };
+            for (const auto& [key, entry] : entries)
+            {
+                stats.entries += entry->loading ? 0 : 1;
+                stats.inUse += entry->users > 0 ? 1 : 0;
+                stats.pinned += entry->pinned ? 1 : 0;
+            }
+            return stats;
+        }
+    };
+
+    Napi::Value memoryFootprintObject(Napi::Env env, const std::shared_ptr<MemoryFootprint>& memory)
+    {
+        if (!memory)
+            return env.Undefined();
+
+        auto weights = Napi::Object::New(env);
+        for (const auto& [component, bytes] : memory->Weights())
+            weights[component] = Napi::Number::From(env, bytes);
+
+        const auto peaks = memory->ComputePeaks();
+        auto computePeaks = Napi::Array::New(env, peaks.size());
+        for (size_t i = 0; i < peaks.size(); i++)
+        {
+            auto peak = Napi::Object::New(env);
+            peak["component"] = Napi::String::New(env, peaks[i].component);
+            peak["width"] = Napi::Number::From(env, peaks[i].width);
+            peak["height"] = Napi::Number::From(env, peaks[i].height);
+            peak["bytes"] = Napi::Number::From(env, peaks[i].bytes);
+            computePeaks[i] = peak;
+        }
+
+        auto ret = Napi::Object::New(env);
+        ret["weightBytes"] = Napi::Number::From(env, memory->WeightBytes());
+        ret["measured"] = Napi::Boolean::New(env, memory->Measured());
+        ret["weights"] = weights;
+        ret["computePeaks"] = computePeaks;
+        return ret;
+    }
+
+    // A SharedArrayBuffer can only be created by JS, so a shared batch gets its memory up front on the main thread
+    // and the job writes into it. The reference keeps it alive until the job is destroyed, on the main thread too.
+    struct SharedResult
+    {
+        std::shared_ptr<Napi::ObjectReference> buffer;
+        uint8_t* data = nullptr;
+        size_t size = 0;
+
+        static SharedResult New(Napi::Env env, const OutputFormat& output, size_t size)
+        {
+            SharedResult ret;
+            if (output.layout != BatchLayout::Shared)
+                return ret;
+
+            const auto buffer = env.Global().Get("SharedArrayBuffer").As<Napi::Function>().New({ Napi::Number::From(env, size) });
+            ret.buffer = std::make_shared<Napi::ObjectReference>(Napi::Persistent(buffer));
+            // napi_create_typedarray only takes an ArrayBuffer, the JS constructor takes a SharedArrayBuffer as well
+            // and the typed array info then points into its memory
+            const auto view = env.Global().Get("Uint8Array").As<Napi::Function>().New({ buffer });
+            ret.data = view.As<Napi::Uint8Array>().Data();
+            ret.size = size;
+            return ret;
+        }
+    };
+
+    // Images produced by one job, raw or already compressed on the worker thread if an output format was asked for
+    class ImageBatch
+    {
+        SdImageList images;
+        int count;
+        ImageFormat format = ImageFormat::Raw;
+        std::vector<EncodedImage> encoded;
+        // once packed every image lives at offsets[i] in one block, owned unless it is a shared buffer
+        std::unique_ptr<uint8_t, decltype(&free)> owned{ nullptr, &free };
+        uint8_t* packed = nullptr;
+        std::vector<size_t> offsets;
+
+        Napi::Object wrapEncoded(Napi::Env env, EncodedImage& img) const
+        {
+            const auto size = img.size;
+            auto data = wrapResultBuffer(env, std::exchange(img.data, nullptr), size);
+
+            auto imgObj = Napi::Object::New(env);
+            imgObj.DefineProperties({
+                    Napi::PropertyDescriptor::Value("width",  Napi::Number::From(env, img.width)),
+                    Napi::PropertyDescriptor::Value("height",  Napi::Number::From(env, img.height)),
+                    Napi::PropertyDescriptor::Value("channel",  Napi::Number::From(env, img.channel)),
+                    Napi::PropertyDescriptor::Value("format",  Napi::String::New(env, imageFormatName(format))),
+                    Napi::PropertyDescriptor::Value("data",  data)
+                });
+
+            imgObj.Freeze();
+            return imgObj;
+        }
+
+    public:
+        ImageBatch(SdImageList&& images, int count) : images(std::move(images)), count(count)
+        {
+            if (!this->images)
+                return;
+
+            uint64_t pixels = 0;
+            for (int b = 0; b < count; b++)
+                pixels += uint64_t(this->images[b].width) * this->images[b].height;
+            Metrics::Add(Metrics::instance().images, count);
+            Metrics::Add(Metrics::instance().pixels, pixels);
+        }
+
+        // Compresses every image, spread over up to threads workers, and frees the raw pixels as it goes
+        static ImageBatch Encode(SdImageList&& images, int count, const OutputFormat& output, int threads)
+        {
+            ImageBatch batch(std::move(images), count);
+            if (output.format == ImageFormat::Raw)
+                return batch;
+
+            if (tl_job)
+                tl_job->timing.Mark(tl_job->timing.current, TimingStage::Compress);
+
+            batch.format = output.format;
+            batch.encoded.resize(count);
+            std::atomic<int> next = 0;
+            std::mutex errorMutex;
+            std::exception_ptr error;
+            const auto work = [&]
+            {
+                for (int i; (i = next++) < count;)
+                {
+                    auto& img = batch.images[i];
+                    try
+                    {
+                        batch.encoded[i] = encodeImage(img, output);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lock(errorMutex);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                    free(std::exchange(img.data, nullptr));
+                }
+            };
+
+            std::vector<std::thread> workers;
+            const auto workerCount = std::min(threads > 0 ? threads : get_num_physical_cores(), count);
+            for (int t = 1; t < workerCount; t++)
+                workers.emplace_back(work);
+            work();
+            for (auto& worker : workers)
+                worker.join();
+
+            if (tl_job)
+                tl_job->timing.Mark(TimingStage::Compress, TimingStage::Compress);
+
+            if (error)
+                std::rethrow_exception(error);
+
+            return batch;
+        }
+
+        int Count() const noexcept { return count; }
+
+        // Hands image index over to JS, it can't be taken again
+        Napi::Object Wrap(Napi::Env env, int index)
+        {
+            if (format == ImageFormat::Raw)
+                return wrapSdImage(env, images[index]);
+            return wrapEncoded(env, encoded[index]);
+        }
+
+        Napi::Object Copy(Napi::Env env, int index) const
+        {
+            if (format == ImageFormat::Raw)
+                return copySdImage(env, images[index]);
+
+            const auto& img = encoded[index];
+            EncodedImage copy;
+            copy.width = img.width;
+            copy.height = img.height;
+            copy.channel = img.channel;
+            EncodedImage::append(&copy, img.data, int(img.size));
+            if (copy.failed)
+                throw Napi::Error::New(env, "Out of memory");
+            return wrapEncoded(env, copy);
+        }
+
+        Napi::Array WrapAll(Napi::Env env)
+        {
+            auto arr = Napi::Array::New(env, count);
+            for (int b = 0; b < count; b++)
+            {
+                arr[b] = Wrap(env, b);
+            }
+            return arr;
+        }
+
+        // Moves every image into one block back to back, on the worker so JS gets a single allocation
+        void Pack(const OutputFormat& output, const SharedResult& shared)
+        {
+            if (output.layout == BatchLayout::Separate)
+                return;
+
+            offsets.assign(1, 0);
+            for (int b = 0; b < count; b++)
+            {
+                const auto size = format == ImageFormat::Raw ? size_t(images[b].width) * images[b].height * images[b].channel : encoded[b].size;
+                offsets.push_back(offsets.back() + size);
+            }
+
+            if (shared.data)
+            {
+                if (offsets.back() != shared.size)
+                    throw std::runtime_error("Images don't match the shared buffer size");
+                packed = shared.data;
+            }
+            else
+            {
+                owned.reset((uint8_t*)malloc(std::max<size_t>(1, offsets.back())));
+                if (!owned)
+                    throw std::runtime_error("Out of memory");
+                packed = owned.get();
+            }
+
+            for (int b = 0; b < count; b++)
+            {
+                auto& data = format == ImageFormat::Raw ? images[b].data : encoded[b].data;
+                memcpy(packed + offsets[b], data, offsets[b + 1] - offsets[b]);
+                free(std::exchange(data, nullptr));
+            }
+        }
+
+        // Every image as a Buffer view into one ArrayBuffer, the stride is the size of one raw image
+        Napi::Value WrapBatch(Napi::Env env, const SharedResult& shared)
+        {
+            if (!packed)
+                return WrapAll(env);
+
+            const auto total = offsets.back();
+            Napi::Object buffer;
+            if (shared.buffer)
+            {
+                buffer = shared.buffer->Value();
+            }
+            else
+            {
+                Metrics::Add(Metrics::instance().outputBytesWrapped, total);
+                MemoryAccounting::instance().ResultAllocated(total);
+                buffer = Napi::ArrayBuffer::New(env, owned.release(), total, [total](Napi::Env, void* data)
+                {
+                    free(data);
+                    MemoryAccounting::instance().ResultFreed(total);
+                    JobScheduler::instance().memoryReleased();
+                });
+            }
+
+            const auto bufferClass = env.Global().Get("Buffer").As<Napi::Object>();
+            const auto bufferFrom = bufferClass.Get("from").As<Napi::Function>();
+            auto arr = Napi::Array::New(env, count);
+            for (int b = 0; b < count; b++)
+            {
+                const auto data = bufferFrom.Call(bufferClass, { buffer, Napi::Number::From(env, offsets[b]), Napi::Number::From(env, offsets[b + 1] - offsets[b]) });
+                const auto width = format == ImageFormat::Raw ? images[b].width : encoded[b].width;
+                const auto height = format == ImageFormat::Raw ? images[b].height : encoded[b].height;
+                const auto channel = format == ImageFormat::Raw ? images[b].channel : encoded[b].channel;
+
+                auto imgObj = Napi::Object::New(env);
+                imgObj.DefineProperties({
+                        Napi::PropertyDescriptor::Value("width",  Napi::Number::From(env, width)),
+                        Napi::PropertyDescriptor::Value("height",  Napi::Number::From(env, height)),
+                        Napi::PropertyDescriptor::Value("channel",  Napi::Number::From(env, channel)),
+                        Napi::PropertyDescriptor::Value("data",  data)
+                    });
+                if (format != ImageFormat::Raw)
+                    imgObj.DefineProperty(Napi::PropertyDescriptor::Value("format", Napi::String::New(env, imageFormatName(format))));
+                imgObj.Freeze();
+                arr[b] = imgObj;
+            }
+
+            auto batchObj = Napi::Object::New(env);
+            batchObj.DefineProperties({
+                    Napi::PropertyDescriptor::Value("buffer",  buffer),
+                    Napi::PropertyDescriptor::Value("stride",  Napi::Number::From(env, format == ImageFormat::Raw && count > 0 ? offsets[1] : 0)),
+                    Napi::PropertyDescriptor::Value("images",  arr)
+                });
+            arr.Freeze();
+            batchObj.Freeze();
+            return batchObj;
+        }
+    };
+
+    // stable-diffusion.cpp picks a random seed for a negative one on every call, a stream of single image runs draws
+    // it once up front so its images are seed, seed + 1, ... like those of one batched run
+    int64_t streamSeed(int64_t seed)
+    {
+        return seed < 0 ? int64_t(std::random_device()() & INT32_MAX) : seed;
+    }
+
+    struct Txt2ImgParams
+    {
+        std::string prompt;
+        std::string negativePrompt;
+        int clipSkip = -1;
+        float cfgScale = 7.0f;
+        float guidance = 0.0f;
+        int width = 512;
+        int height = 512;
+        sample_method_t sampleMethod = EULER_A;
+        int sampleSteps = 20;
+        int64_t seed = 42;
+        int batchCount = 1;
+        SdInputImage controlCond;
+        float controlStrength = 0.0f;
+        float styleRatio = 20.0f;
+        bool normalizeInput = false;
+        std::string inputIdImagesPath;
+        OutputFormat output;
+
+        static Txt2ImgParams From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            Txt2ImgParams p;
+            const auto copyInputs = (tmp = params.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.prompt = params.Get("prompt").ToString().Utf8Value();
+            p.negativePrompt = (tmp = params.Get("negativePrompt"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.clipSkip = (tmp = params.Get("clipSkip"), tmp.IsUndefined() ? -1 : tmp.ToNumber().Int32Value());
+            p.cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
+            p.width = (tmp = params.Get("width"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
+            p.height = (tmp = params.Get("height"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
+            p.sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
+            p.sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
+            p.seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
+            p.batchCount = (tmp = params.Get("batchCount"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value());
+            p.controlCond = (tmp = params.Get("controlCond"), tmp.IsUndefined() ? SdInputImage() : extractSdImage(tmp.ToObject(), copyInputs));
+            p.controlStrength = (tmp = params.Get("controlStrength"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
+            p.styleRatio = (tmp = params.Get("styleRatio"), tmp.IsUndefined() ? 20.0f : tmp.ToNumber().FloatValue());
+            p.normalizeInput = (tmp = params.Get("normalizeInput"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.inputIdImagesPath = (tmp = params.Get("inputIdImagesPath"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.guidance = (tmp = params.Get("guidance"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
+            p.output = OutputFormat::From(params);
+
+            if (p.sampleMethod >= N_SAMPLE_METHODS)
+                throw Napi::Error::New(params.Env(), "Invalid sampleMethod");
+
+            return p;
+        }
+
+        // Everything but the seed range, requests with equal keys can share a batched run. Control images aren't compared,
+        // and a negative seed asks stable-diffusion.cpp for a random one, which is no range to merge with.
+        std::optional<std::string> BatchKey() const
+        {
+            if (controlCond || seed < 0)
+                return std::nullopt;
+
+            std::string key = prompt + '\0' + negativePrompt + '\0' + inputIdImagesPath + '\0';
+            const auto append = [&](const auto& value) { key.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+            append(clipSkip);
+            append(cfgScale);
+            append(guidance);
+            append(width);
+            append(height);
+            append(sampleMethod);
+            append(sampleSteps);
+            append(styleRatio);
+            append(normalizeInput);
+            append(output.format);
+            append(output.quality);
+            append(output.lossless);
+            return key;
+        }
+
+        // stable-diffusion.cpp seeds batch item b with seed + b, so a batch can be split into single runs that produce the same images
+        SdImageList Run(sd_ctx_t* sdCtx, int64_t seed, int batchCount) const
+        {
+            auto images = SdImageList(txt2img(
+                sdCtx,
+                prompt.c_str(),
+                negativePrompt.c_str(),
+                clipSkip,
+                cfgScale,
+                guidance,
+                width,
+                height,
+                sampleMethod,
+                sampleSteps,
+                seed,
+                batchCount,
+                controlCond.get(),
+                controlStrength,
+                styleRatio,
+                normalizeInput,
+                inputIdImagesPath.c_str()
+            ), batchCount);
+
+            if (!images)
+                throw std::runtime_error("txt2img failed");
+
+            return images;
+        }
+    };
+
+    // The LoRAs and multipliers a prompt asks for, read from its <lora:name:multiplier> tags the way
+    // stable-diffusion.cpp does. Repeated names add up, a multiplier of 0 is no LoRA.
+    std::map<std::string, float> promptLoras(const std::string& prompt)
+    {
+        static const std::regex tag("<lora:([^:]+):([^>]+)>");
+        std::map<std::string, float> loras;
+        for (auto it = std::sregex_iterator(prompt.begin(), prompt.end(), tag); it != std::sregex_iterator(); ++it)
+            loras[(*it)[1].str()] += strtof((*it)[2].str().c_str(), nullptr);
+        std::erase_if(loras, [](const auto& lora) { return lora.second == 0.0f; });
+        return loras;
+    }
+
+    std::string loraSetKey(const std::map<std::string, float>& loras)
+    {
+        std::string key;
+        for (const auto& [name, multiplier] : loras)
+            key += name + ':' + std::to_string(multiplier) + '\n';
+        return key;
+    }
+
+    struct LoraCacheOptions
+    {
+        // LoRA sets held merged at once, the context's own weights included, 0 disables the cache
+        int maxSets = 0;
+        // Weights of the context and its variants together, 0 leaves it to the process memory budget
+        size_t memoryLimit = 0;
+
+        static LoraCacheOptions From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            LoraCacheOptions o;
+            if (tmp = params.Get("loraCache"), tmp.IsUndefined())
+                return o;
+
+            const auto cache = tmp.ToObject();
+            o.maxSets = (tmp = cache.Get("maxSets"), tmp.IsUndefined() ? 2 : tmp.ToNumber().Int32Value());
+            o.memoryLimit = (tmp = cache.Get("memoryLimit"), tmp.IsUndefined() ? 0 : size_t(std::max(0.0, tmp.ToNumber().DoubleValue())));
+
+            if (o.maxSets < 1)
+                throw Napi::Error::New(params.Env(), "Invalid loraCache maxSets");
+
+            return o;
+        }
+    };
+
+    struct LoraCacheStats
+    {
+        std::vector<std::map<std::string, float>> sets;
+        size_t weightBytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t loads = 0;
+        int maxSets = 0;
+        size_t memoryLimit = 0;
+    };
+
+    // stable-diffusion.cpp merges the LoRAs a prompt names straight into the context's weights and merges again
+    // whenever the next prompt names a different set, its API has no way to hold merged tensors on the side. So
+    // every further set gets a private copy of the context which keeps that set merged, and a prompt whose set
+    // one of them holds runs there without merging. A set nobody holds gets a copy of its own while there is
+    // room, once the cache is full it takes over the least recently used one.
+    // Only the context's own jobs use the copies and those never run concurrently, the lock is for stats readers.
+    class LoraVariants
+    {
+        struct Variant
+        {
+            // null for the context's own weights, which may be shared with other contexts
+            std::shared_ptr<sd_ctx_t> sdCtx;
+            std::shared_ptr<MemoryFootprint> memory;
+            std::map<std::string, float> loras;
+            std::string key;
+            uint64_t lastUsed = 0;
+        };
+
+        ContextParams params;
+        LoraCacheOptions options;
+        std::shared_ptr<MemoryFootprint> baseMemory;
+        mutable std::mutex mutex;
+        std::vector<Variant> variants;
+        uint64_t clock = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t loads = 0;
+
+        size_t BaseBytes() const
+        {
+            return baseMemory ? baseMemory->WeightBytes() : params.EstimateBytes();
+        }
+
+        // Whether one more copy fits into maxSets and the memory limit
+        bool CanGrow(size_t count) const
+        {
+            return count < size_t(options.maxSets) && (options.memoryLimit == 0 || (count + 1) * BaseBytes() <= options.memoryLimit);
+        }
+
+        Variant& LeastRecentlyUsed()
+        {
+            return *std::min_element(variants.begin(), variants.end(), [](const auto& a, const auto& b) { return a.lastUsed < b.lastUsed; });
+        }
+
+        // Loads a copy for the set when one more fits into maxSets, the memory limit and the scheduler's budget,
+        // null if it doesn't or the load fails. The set is merged by the first run on it.
+        sd_ctx_t* Load(const std::map<std::string, float>& loras, const std::string& key)
+        {
+            {
+                std::lock_guard lock(mutex);
+                if (!CanGrow(variants.size()) || !JobScheduler::instance().FitsMemory(BaseBytes()))
+                    return nullptr;
+            }
+
+            // the copy's weights are measured into a footprint of its own
+            auto& job = *tl_job;
+            const auto contextMemory = job.memory;
+            Variant variant{ .memory = MemoryAccounting::instance().Track(params.EstimateBytes()), .loras = loras, .key = key };
+            job.memory = variant.memory;
+            try
+            {
+                variant.sdCtx = { params.Create(), [](sd_ctx_t* c) { if (c) free_sd_ctx(c); } };
+            }
+            catch (const std::exception&)
+            {
+                // a copy that can't be loaded only costs the merge
+            }
+            catch (...)
+            {
+                job.memory = contextMemory;
+                throw;
+            }
+            job.memory = contextMemory;
+            if (!variant.sdCtx)
+                return nullptr;
+
+            const auto sdCtx = variant.sdCtx.get();
+            std::lock_guard lock(mutex);
+            variant.lastUsed = ++clock;
+            variants.push_back(std::move(variant));
+            loads++;
+            return sdCtx;
+        }
+
+        // Hands the least recently used slot to the set, stable-diffusion.cpp merges it there during the next run
+        sd_ctx_t* Replace(const std::map<std::string, float>& loras, const std::string& key, const std::shared_ptr<sd_ctx_t>& base)
+        {
+            std::lock_guard lock(mutex);
+            auto& variant = LeastRecentlyUsed();
+            variant.loras = loras;
+            variant.key = key;
+            variant.lastUsed = ++clock;
+            return variant.sdCtx ? variant.sdCtx.get() : base.get();
+        }
+
+    public:
+        LoraVariants(const ContextParams& contextParams, const LoraCacheOptions& options, const std::shared_ptr<MemoryFootprint>& baseMemory) :
+            params(contextParams), options(options), baseMemory(baseMemory)
+        {
+            params.shared = false;
+            variants.push_back({});
+        }
+
+        sd_ctx_t* Route(const std::string& prompt, const std::shared_ptr<sd_ctx_t>& base)
+        {
+            const auto loras = promptLoras(prompt);
+            const auto key = loraSetKey(loras);
+
+            {
+                std::lock_guard lock(mutex);
+                const auto it = std::find_if(variants.begin(), variants.end(), [&](const auto& variant) { return variant.key == key; });
+                if (it != variants.end())
+                {
+                    hits++;
+                    it->lastUsed = ++clock;
+                    return it->sdCtx ? it->sdCtx.get() : base.get();
+                }
+                misses++;
+            }
+
+            // the run that misses pays for loading the copy, later ones with the set don't merge at all
+            if (const auto sdCtx = Load(loras, key))
+                return sdCtx;
+
+            return Replace(loras, key, base);
+        }
+
+        // Weights the copies for these sets are expected to add, what the scheduler holds memory for
+        size_t LoadBytes(const std::vector<std::map<std::string, float>>& sets) const
+        {
+            std::lock_guard lock(mutex);
+            auto count = variants.size();
+            size_t bytes = 0;
+            for (const auto& loras : sets)
+            {
+                const auto key = loraSetKey(loras);
+                if (std::none_of(variants.begin(), variants.end(), [&](const auto& variant) { return variant.key == key; }) && CanGrow(count))
+                {
+                    count++;
+                    bytes += BaseBytes();
+                }
+            }
+            return bytes;
+        }
+
+        // Loads a copy for each set not held yet while there is room, after that sets replace the least recently
+        // used ones, and merges it with a one step generation at the smallest size
+        void Preload(const std::vector<std::map<std::string, float>>& sets, const std::shared_ptr<sd_ctx_t>& base)
+        {
+            auto& job = *tl_job;
+            for (const auto& loras : sets)
+            {
+                const auto key = loraSetKey(loras);
+                {
+                    std::lock_guard lock(mutex);
+                    const auto it = std::find_if(variants.begin(), variants.end(), [&](const auto& variant) { return variant.key == key; });
+                    if (it != variants.end())
+                    {
+                        it->lastUsed = ++clock;
+                        continue;
+                    }
+                }
+
+                auto target = Load(loras, key);
+                if (!target)
+                    target = Replace(loras, key, base);
+
+                Txt2ImgParams run;
+                for (const auto& [name, multiplier] : loras)
+                    run.prompt += "<lora:" + name + ':' + std::to_string(multiplier) + '>';
+                run.width = 64;
+                run.height = 64;
+                run.sampleSteps = 1;
+                job.width = run.width;
+                job.height = run.height;
+                run.Run(target, 0, 1);
+            }
+        }
+
+        LoraCacheStats Stats() const
+        {
+            std::lock_guard lock(mutex);
+            LoraCacheStats stats;
+            for (const auto& variant : variants)
+            {
+                stats.sets.push_back(variant.loras);
+                if (variant.memory)
+                    stats.weightBytes += variant.memory->WeightBytes();
+            }
+            stats.hits = hits;
+            stats.misses = misses;
+            stats.loads = loads;
+            stats.maxSets = options.maxSets;
+            stats.memoryLimit = options.memoryLimit;
+            return stats;
+        }
+    };
+
+    sd_ctx_t* CPPContextData::SdCtxFor(const std::shared_ptr<sd_ctx_t>& base, const std::string& prompt)
+    {
+        return loras ? loras->Route(prompt, base) : base.get();
+    }
+
+    struct Img2ImgParams
+    {
+        SdInputImage initImage;
+        std::string prompt;
+        std::string negativePrompt;
+        int clipSkip = -1;
+        float cfgScale = 7.0f;
+        float guidance = 0.0f;
+        int width = 0;
+        int height = 0;
+        sample_method_t sampleMethod = EULER_A;
+        int sampleSteps = 20;
+        float strength = 0.75f;
+        int64_t seed = 42;
+        int batchCount = 1;
+        SdInputImage controlCond;
+        float controlStrength = 0.0f;
+        float styleRatio = 20.0f;
+        bool normalizeInput = false;
+        std::string inputIdImagesPath;
+        OutputFormat output;
+
+        static Img2ImgParams From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            Img2ImgParams p;
+            const auto copyInputs = (tmp = params.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.initImage = (tmp = params.Get("initImage"), tmp.IsUndefined() ? SdInputImage() : extractSdImage(tmp.ToObject(), copyInputs));
+            p.prompt = params.Get("prompt").ToString().Utf8Value();
+            p.negativePrompt = (tmp = params.Get("negativePrompt"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.clipSkip = (tmp = params.Get("clipSkip"), tmp.IsUndefined() ? -1 : tmp.ToNumber().Int32Value());
+            p.cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
+            p.width = (tmp = params.Get("width"), tmp.IsUndefined() ? int(p.initImage->width) : tmp.ToNumber().Int32Value());
+            p.height = (tmp = params.Get("height"), tmp.IsUndefined() ? int(p.initImage->height) : tmp.ToNumber().Int32Value());
+            p.sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
+            p.sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
+            p.strength = (tmp = params.Get("strength"), tmp.IsUndefined() ? 0.75f : tmp.ToNumber().FloatValue());
+            p.seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
+            p.batchCount = (tmp = params.Get("batchCount"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value());
+            p.controlCond = (tmp = params.Get("controlCond"), tmp.IsUndefined() ? SdInputImage() : extractSdImage(tmp.ToObject(), copyInputs));
+            p.controlStrength = (tmp = params.Get("controlStrength"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
+            p.styleRatio = (tmp = params.Get("styleRatio"), tmp.IsUndefined() ? 20.0f : tmp.ToNumber().FloatValue());
+            p.normalizeInput = (tmp = params.Get("normalizeInput"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.inputIdImagesPath = (tmp = params.Get("inputIdImagesPath"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            p.guidance = (tmp = params.Get("guidance"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
+            p.output = OutputFormat::From(params);
+
+            if (p.sampleMethod >= N_SAMPLE_METHODS)
+                throw Napi::Error::New(params.Env(), "Invalid sampleMethod");
+
+            return p;
+        }
+
+        SdImageList Run(sd_ctx_t* sdCtx, int64_t seed, int batchCount) const
+        {
+            auto images = SdImageList(img2img(
+                sdCtx,
+                *initImage,
+                prompt.c_str(),
+                negativePrompt.c_str(),
+                clipSkip,
+                cfgScale,
+                guidance,
+                width,
+                height,
+                sampleMethod,
+                sampleSteps,
+                strength,
+                seed,
+                batchCount,
+                controlCond.get(),
+                controlStrength,
+                styleRatio,
+                normalizeInput,
+                inputIdImagesPath.c_str()
+            ), batchCount);
+
+            if (!images)
+                throw std::runtime_error("img2img failed");
+
+            return images;
+        }
+    };
+
+    struct Img2VidParams
+    {
+        SdInputImage initImage;
+        int width = 0;
+        int height = 0;
+        int videoFrames = 6;
+        int motionBucketId = 127;
+        int fps = 6;
+        float augmentationLevel = 0.0f;
+        float minCfg = 1.0f;
+        float cfgScale = 7.0f;
+        sample_method_t sampleMethod = EULER_A;
+        int sampleSteps = 20;
+        float strength = 0.75f;
+        int64_t seed = 42;
+        OutputFormat output;
+
+        static Img2VidParams From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            Img2VidParams p;
+            const auto copyInputs = (tmp = params.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            p.initImage = (tmp = params.Get("initImage"), tmp.IsUndefined() ? SdInputImage() : extractSdImage(tmp.ToObject(), copyInputs));
+            p.width = (tmp = params.Get("width"), tmp.IsUndefined() ? int(p.initImage->width) : tmp.ToNumber().Int32Value());
+            p.height = (tmp = params.Get("height"), tmp.IsUndefined() ? int(p.initImage->height) : tmp.ToNumber().Int32Value());
+            p.videoFrames = (tmp = params.Get("videoFrames"), tmp.IsUndefined() ? 6 : tmp.ToNumber().Int32Value());
+            p.motionBucketId = (tmp = params.Get("motionBucketId"), tmp.IsUndefined() ? 127 : tmp.ToNumber().Int32Value());
+            p.fps = (tmp = params.Get("fps"), tmp.IsUndefined() ? 6 : tmp.ToNumber().Int32Value());
+            p.augmentationLevel = (tmp = params.Get("augmentationLevel"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
+            p.minCfg = (tmp = params.Get("minCfg"), tmp.IsUndefined() ? 1.0f : tmp.ToNumber().FloatValue());
+            p.cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
+            p.sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
+            p.sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
+            p.strength = (tmp = params.Get("strength"), tmp.IsUndefined() ? 0.75f : tmp.ToNumber().FloatValue());
+            p.seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
+            p.output = OutputFormat::From(params);
+
+            if (p.sampleMethod >= N_SAMPLE_METHODS)
+                throw Napi::Error::New(params.Env(), "Invalid sampleMethod");
+
+            return p;
+        }
+
+        SdImageList Run(sd_ctx_t* sdCtx) const
+        {
+            auto images = SdImageList(img2vid(sdCtx, *initImage, width, height, videoFrames, motionBucketId, fps, augmentationLevel, minCfg, cfgScale, sampleMethod, sampleSteps, strength, seed), videoFrames);
+
+            if (!images)
+                throw std::runtime_error("img2vid failed");
+
+            return images;
+        }
+    };
+
+    template <typename T, typename C>
+    Napi::Promise queueStableDiffusionWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, T&& func, C&& convFunc, const JobOptions& options = {})
+    {
+        class StableDiffusionWorker : public ContextWorker
+        {
+            std::decay_t<T> func;
+            std::decay_t<C> convFunc;
+            std::optional<std::invoke_result_t<decltype(func), CPPContextData&>> result;
+        public:
+            StableDiffusionWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, T&& func, C&& convFunc, const JobOptions& options) : ContextWorker(env, ctx, options),
+                func(std::forward<T>(func)), convFunc(std::forward<C>(convFunc))
+            {
+            }
+
+            void Run() override
+            {
+                result.emplace(func(*ctx));
+            }
+
+            Napi::Value Convert(Napi::Env env) override
+            {
+                return convFunc(env, std::move(result).value());
+            }
+        };
+
+        const auto signal = options.signal;
+        const bool hasSignal = !signal.IsUndefined() && !signal.IsNull();
+        if (hasSignal && signal.ToObject().Get("aborted").ToBoolean())
+        {
+            Metrics::instance().JobSettled(options.kind, "aborted");
+            auto def = Napi::Promise::Deferred::New(env);
+            def.Reject(signal.ToObject().Get("reason"));
+            return def.Promise();
+        }
+
+        // a generation adds compute and result buffers to the context's weights, a load adds the weights
+        const auto memoryBytes = options.images > 0 && ctx->memory ? ctx->memory->EstimateRunBytes(options.width, options.height, options.images) : options.loadBytes;
+        const auto admission = JobScheduler::instance().admit(options.limited, memoryBytes);
+        if (admission != JobScheduler::Admission::Admitted)
+        {
+            Metrics::instance().JobSettled(options.kind, "rejected");
+            auto def = Napi::Promise::Deferred::New(env);
+            def.Reject(Napi::Error::New(env, admission == JobScheduler::Admission::QueueFull ? "Job queue is full" : "Memory budget exceeded").Value());
+            return def.Promise();
+        }
+
+        auto worker = std::make_unique<StableDiffusionWorker>(env, ctx, std::forward<T>(func), std::forward<C>(convFunc), options);
+        worker->memoryBytes = memoryBytes;
+        const auto ret = worker->Promise();
+        if (hasSignal)
+            worker->ListenForAbort(signal.ToObject());
+
+        ctx->queueTask(std::move(worker));
+        return ret;
+    }
+
+    Napi::Object iteratorResult(Napi::Env env, Napi::Value value, bool done)
+    {
+        auto ret = Napi::Object::New(env);
+        ret["value"] = value;
+        ret["done"] = Napi::Boolean::New(env, done);
+        return ret;
+    }
+
+    // Async iterator returned by the *Stream methods. Images are produced by separate jobs that are only queued
+    // once the consumer asks for them, with at most highWaterMark of them ahead, so native code can't run far
+    // ahead of a slow consumer and other work on the context can interleave between images.
+    class ImageStream : public std::enable_shared_from_this<ImageStream>
+    {
+    public:
+        using ProduceFunc = std::function<Napi::Value(Napi::Env env, int index, const JobOptions& options)>;
+
+        static Napi::Object New(Napi::Env env, const char* kind, int count, Napi::Object params, ProduceFunc&& produce, int defaultHighWaterMark = 1)
+        {
+            Napi::Value tmp;
+            auto stream = std::make_shared<ImageStream>();
+            stream->kind = kind;
+            stream->count = count;
+            stream->highWaterMark = std::max(1, (tmp = params.Get("highWaterMark"), tmp.IsUndefined() ? defaultHighWaterMark : tmp.ToNumber().Int32Value()));
+            stream->priority = (tmp = params.Get("priority"), tmp.IsUndefined() ? 0 : tmp.ToNumber().Int32Value());
+            stream->produce = std::move(produce);
+            if (tmp = params.Get("onTiming"), !tmp.IsUndefined())
+            {
+                Napi::Function::CheckCast(env, tmp);
+                stream->onTiming = Napi::Persistent(tmp.As<Napi::Function>());
+            }
+            stream->controller = Napi::Persistent(env.Global().Get("AbortController").As<Napi::Function>().New({}));
+
+            const auto signal = params.Get("signal");
+            if (!signal.IsUndefined() && !signal.IsNull())
+            {
+                const auto signalObj = signal.ToObject();
+                if (signalObj.Get("aborted").ToBoolean())
+                {
+                    stream->close(signalObj.Get("reason"));
+                }
+                else
+                {
+                    auto listenerOptions = Napi::Object::New(env);
+                    listenerOptions["once"] = Napi::Boolean::New(env, true);
+                    auto forward = Napi::Function::New(env, [weak = std::weak_ptr<ImageStream>(stream)](const Napi::CallbackInfo& info)
+                    {
+                        if (const auto stream = weak.lock())
+                            stream->close(info.This().ToObject().Get("reason"));
+                    }, "onAbort");
+                    signalObj.Get("addEventListener").As<Napi::Function>().Call(signalObj, { Napi::String::New(env, "abort"), forward, listenerOptions });
+                }
+            }
+
+            auto iterator = Napi::Object::New(env);
+            iterator["next"] = Napi::Function::New(env, [stream](const Napi::CallbackInfo& info) { return stream->Next(info.Env()); }, "next");
+            iterator["return"] = Napi::Function::New(env, [stream](const Napi::CallbackInfo& info)
+            {
+                stream->close(info.Env().Undefined());
+                stream->pending.clear();
+                auto def = Napi::Promise::Deferred::New(info.Env());
+                def.Resolve(iteratorResult(info.Env(), info[0], true));
+                return def.Promise();
+            }, "return");
+            iterator.Set(Napi::Symbol::WellKnown(env, "asyncIterator"), Napi::Function::New(env, [](const Napi::CallbackInfo& info) { return info.This(); }));
+            return iterator;
+        }
+
+    private:
+        const char* kind = "internal";
+        int count = 0;
+        int highWaterMark = 1;
+        int priority = 0;
+        int requested = 0;
+        bool closed = false;
+        ProduceFunc produce;
+        Napi::FunctionReference onTiming;
+        Napi::ObjectReference controller;
+        std::deque<Napi::ObjectReference> pending;
+
+        void close(Napi::Value reason)
+        {
+            if (closed)
+                return;
+
+            closed = true;
+            const auto controllerObj = controller.Value();
+            controllerObj.Get("abort").As<Napi::Function>().Call(controllerObj, { reason });
+        }
+
+        void fill(Napi::Env env)
+        {
+            while (!closed && requested < count && int(pending.size()) < highWaterMark)
+            {
+                const auto options = JobOptions{
+                    .signal = controller.Value().Get("signal"),
+                    .priority = priority,
+                    .limited = true,
+                    .kind = kind,
+                    .onTiming = onTiming.IsEmpty() ? env.Undefined() : onTiming.Value(),
+                };
+                const auto promise = produce(env, requested++, options).ToObject();
+                // mark it handled, a prefetched image that fails is only reported once it is asked for
+                promise.Get("catch").As<Napi::Function>().Call(promise, { Napi::Function::New(env, [](const Napi::CallbackInfo&) {}) });
+                pending.emplace_back(Napi::Persistent(promise));
+            }
+        }
+
+        Napi::Value Next(Napi::Env env)
+        {
+            fill(env);
+            if (pending.empty())
+            {
+                auto def = Napi::Promise::Deferred::New(env);
+                def.Resolve(iteratorResult(env, env.Undefined(), true));
+                return def.Promise();
+            }
+
+            const auto promise = pending.front().Value();
+            pending.pop_front();
+            fill(env);
+
+            auto onFulfilled = Napi::Function::New(env, [](const Napi::CallbackInfo& info) { return iteratorResult(info.Env(), info[0], false); });
+            auto onRejected = Napi::Function::New(env, [self = shared_from_this()](const Napi::CallbackInfo& info)
+            {
+                // nothing after a failed image is worth producing
+                self->close(info[0]);
+                auto def = Napi::Promise::Deferred::New(info.Env());
+                def.Reject(info[0]);
+                return def.Promise();
+            });
+            return promise.Get("then").As<Napi::Function>().Call(promise, { onFulfilled, onRejected });
+        }
+    };
+
+    // Opt in per context. txt2img calls that arrive within the window and differ only in their seed range are
+    // merged into one batched run when the ranges touch, since upstream can only batch consecutive seeds of one
+    // prompt. The images are split back up between the callers.
+    class Txt2ImgCoalescer : public std::enable_shared_from_this<Txt2ImgCoalescer>
+    {
+        struct Batch;
+
+        struct Request
+        {
+            std::shared_ptr<const Txt2ImgParams> params;
+            std::shared_ptr<sd_ctx_t> sdCtx;
+            Napi::Promise::Deferred def;
+            int priority = 0;
+            Napi::ObjectReference signal;
+            Napi::FunctionReference abortListener;
+            std::weak_ptr<Batch> batch;
+            bool settled = false;
+
+            void Settle()
+            {
+                settled = true;
+                if (signal.IsEmpty())
+                    return;
+
+                auto signalObj = signal.Value();
+                signalObj.Get("removeEventListener").As<Napi::Function>().Call(signalObj, { Napi::String::New(def.Env(), "abort"), abortListener.Value() });
+                signal.Reset();
+                abortListener.Reset();
+            }
+
+            void Resolve(Napi::Value value)
+            {
+                if (settled)
+                    return;
+                Settle();
+                def.Resolve(value);
+            }
+
+            void Reject(Napi::Value reason)
+            {
+                if (settled)
+                    return;
+                Settle();
+                def.Reject(reason);
+            }
+        };
+
+        struct Batch
+        {
+            std::vector<std::shared_ptr<Request>> members;
+            Napi::ObjectReference controller;
+        };
+
+        std::shared_ptr<CPPContextData> ctx;
+        int windowMs;
+        std::vector<std::pair<std::string, std::vector<std::shared_ptr<Request>>>> groups;
+        bool timerPending = false;
+
+        static void onRequestAborted(const std::shared_ptr<Request>& request)
+        {
+            request->Reject(request->signal.Value().Get("reason"));
+
+            // a batch nobody waits for anymore is aborted as well
+            const auto batch = request->batch.lock();
+            if (batch && std::all_of(batch->members.begin(), batch->members.end(), [](const auto& member) { return member->settled; }))
+            {
+                const auto controllerObj = batch->controller.Value();
+                controllerObj.Get("abort").As<Napi::Function>().Call(controllerObj, {});
+            }
+        }
+
+        void dispatch(Napi::Env env, std::vector<std::shared_ptr<Request>>&& members, int64_t firstSeed, int count)
+        {
+            auto batch = std::make_shared<Batch>();
+            batch->members = std::move(members);
+            batch->controller = Napi::Persistent(env.Global().Get("AbortController").As<Napi::Function>().New({}));
+
+            int priority = INT_MIN;
+            for (const auto& member : batch->members)
+            {
+                member->batch = batch;
+                priority = std::max(priority, member->priority);
+            }
+
+            const auto& first = batch->members.front();
+            const auto options = JobOptions{ .signal = batch->controller.Value().Get("signal"), .priority = priority, .limited = true, .kind = "txt2img" }
+                .WithWorkload(first->params->width, first->params->height, count);
+            const auto promise = queueStableDiffusionWorker(env, ctx, [sdCtx = first->sdCtx, params = first->params, firstSeed, count](CPPContextData& ctx)
+            {
+                return ImageBatch::Encode(params->Run(ctx.SdCtxFor(sdCtx, params->prompt), firstSeed, count), count, params->output, ctx.numThreads);
+            },
+            [batch, firstSeed, count](Napi::Env env, ImageBatch&& images)
+            {
+                // the last caller to need an image takes it over, anyone before that gets a copy
+                std::vector<size_t> lastUser(count, SIZE_MAX);
+                for (size_t m = 0; m < batch->members.size(); m++)
+                {
+                    const auto& member = *batch->members[m];
+                    for (int b = 0; b < member.params->batchCount && !member.settled; b++)
+                        lastUser[member.params->seed + b - firstSeed] = m;
+                }
+
+                for (size_t m = 0; m < batch->members.size(); m++)
+                {
+                    auto& member = *batch->members[m];
+                    if (member.settled)
+                        continue;
+
+                    auto arr = Napi::Array::New(env, member.params->batchCount);
+                    for (int b = 0; b < member.params->batchCount; b++)
+                    {
+                        const auto index = size_t(member.params->seed + b - firstSeed);
+                        arr[b] = lastUser[index] == m ? images.Wrap(env, int(index)) : images.Copy(env, int(index));
+                    }
+                    member.Resolve(arr);
+                }
+                return env.Undefined();
+            }, options);
+
+            auto onFailed = Napi::Function::New(env, [batch](const Napi::CallbackInfo& info)
+            {
+                for (const auto& member : batch->members)
+                    member->Reject(info[0]);
+            });
+            promise.Get("then").As<Napi::Function>().Call(promise, { env.Undefined(), onFailed });
+        }
+
+    public:
+        Txt2ImgCoalescer(const std::shared_ptr<CPPContextData>& ctx, int windowMs) : ctx(ctx), windowMs(windowMs) {}
+
+        Napi::Promise Add(Napi::Env env, Txt2ImgParams&& params, const JobOptions& options)
+        {
+            auto key = params.BatchKey();
+            const auto signal = options.signal;
+            const bool hasSignal = !signal.IsUndefined() && !signal.IsNull();
+            if (!key || (hasSignal && signal.ToObject().Get("aborted").ToBoolean()))
+            {
+                return queueStableDiffusionWorker(env, ctx, [sdCtx = ctx->sdCtx, p = std::move(params)](CPPContextData& ctx)
+                {
+                    return ImageBatch::Encode(p.Run(ctx.SdCtxFor(sdCtx, p.prompt), p.seed, p.batchCount), p.batchCount, p.output, ctx.numThreads);
+                },
+                [](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.WrapAll(env);
+                }, options);
+            }
+
+            auto request = std::make_shared<Request>(Request{ .params = std::make_shared<const Txt2ImgParams>(std::move(params)), .sdCtx = ctx->sdCtx, .def = Napi::Promise::Deferred::New(env), .priority = options.priority });
+            if (hasSignal)
+            {
+                auto listener = Napi::Function::New(env, [weak = std::weak_ptr<Request>(request)](const Napi::CallbackInfo&)
+                {
+                    if (const auto request = weak.lock())
+                        onRequestAborted(request);
+                }, "onAbort");
+                const auto signalObj = signal.ToObject();
+                signalObj.Get("addEventListener").As<Napi::Function>().Call(signalObj, { Napi::String::New(env, "abort"), listener });
+                request->signal = Napi::Persistent(signalObj);
+                request->abortListener = Napi::Persistent(listener);
+            }
+
+            const auto group = std::find_if(groups.begin(), groups.end(), [&](const auto& group) { return group.first == *key; });
+            if (group != groups.end())
+                group->second.push_back(request);
+            else
+                groups.emplace_back(std::move(*key), std::vector{ request });
+
+            if (!timerPending)
+            {
+                timerPending = true;
+                auto flush = Napi::Function::New(env, [self = shared_from_this()](const Napi::CallbackInfo& info) { self->Flush(info.Env()); }, "flushTxt2Img");
+                auto timer = env.Global().Get("setTimeout").As<Napi::Function>().Call({ flush, Napi::Number::New(env, windowMs) }).ToObject();
+                timer.Get("unref").As<Napi::Function>().Call(timer, {});
+            }
+
+            return request->def.Promise();
+        }
+
+        void Flush(Napi::Env env)
+        {
+            timerPending = false;
+            for (auto& [key, requests] : std::exchange(groups, {}))
+            {
+                std::erase_if(requests, [](const auto& request) { return request->settled; });
+                std::stable_sort(requests.begin(), requests.end(), [](const auto& a, const auto& b) { return a->params->seed < b->params->seed; });
+
+                std::vector<std::shared_ptr<Request>> members;
+                int64_t firstSeed = 0;
+                int64_t endSeed = 0;
+                for (auto& request : requests)
+                {
+                    if (!members.empty() && request->params->seed > endSeed)
+                    {
+                        dispatch(env, std::move(members), firstSeed, int(endSeed - firstSeed));
+                        members.clear();
+                    }
+
+                    if (members.empty())
+                        firstSeed = endSeed = request->params->seed;
+
+                    endSeed = std::max(endSeed, request->params->seed + request->params->batchCount);
+                    members.push_back(std::move(request));
+                }
+
+                if (!members.empty())
+                    dispatch(env, std::move(members), firstSeed, int(endSeed - firstSeed));
+            }
+        }
+    };
+
+    // Native contexts handed from one env to another, transfer() parks one under a token that can be passed
+    // to a worker thread and adopted there once
+    class ContextHandoffs
+    {
+    public:
+        struct Handoff
+        {
+            std::shared_ptr<sd_ctx_t> sdCtx;
+            std::shared_ptr<upscaler_ctx_t> upscalerCtx;
+            std::vector<std::shared_ptr<upscaler_ctx_t>> upscalerLanes;
+            std::shared_ptr<MemoryFootprint> memory;
+            std::shared_ptr<LoraVariants> loras;
+            int numThreads = GGML_DEFAULT_N_THREADS;
+            Placement placement;
+        };
+
+    private:
+        std::mutex mutex;
+        std::unordered_map<uint32_t, Handoff> handoffs;
+        uint32_t nextToken = 1;
+
+        ContextHandoffs() = default;
+
+    public:
+        static ContextHandoffs& instance()
+        {
+            static auto handoffs = new ContextHandoffs();
+            return *handoffs;
+        }
+
+        uint32_t Put(Handoff&& handoff)
+        {
+            std::lock_guard lock(mutex);
+            const auto token = nextToken++;
+            handoffs.emplace(token, std::move(handoff));
+            return token;
+        }
+
+        std::optional<Handoff> Take(uint32_t token, bool upscaler)
+        {
+            std::lock_guard lock(mutex);
+            const auto it = handoffs.find(token);
+            if (it == handoffs.end() || bool(it->second.upscalerCtx) != upscaler)
+                return std::nullopt;
+
+            auto handoff = std::move(it->second);
+            handoffs.erase(it);
+            return handoff;
+        }
+    };
+
+    // Hands the native context over to whichever env adopts the token, once the work queued before is done
+    Napi::Promise transferContext(Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData, ContextHandoffs::Handoff&& handoff)
+    {
+        return queueStableDiffusionWorker(env, cppContextData, [](CPPContextData& ctx)
+        {
+            return ctx.shared_from_this();
+        },
+        [handoff = std::make_shared<ContextHandoffs::Handoff>(std::move(handoff))](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
+        {
+            handoff->memory = cppContextData->memory;
+            handoff->loras = cppContextData->loras;
+            handoff->numThreads = cppContextData->numThreads;
+            handoff->placement = cppContextData->placement;
+            const auto token = ContextHandoffs::instance().Put(std::move(*handoff));
+            cppContextData->reset();
+            return Napi::Number::New(env, token);
+        }, { .kind = "transfer" });
+    }
+
+    struct TileOptions
+    {
+        // 0 upscales the whole image in one call
+        int size = 0;
+        int overlap = 16;
+
+        static TileOptions From(Napi::Object options)
+        {
+            Napi::Value tmp;
+            TileOptions t;
+            if (tmp = options.Get("tile"), tmp.IsUndefined())
+                return t;
+
+            const auto tile = tmp.ToObject();
+            t.size = (tmp = tile.Get("size"), tmp.IsUndefined() ? 256 : tmp.ToNumber().Int32Value());
+            t.overlap = (tmp = tile.Get("overlap"), tmp.IsUndefined() ? 16 : tmp.ToNumber().Int32Value());
+
+            if (t.size < 16)
+                throw Napi::Error::New(options.Env(), "Invalid tile size");
+
+            if (t.overlap < 0 || t.overlap * 2 >= t.size)
+                throw Napi::Error::New(options.Env(), "Invalid tile overlap");
+
+            return t;
+        }
+    };
+
+    // Upscales an image in overlapping tiles so the working set of ESRGAN is bounded by the tile rather than the
+    // image, upstream converts the whole input and output to float tensors otherwise. The tiles of one band go
+    // out to the upscaler's lanes, each an upscaler_ctx_t of its own, and are blended with linear ramps across
+    // the overlap. Rows are final once no tile of a later band reaches them, only one band is kept unfinished.
+    class TiledUpscale
+    {
+        SdInputImage input;
+        std::vector<std::shared_ptr<upscaler_ctx_t>> lanes;
+        uint32_t factor;
+        int overlap;
+        int tileWidth;
+        int tileHeight;
+        std::vector<int> xs;
+        std::vector<int> ys;
+        int nextBand = 0;
+        std::mutex mutex;
+        int scale = 0;
+        int channel = 0;
+        std::vector<float> sum;
+        std::vector<float> weight;
+
+        // Tile origins along one axis, the last tile is pulled back to end at the edge
+        static std::vector<int> origins(int length, int tile, int overlap)
+        {
+            std::vector<int> ret;
+            for (int pos = 0; ; pos += tile - overlap)
+            {
+                if (pos + tile >= length)
+                {
+                    ret.push_back(std::max(0, length - tile));
+                    break;
+                }
+                ret.push_back(pos);
+            }
+            ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+            return ret;
+        }
+
+        // Full weight inside, ramping down towards edges another tile overlaps
+        static float ramp(int pos, int length, bool before, bool after, int width)
+        {
+            auto w = 1.0f;
+            if (before)
+                w = std::min(w, (pos + 0.5f) / width);
+            if (after)
+                w = std::min(w, (length - pos - 0.5f) / width);
+            return w;
+        }
+
+        int OutWidth() const { return int(input->width) * scale; }
+
+        void Accumulate(int x0, int y0, const sd_image_t& out)
+        {
+            std::lock_guard lock(mutex);
+            if (scale == 0)
+            {
+                scale = std::max(1, int(out.width) / tileWidth);
+                channel = int(out.channel);
+                sum.assign(size_t(OutWidth()) * tileHeight * scale * channel, 0.0f);
+                weight.assign(size_t(OutWidth()) * tileHeight * scale, 0.0f);
+            }
+
+            if (int(out.width) != tileWidth * scale || int(out.height) != tileHeight * scale || int(out.channel) != channel)
+                throw std::runtime_error("upscale returned an unexpected size");
+
+            const auto rampWidth = std::max(1, overlap * scale);
+            const auto ox = x0 * scale;
+            for (int y = 0; y < int(out.height); y++)
+            {
+                const auto wy = ramp(y, out.height, y0 > ys.front(), y0 < ys.back(), rampWidth);
+                auto sumRow = sum.data() + size_t(y) * OutWidth() * channel;
+                auto weightRow = weight.data() + size_t(y) * OutWidth();
+                const auto src = out.data + size_t(y) * out.width * channel;
+                for (int x = 0; x < int(out.width); x++)
+                {
+                    const auto w = wy * ramp(x, out.width, x0 > xs.front(), x0 < xs.back(), rampWidth);
+                    weightRow[ox + x] += w;
+                    for (int c = 0; c < channel; c++)
+                        sumRow[(ox + x) * channel + c] += w * src[x * channel + c];
+                }
+            }
+        }
+
+        void UpscaleTile(upscaler_ctx_t* lane, int x0, int y0)
+        {
+            const auto channelIn = int(input->channel);
+            std::vector<uint8_t> pixels(size_t(tileWidth) * tileHeight * channelIn);
+            for (int y = 0; y < tileHeight; y++)
+                memcpy(pixels.data() + size_t(y) * tileWidth * channelIn, input->data + (size_t(y0 + y) * input->width + x0) * channelIn, size_t(tileWidth) * channelIn);
+
+            const sd_image_t tile{ .width = uint32_t(tileWidth), .height = uint32_t(tileHeight), .channel = uint32_t(channelIn), .data = pixels.data() };
+            const auto out = SdImage((sd_image_t*)calloc(1, sizeof(sd_image_t)));
+            *out = upscale(lane, tile, factor);
+            if (!out->data)
+                throw std::runtime_error("upscale failed");
+
+            Accumulate(x0, y0, *out);
+        }
+
+    public:
+        struct Rows
+        {
+            int y = 0;
+            SdImage image;
+        };
+
+        TiledUpscale(SdInputImage&& input, std::vector<std::shared_ptr<upscaler_ctx_t>>&& lanes, uint32_t factor, const TileOptions& tile) :
+            input(std::move(input)), lanes(std::move(lanes)), factor(factor), overlap(tile.overlap)
+        {
+            tileWidth = std::min(tile.size, int(this->input->width));
+            tileHeight = std::min(tile.size, int(this->input->height));
+            xs = origins(this->input->width, tileWidth, overlap);
+            ys = origins(this->input->height, tileHeight, overlap);
+        }
+
+        int Bands() const { return int(ys.size()); }
+
+        // Upscales every tile of the next band and returns the rows it finished
+        Rows RunBand(int band)
+        {
+            if (band != nextBand)
+                throw std::runtime_error("Tiles upscaled out of order");
+
+            const auto job = tl_job;
+            std::atomic<size_t> next = 0;
+            std::mutex errorMutex;
+            std::exception_ptr error;
+            const auto work = [&](upscaler_ctx_t* lane)
+            {
+                try
+                {
+                    for (size_t i; (i = next++) < xs.size();)
+                    {
+                        if (job && job->aborted)
+                            return;
+                        UpscaleTile(lane, xs[i], ys[band]);
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard lock(errorMutex);
+                    if (!error)
+                        error = std::current_exception();
+                    next = xs.size();
+                }
+            };
+
+            // the job thread takes the first lane, it is the only one an abort can unwind mid tile
+            std::vector<std::thread> workers;
+            for (size_t l = 1; l < std::min(lanes.size(), xs.size()); l++)
+                workers.emplace_back(work, lanes[l].get());
+            work(lanes.front().get());
+            for (auto& worker : workers)
+                worker.join();
+
+            if (error)
+                std::rethrow_exception(error);
+            if (job && job->aborted)
+                throw JobAborted();
+
+            nextBand++;
+            const auto bandRows = tileHeight * scale;
+            const auto rows = band + 1 < Bands() ? (ys[band + 1] - ys[band]) * scale : bandRows;
+            const auto width = OutWidth();
+
+            Rows ret{ .y = ys[band] * scale, .image = SdImage((sd_image_t*)calloc(1, sizeof(sd_image_t))) };
+            ret.image->width = width;
+            ret.image->height = rows;
+            ret.image->channel = channel;
+            ret.image->data = (uint8_t*)malloc(size_t(width) * rows * channel);
+            if (!ret.image->data)
+                throw std::runtime_error("Out of memory");
+
+            for (size_t p = 0; p < size_t(width) * rows; p++)
+            {
+                const auto w = weight[p] > 0.0f ? weight[p] : 1.0f;
+                for (int c = 0; c < channel; c++)
+                    ret.image->data[p * channel + c] = uint8_t(std::clamp(sum[p * channel + c] / w + 0.5f, 0.0f, 255.0f));
+            }
+
+            // what the next band still blends into moves to the front
+            const auto kept = bandRows - rows;
+            std::copy(sum.begin() + size_t(width) * rows * channel, sum.end(), sum.begin());
+            std::fill(sum.begin() + size_t(width) * kept * channel, sum.end(), 0.0f);
+            std::copy(weight.begin() + size_t(width) * rows, weight.end(), weight.begin());
+            std::fill(weight.begin() + size_t(width) * kept, weight.end(), 0.0f);
+            return ret;
+        }
+
+        SdImage RunAll()
+        {
+            SdImage ret;
+            for (int band = 0; band < Bands(); band++)
+            {
+                auto rows = RunBand(band);
+                if (!ret)
+                {
+                    ret = SdImage((sd_image_t*)calloc(1, sizeof(sd_image_t)));
+                    ret->width = rows.image->width;
+                    ret->height = input->height * scale;
+                    ret->channel = rows.image->channel;
+                    ret->data = (uint8_t*)malloc(size_t(ret->width) * ret->height * ret->channel);
+                    if (!ret->data)
+                        throw std::runtime_error("Out of memory");
+                }
+                memcpy(ret->data + size_t(rows.y) * ret->width * ret->channel, rows.image->data, size_t(rows.image->width) * rows.image->height * rows.image->channel);
+            }
+            return ret;
+        }
+    };
+
+    Napi::Object wrapImageRows(Napi::Env env, TiledUpscale::Rows& rows)
+    {
+        const size_t size = size_t(rows.image->width) * rows.image->height * rows.image->channel;
+        auto data = wrapResultBuffer(env, std::exchange(rows.image->data, nullptr), size);
+
+        auto rowsObj = Napi::Object::New(env);
+        rowsObj.DefineProperties({
+                Napi::PropertyDescriptor::Value("y",  Napi::Number::From(env, rows.y)),
+                Napi::PropertyDescriptor::Value("width",  Napi::Number::From(env, rows.image->width)),
+                Napi::PropertyDescriptor::Value("height",  Napi::Number::From(env, rows.image->height)),
+                Napi::PropertyDescriptor::Value("channel",  Napi::Number::From(env, rows.image->channel)),
+                Napi::PropertyDescriptor::Value("data",  data)
+            });
+
+        rowsObj.Freeze();
+        return rowsObj;
+    }
+
+    // Upscales images [begin, end) in one job, each lane takes the next image as soon as it is done with one
+    ImageBatch upscaleImages(const std::vector<std::shared_ptr<upscaler_ctx_t>>& lanes, const std::vector<SdInputImage>& inputs, size_t begin, size_t end, uint32_t factor, const OutputFormat& output, int threads)
+    {
+        const auto count = end - begin;
+        auto images = SdImageList((sd_image_t*)calloc(count, sizeof(sd_image_t)), count);
+        const auto job = tl_job;
+        std::atomic<size_t> next = 0;
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        const auto work = [&](upscaler_ctx_t* lane)
+        {
+            try
+            {
+                for (size_t i; (i = next++) < count;)
+                {
+                    if (job && job->aborted)
+                        return;
+
+                    images[i] = upscale(lane, *inputs[begin + i], factor);
+                    if (!images[i].data)
+                        throw std::runtime_error("upscale failed");
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        };
+
+        // as with tiles the job thread takes the first lane
+        std::vector<std::thread> workers;
+        for (size_t l = 1; l < std::min(lanes.size(), count); l++)
+            workers.emplace_back(work, lanes[l].get());
+        work(lanes.front().get());
+        for (auto& worker : workers)
+            worker.join();
+
+        if (error)
+            std::rethrow_exception(error);
+        if (job && job->aborted)
+            throw JobAborted();
+
+        return ImageBatch::Encode(std::move(images), int(count), output, threads);
+    }
+
+    struct UpscaleBatchParams
+    {
+        std::shared_ptr<std::vector<SdInputImage>> inputs;
+        uint32_t factor = 1;
+        OutputFormat output;
+        int maxWidth = 0;
+        int maxHeight = 0;
+
+        static UpscaleBatchParams From(const Napi::CallbackInfo& info, Napi::Object options)
+        {
+            Napi::Value tmp;
+            UpscaleBatchParams p;
+            const auto copyInputs = (tmp = options.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+            const auto images = info[0].As<Napi::Array>();
+            p.inputs = std::make_shared<std::vector<SdInputImage>>();
+            p.inputs->reserve(images.Length());
+            for (uint32_t i = 0; i < images.Length(); i++)
+            {
+                auto& input = p.inputs->emplace_back(extractSdImage(images.Get(i).ToObject(), copyInputs));
+                p.maxWidth = std::max(p.maxWidth, int(input->width));
+                p.maxHeight = std::max(p.maxHeight, int(input->height));
+            }
+            p.factor = info[1].ToNumber().Uint32Value();
+            p.output = OutputFormat::From(options);
+            return p;
+        }
+    };
+
+    constexpr napi_type_tag upscalerTypeTag = { 0x5d3c8a1f0b6e4e27, 0x9a41c2d7e38f6b15 };
+
+    // Lets calls that take an upscaler object as an argument get at its native side
+    void tagUpscaler(Napi::Object obj, const std::shared_ptr<CPPContextData>& cppContextData)
+    {
+        obj.TypeTag(&upscalerTypeTag);
+        const auto status = napi_wrap(obj.Env(), obj, new std::shared_ptr<CPPContextData>(cppContextData), [](napi_env, void* data, void*)
+        {
+            delete static_cast<std::shared_ptr<CPPContextData>*>(data);
+        }, nullptr, nullptr);
+        if (status != napi_ok)
+            throw Napi::Error::New(obj.Env());
+    }
+
+    std::shared_ptr<CPPContextData> upscalerOf(Napi::Value value)
+    {
+        void* data = nullptr;
+        if (!value.IsObject() || !value.As<Napi::Object>().CheckTypeTag(&upscalerTypeTag) || napi_unwrap(value.Env(), value, &data) != napi_ok)
+            throw Napi::Error::New(value.Env(), "Invalid upscaler");
+
+        return *static_cast<std::shared_ptr<CPPContextData>*>(data);
+    }
+
+    // Second stage of a pipeline. The generated image is never handed to JS, it moves straight into a job on
+    // the upscaler's queue, which runs alongside the context's so the next image samples meanwhile.
+    struct UpscaleStage
+    {
+        std::shared_ptr<CPPContextData> upscaler;
+        uint32_t factor = 4;
+        TileOptions tile;
+
+        static std::optional<UpscaleStage> From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            if (tmp = params.Get("upscale"), tmp.IsUndefined())
+                return std::nullopt;
+
+            const auto upscale = tmp.ToObject();
+            UpscaleStage s;
+            s.upscaler = upscalerOf(upscale.Get("upscaler"));
+            s.factor = (tmp = upscale.Get("factor"), tmp.IsUndefined() ? 4 : tmp.ToNumber().Uint32Value());
+            s.tile = TileOptions::From(upscale);
+            return s;
+        }
+
+        Napi::Value Queue(Napi::Env env, SdImage&& image, const OutputFormat& output, const JobOptions& options) const
+        {
+            if (!upscaler->upscalerCtx)
+            {
+                auto def = Napi::Promise::Deferred::New(env);
+                def.Reject(Napi::Error::New(env, "Context disposed").Value());
+                return def.Promise();
+            }
+
+            auto lanes = upscaler->upscalerLanes;
+            lanes.insert(lanes.begin(), upscaler->upscalerCtx);
+            auto jobOptions = options.WithWorkload(int(image->width * factor), int(image->height * factor), 1);
+            jobOptions.kind = "upscale";
+            if (tile.size > 0)
+            {
+                const auto tiled = std::make_shared<TiledUpscale>(SdInputImage(std::move(image)), std::move(lanes), factor, tile);
+                return queueStableDiffusionWorker(env, upscaler, [tiled, output](CPPContextData& ctx)
+                {
+                    return ImageBatch::Encode(SdImageList(tiled->RunAll().release(), 1), 1, output, ctx.numThreads);
+                },
+                [](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.Wrap(env, 0);
+                }, jobOptions);
+            }
+
+            auto inputs = std::make_shared<std::vector<SdInputImage>>();
+            inputs->emplace_back(std::move(image));
+            return queueStableDiffusionWorker(env, upscaler, [inputs, lanes = std::move(lanes), factor = factor, output](CPPContextData& ctx)
+            {
+                return upscaleImages(lanes, *inputs, 0, 1, factor, output, ctx.numThreads);
+            },
+            [](Napi::Env env, ImageBatch&& images)
+            {
+                return images.Wrap(env, 0);
+            }, jobOptions);
+        }
+    };
+
+    // One resolution to warm up, with controlNet a blank control image takes the ControlNet through its graph as well
+    struct WarmupShape
+    {
+        int width = 512;
+        int height = 512;
+        int batchCount = 1;
+        sample_method_t sampleMethod = EULER_A;
+        bool controlNet = false;
+    };
+
+    struct WarmupReport
+    {
+        struct Shape
+        {
+            WarmupShape shape;
+            double ms = 0;
+            std::vector<MemoryFootprint::ComputePeak> computePeaks;
+        };
+
+        std::vector<Shape> shapes;
+        double totalMs = 0;
+    };
+
+    // Runs a short generation for every shape. stable-diffusion.cpp builds its graphs and compute buffers anew on
+    // every call, so what carries over is everything around them: weight pages touched, allocator arenas grown,
+    // ggml's first use setup, and the compute buffer sizes of each shape, which memory admission then knows exactly.
+    struct WarmupParams
+    {
+        std::vector<WarmupShape> shapes;
+        std::string prompt = "a photo of a cat";
+        int sampleSteps = 1;
+
+        static WarmupParams From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            WarmupParams p;
+            const auto shapes = params.Get("shapes");
+            if (!shapes.IsArray() || shapes.As<Napi::Array>().Length() == 0)
+                throw Napi::Error::New(params.Env(), "Missing shapes");
+
+            const auto shapeArray = shapes.As<Napi::Array>();
+            for (uint32_t i = 0; i < shapeArray.Length(); i++)
+            {
+                const auto shapeObj = shapeArray.Get(i).ToObject();
+                auto& shape = p.shapes.emplace_back();
+                shape.width = (tmp = shapeObj.Get("width"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
+                shape.height = (tmp = shapeObj.Get("height"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
+                shape.batchCount = (tmp = shapeObj.Get("batchCount"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value());
+                shape.sampleMethod = (tmp = shapeObj.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
+                shape.controlNet = (tmp = shapeObj.Get("controlNet"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+
+                if (shape.width <= 0 || shape.height <= 0 || shape.batchCount <= 0)
+                    throw Napi::Error::New(params.Env(), "Invalid shape");
+
+                if (shape.sampleMethod >= N_SAMPLE_METHODS)
+                    throw Napi::Error::New(params.Env(), "Invalid sampleMethod");
+            }
+
+            p.prompt = (tmp = params.Get("prompt"), tmp.IsUndefined() ? p.prompt : tmp.ToString().Utf8Value());
+            p.sampleSteps = std::max(1, (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value()));
+            return p;
+        }
+
+        // The largest shape, what the scheduler holds memory for
+        const WarmupShape& Largest() const
+        {
+            return *std::max_element(shapes.begin(), shapes.end(), [](const auto& a, const auto& b)
+            {
+                return size_t(a.width) * a.height * a.batchCount < size_t(b.width) * b.height * b.batchCount;
+            });
+        }
+
+        WarmupReport Run(sd_ctx_t* sdCtx) const
+        {
+            auto& job = *tl_job;
+            WarmupReport report;
+            const auto start = Clock::now();
+            for (const auto& shape : shapes)
+            {
+                Txt2ImgParams run;
+                run.prompt = prompt;
+                run.width = shape.width;
+                run.height = shape.height;
+                run.sampleMethod = shape.sampleMethod;
+                run.sampleSteps = sampleSteps;
+                if (shape.controlNet)
+                {
+                    const auto size = size_t(shape.width) * shape.height * 3;
+                    const auto control = (sd_image_t*)calloc(1, sizeof(sd_image_t));
+                    *control = { .width = uint32_t(shape.width), .height = uint32_t(shape.height), .channel = 3, .data = (uint8_t*)malloc(size) };
+                    memset(control->data, 128, size);
+                    run.controlCond = SdInputImage(SdImage(control));
+                    run.controlStrength = 0.9f;
+                }
+
+                // compute buffers logged during the run are recorded under this shape
+                job.width = shape.width;
+                job.height = shape.height;
+                const auto shapeStart = Clock::now();
+                run.Run(sdCtx, run.seed, shape.batchCount);
+
+                auto& result = report.shapes.emplace_back(WarmupReport::Shape{ .shape = shape, .ms = toMs(Clock::now() - shapeStart) });
+                if (job.memory)
+                {
+                    for (auto& peak : job.memory->ComputePeaks())
+                    {
+                        if (peak.width == shape.width && peak.height == shape.height)
+                            result.computePeaks.push_back(std::move(peak));
+                    }
+                }
+            }
+            report.totalMs = toMs(Clock::now() - start);
+            return report;
+        }
+    };
+
+    Napi::Object warmupReportObject(Napi::Env env, const WarmupReport& report)
+    {
+        size_t computeBytes = 0;
+        auto shapes = Napi::Array::New(env, report.shapes.size());
+        for (size_t i = 0; i < report.shapes.size(); i++)
+        {
+            const auto& result = report.shapes[i];
+            size_t shapeBytes = 0;
+            auto components = Napi::Object::New(env);
+            for (const auto& peak : result.computePeaks)
+            {
+                components[peak.component] = Napi::Number::From(env, double(peak.bytes));
+                shapeBytes = std::max(shapeBytes, peak.bytes);
+            }
+            computeBytes = std::max(computeBytes, shapeBytes);
+
+            auto shape = Napi::Object::New(env);
+            shape["width"] = Napi::Number::From(env, result.shape.width);
+            shape["height"] = Napi::Number::From(env, result.shape.height);
+            shape["batchCount"] = Napi::Number::From(env, result.shape.batchCount);
+            shape["sampleMethod"] = Napi::Number::From(env, int(result.shape.sampleMethod));
+            shape["controlNet"] = Napi::Boolean::New(env, result.shape.controlNet);
+            shape["ms"] = Napi::Number::From(env, result.ms);
+            // components run one after another, the largest buffer is what a run needs
+            shape["computeBytes"] = Napi::Number::From(env, double(shapeBytes));
+            shape["components"] = components;
+            shapes[i] = shape;
+        }
+
+        auto ret = Napi::Object::New(env);
+        ret["totalMs"] = Napi::Number::From(env, report.totalMs);
+        ret["computeBytes"] = Napi::Number::From(env, double(computeBytes));
+        ret["shapes"] = shapes;
+        return ret;
+    }
+
+    std::vector<std::map<std::string, float>> loraSetsFrom(Napi::Value value)
+    {
+        if (!value.IsArray())
+            throw Napi::Error::New(value.Env(), "Missing LoRA sets");
+
+        std::vector<std::map<std::string, float>> sets;
+        const auto array = value.As<Napi::Array>();
+        for (uint32_t i = 0; i < array.Length(); i++)
+        {
+            const auto setObj = array.Get(i).ToObject();
+            const auto names = setObj.GetPropertyNames();
+            auto& loras = sets.emplace_back();
+            for (uint32_t n = 0; n < names.Length(); n++)
+            {
+                const auto name = names.Get(n).ToString().Utf8Value();
+                const auto multiplier = setObj.Get(name).ToNumber().FloatValue();
+                if (name.empty() || name.find_first_of(":>") != std::string::npos || !std::isfinite(multiplier))
+                    throw Napi::Error::New(value.Env(), "Invalid LoRA set");
+
+                if (multiplier != 0.0f)
+                    loras[name] = multiplier;
+            }
+        }
+        return sets;
+    }
+
+    Napi::Object loraCacheStatsObject(Napi::Env env, const LoraCacheStats& stats)
+    {
+        auto sets = Napi::Array::New(env, stats.sets.size());
+        for (size_t i = 0; i < stats.sets.size(); i++)
+        {
+            auto loras = Napi::Object::New(env);
+            for (const auto& [name, multiplier] : stats.sets[i])
+                loras[name] = Napi::Number::From(env, multiplier);
+            sets[i] = loras;
+        }
+
+        auto ret = Napi::Object::New(env);
+        ret["sets"] = sets;
+        ret["weightBytes"] = Napi::Number::From(env, double(stats.weightBytes));
+        ret["hits"] = Napi::Number::From(env, double(stats.hits));
+        ret["misses"] = Napi::Number::From(env, double(stats.misses));
+        ret["loads"] = Napi::Number::From(env, double(stats.loads));
+        ret["maxSets"] = Napi::Number::From(env, stats.maxSets);
+        ret["memoryLimit"] = Napi::Number::From(env, double(stats.memoryLimit));
+        return ret;
+    }
+
+    Napi::Object wrapContext(Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
+    {
+        const auto coalescer = cppContextData->coalesceWindowMs > 0 ? std::make_shared<Txt2ImgCoalescer>(cppContextData, cppContextData->coalesceWindowMs) : nullptr;
+        auto ctx = Napi::Object::New(env);
+        ctx.DefineProperties({
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "getLogStats", [cppContextData](const Napi::CallbackInfo& info) -> Napi::Value
+            {
+                if (!cppContextData->events)
+                    return info.Env().Undefined();
+
+                return cppContextData->events->Stats();
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "getMemoryStats", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                return memoryFootprintObject(info.Env(), cppContextData->memory);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "getLoraCacheStats", [cppContextData](const Napi::CallbackInfo& info) -> Napi::Value
+            {
+                if (!cppContextData->loras)
+                    return info.Env().Undefined();
+
+                return loraCacheStatsObject(info.Env(), cppContextData->loras->Stats());
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "preloadLoras", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                if (!cppContextData->loras)
+                    throw Napi::Error::New(info.Env(), "Create the context with loraCache to preload LoRAs");
+
+                auto sets = loraSetsFrom(info[0]);
+                const auto params = info[1].IsUndefined() ? Napi::Object::New(info.Env()) : info[1].ToObject();
+                auto options = JobOptions::From(params, "preloadLoras");
+                options.loadBytes = cppContextData->loras->LoadBytes(sets);
+
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [sdCtx = cppContextData->sdCtx, loras = cppContextData->loras, sets = std::move(sets)](CPPContextData&)
+                {
+                    loras->Preload(sets, sdCtx);
+                    return loras->Stats();
+                },
+                [](Napi::Env env, LoraCacheStats&& stats)
+                {
+                    return loraCacheStatsObject(env, stats);
+                }, options);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "dispose", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                cppContextData->sdCtx.reset();
+
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [](CPPContextData& ctx)
+                {
+                   return ctx.shared_from_this();
+                },
+                [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
+                {
+                    cppContextData->reset();
+                    return env.Undefined();
+                }, { .kind = "dispose" });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "transfer", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                return transferContext(info.Env(), cppContextData, { .sdCtx = std::move(cppContextData->sdCtx) });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "warmup", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto warmupParams = WarmupParams::From(params);
+                const auto& largest = warmupParams.Largest();
+                const auto options = JobOptions::From(params, "warmup").WithWorkload(largest.width, largest.height, largest.batchCount);
+
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [sdCtx = cppContextData->sdCtx, p = std::move(warmupParams)](CPPContextData& ctx)
+                {
+                    return p.Run(ctx.SdCtxFor(sdCtx, p.prompt));
+                },
+                [](Napi::Env env, WarmupReport&& report)
+                {
+                    return warmupReportObject(env, report);
+                }, options);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "txt2img", [cppContextData, coalescer](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto txt2imgParams = Txt2ImgParams::From(params);
+                const auto options = JobOptions::From(params, "txt2img").WithWorkload(txt2imgParams.width, txt2imgParams.height, txt2imgParams.batchCount);
+
+                // coalesced runs are split back into single images, a packed batch has to stay whole
+                if (coalescer && txt2imgParams.output.layout == BatchLayout::Separate)
+                    return coalescer->Add(info.Env(), std::move(txt2imgParams), options);
+
+                const auto shared = SharedResult::New(info.Env(), txt2imgParams.output, size_t(txt2imgParams.width) * txt2imgParams.height * 3 * txt2imgParams.batchCount);
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [sdCtx = cppContextData->sdCtx, p = std::move(txt2imgParams), shared](CPPContextData& ctx)
+                {
+                    auto images = ImageBatch::Encode(p.Run(ctx.SdCtxFor(sdCtx, p.prompt), p.seed, p.batchCount), p.batchCount, p.output, ctx.numThreads);
+                    images.Pack(p.output, shared);
+                    return images;
+                },
+                [shared](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.WrapBatch(env, shared);
+                }, options);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "txt2imgStream", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto txt2imgParams = Txt2ImgParams::From(params);
+                txt2imgParams.seed = streamSeed(txt2imgParams.seed);
+                const auto p = std::make_shared<const Txt2ImgParams>(std::move(txt2imgParams));
+
+                return ImageStream::New(info.Env(), "txt2img", p->batchCount, params, [cppContextData, p](Napi::Env env, int index, const JobOptions& options)
+                {
+                    return queueStableDiffusionWorker(env, cppContextData, [sdCtx = cppContextData->sdCtx, p, index](CPPContextData& ctx)
+                    {
+                        return ImageBatch::Encode(p->Run(ctx.SdCtxFor(sdCtx, p->prompt), p->seed + index, 1), 1, p->output, ctx.numThreads);
+                    },
+                    [](Napi::Env env, ImageBatch&& images)
+                    {
+                        return images.Wrap(env, 0);
+                    }, options.WithWorkload(p->width, p->height, 1));
+                });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "txt2imgPipeline", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto txt2imgParams = Txt2ImgParams::From(params);
+                const auto upscale = UpscaleStage::From(params);
+                const auto output = txt2imgParams.output;
+                txt2imgParams.seed = streamSeed(txt2imgParams.seed);
+                // only the last stage encodes
+                if (upscale)
+                    txt2imgParams.output = {};
+                const auto p = std::make_shared<const Txt2ImgParams>(std::move(txt2imgParams));
+
+                // two images in flight by default, one sampling while the one before is upscaled
+                return ImageStream::New(info.Env(), "txt2img", p->batchCount, params, [cppContextData, p, upscale, output](Napi::Env env, int index, const JobOptions& options)
+                {
+                    if (!upscale)
+                    {
+                        return queueStableDiffusionWorker(env, cppContextData, [sdCtx = cppContextData->sdCtx, p, index](CPPContextData& ctx)
+                        {
+                            return ImageBatch::Encode(p->Run(ctx.SdCtxFor(sdCtx, p->prompt), p->seed + index, 1), 1, p->output, ctx.numThreads);
+                        },
+                        [](Napi::Env env, ImageBatch&& images)
+                        {
+                            return images.Wrap(env, 0);
+                        }, options.WithWorkload(p->width, p->height, 1));
+                    }
+
+                    // the upscale job is queued once the image exists, by then these values are out of scope
+                    const auto signal = std::make_shared<Napi::ObjectReference>(Napi::Persistent(options.signal.ToObject()));
+                    const auto onTiming = std::make_shared<Napi::FunctionReference>();
+                    if (!options.onTiming.IsUndefined())
+                        *onTiming = Napi::Persistent(options.onTiming.As<Napi::Function>());
+
+                    return queueStableDiffusionWorker(env, cppContextData, [sdCtx = cppContextData->sdCtx, p, index](CPPContextData& ctx)
+                    {
+                        return SdImage(p->Run(ctx.SdCtxFor(sdCtx, p->prompt), p->seed + index, 1).release());
+                    },
+                    [upscale, output, signal, onTiming, priority = options.priority](Napi::Env env, SdImage&& image)
+                    {
+                        const auto options = JobOptions{
+                            .signal = signal->Value(),
+                            .priority = priority,
+                            .limited = true,
+                            .onTiming = onTiming->IsEmpty() ? env.Undefined() : onTiming->Value(),
+                        };
+                        return upscale->Queue(env, std::move(image), output, options);
+                    }, options.WithWorkload(p->width, p->height, 1));
+                }, 2);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2img", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto img2imgParams = Img2ImgParams::From(params);
+                const auto options = JobOptions::From(params, "img2img").WithWorkload(img2imgParams.width, img2imgParams.height, img2imgParams.batchCount);
+
+                const auto shared = SharedResult::New(info.Env(), img2imgParams.output, size_t(img2imgParams.width) * img2imgParams.height * 3 * img2imgParams.batchCount);
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [sdCtx = cppContextData->sdCtx, p = std::move(img2imgParams), shared](CPPContextData& ctx)
+                {
+                    auto images = ImageBatch::Encode(p.Run(ctx.SdCtxFor(sdCtx, p.prompt), p.seed, p.batchCount), p.batchCount, p.output, ctx.numThreads);
+                    images.Pack(p.output, shared);
+                    return images;
+                },
+                [shared](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.WrapBatch(env, shared);
+                }, options);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2imgStream", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto img2imgParams = Img2ImgParams::From(params);
+                img2imgParams.seed = streamSeed(img2imgParams.seed);
+                const auto p = std::make_shared<const Img2ImgParams>(std::move(img2imgParams));
+
+                return ImageStream::New(info.Env(), "img2img", p->batchCount, params, [cppContextData, p](Napi::Env env, int index, const JobOptions& options)
+                {
+                    return queueStableDiffusionWorker(env, cppContextData, [sdCtx = cppContextData->sdCtx, p, index](CPPContextData& ctx)
+                    {
+                        return ImageBatch::Encode(p->Run(ctx.SdCtxFor(sdCtx, p->prompt), p->seed + index, 1), 1, p->output, ctx.numThreads);
+                    },
+                    [](Napi::Env env, ImageBatch&& images)
+                    {
+                        return images.Wrap(env, 0);
+                    }, options.WithWorkload(p->width, p->height, 1));
+                });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2vid", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                auto img2vidParams = Img2VidParams::From(params);
+                const auto options = JobOptions::From(params, "img2vid").WithWorkload(img2vidParams.width, img2vidParams.height, img2vidParams.videoFrames);
+
+                const auto shared = SharedResult::New(info.Env(), img2vidParams.output, size_t(img2vidParams.width) * img2vidParams.height * 3 * img2vidParams.videoFrames);
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [sdCtx = cppContextData->sdCtx, p = std::move(img2vidParams), shared](CPPContextData& ctx)
+                {
+                    auto images = ImageBatch::Encode(p.Run(sdCtx.get()), p.videoFrames, p.output, ctx.numThreads);
+                    images.Pack(p.output, shared);
+                    return images;
+                },
+                [shared](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.WrapBatch(env, shared);
+                }, options);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2vidStream", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->sdCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto params = info[0].ToObject();
+                const auto p = std::make_shared<const Img2VidParams>(Img2VidParams::From(params));
+
+                // All frames come out of one native call, they are kept native and only wrapped once asked for
+                auto frames = std::make_shared<Napi::ObjectReference>();
+                return ImageStream::New(info.Env(), "img2vid", p->videoFrames, params, [cppContextData, p, frames](Napi::Env env, int index, const JobOptions& options)
+                {
+                    if (frames->IsEmpty())
+                    {
+                        *frames = Napi::Persistent(queueStableDiffusionWorker(env, cppContextData, [sdCtx = cppContextData->sdCtx, p](CPPContextData& ctx)
+                        {
+                            return ImageBatch::Encode(p->Run(sdCtx.get()), p->videoFrames, p->output, ctx.numThreads);
+                        },
+                        [](Napi::Env env, ImageBatch&& images)
+                        {
+                            return Napi::External<ImageBatch>::New(env, new ImageBatch(std::move(images)), [](Napi::Env, ImageBatch* batch) { delete batch; });
+                        }, options.WithWorkload(p->width, p->height, p->videoFrames)).As<Napi::Object>());
+                    }
+
+                    const auto framesPromise = frames->Value();
+                    auto onFrames = Napi::Function::New(env, [index](const Napi::CallbackInfo& info)
+                    {
+                        return info[0].As<Napi::External<ImageBatch>>().Data()->Wrap(info.Env(), index);
+                    });
+                    return framesPromise.Get("then").As<Napi::Function>().Call(framesPromise, { onFrames });
+                });
+            }),
+        });
+        ctx.Freeze();
+        return ctx;
+    }
+
+    Napi::Object wrapUpscaler(Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
+    {
+        auto ctx = Napi::Object::New(env);
+        ctx.DefineProperties({
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "getLogStats", [cppContextData](const Napi::CallbackInfo& info) -> Napi::Value
+            {
+                if (!cppContextData->events)
+                    return info.Env().Undefined();
+
+                return cppContextData->events->Stats();
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "getMemoryStats", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                return memoryFootprintObject(info.Env(), cppContextData->memory);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "dispose", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                cppContextData->upscalerCtx.reset();
+                cppContextData->upscalerLanes.clear();
+
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [](CPPContextData& ctx)
+                {
+                    return ctx.shared_from_this();
+                },
+                [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
+                {
+                    cppContextData->reset();
+                    return env.Undefined();
+                }, { .kind = "dispose" });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "transfer", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                return transferContext(info.Env(), cppContextData, { .upscalerCtx = std::move(cppContextData->upscalerCtx), .upscalerLanes = std::move(cppContextData->upscalerLanes) });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "upscale", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                Napi::Value tmp;
+                const auto options = info[2].IsUndefined() ? Napi::Object::New(info.Env()) : info[2].ToObject();
+                const auto copyInputs = (tmp = options.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+                auto inputImage = extractSdImage(info[0].ToObject(), copyInputs);
+                const auto upscaleFactor = info[1].ToNumber().Uint32Value();
+                const auto output = OutputFormat::From(options);
+                const auto tile = TileOptions::From(options);
+                const auto jobOptions = JobOptions::From(options, "upscale").WithWorkload(int(inputImage->width * upscaleFactor), int(inputImage->height * upscaleFactor), 1);
+                if (tile.size > 0)
+                {
+                    auto lanes = cppContextData->upscalerLanes;
+                    lanes.insert(lanes.begin(), cppContextData->upscalerCtx);
+                    const auto tiled = std::make_shared<TiledUpscale>(std::move(inputImage), std::move(lanes), upscaleFactor, tile);
+                    return queueStableDiffusionWorker(info.Env(), cppContextData, [=](CPPContextData& ctx)
+                    {
+                        return ImageBatch::Encode(SdImageList(tiled->RunAll().release(), 1), 1, output, ctx.numThreads);
+                    },
+                    [](Napi::Env env, ImageBatch&& images)
+                    {
+                        return images.Wrap(env, 0);
+                    }, jobOptions);
+                }
+
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [=, upscalerCtx = cppContextData->upscalerCtx, inputImage = std::move(inputImage)](CPPContextData& ctx)
+                {
+                    auto img = (sd_image_t*)calloc(1, sizeof(sd_image_t));
+                    *img = upscale(upscalerCtx.get(), *inputImage, upscaleFactor);
+                    if (!img->data)
+                    {
+                        free(img);
+                        throw std::runtime_error("upscale failed");
+                    }
+                    return ImageBatch::Encode(SdImageList(img, 1), 1, output, ctx.numThreads);
+                },
+                [](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.Wrap(env, 0);
+                }, jobOptions);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "upscaleBatch", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                const auto options = info[2].IsUndefined() ? Napi::Object::New(info.Env()) : info[2].ToObject();
+                const auto p = UpscaleBatchParams::From(info, options);
+                const auto count = p.inputs->size();
+                if (count == 0)
+                {
+                    auto def = Napi::Promise::Deferred::New(info.Env());
+                    def.Resolve(Napi::Array::New(info.Env()));
+                    return def.Promise();
+                }
+
+                auto lanes = cppContextData->upscalerLanes;
+                lanes.insert(lanes.begin(), cppContextData->upscalerCtx);
+                const auto jobOptions = JobOptions::From(options, "upscale").WithWorkload(int(p.maxWidth * p.factor), int(p.maxHeight * p.factor), int(count));
+                return queueStableDiffusionWorker(info.Env(), cppContextData, [p, count, lanes = std::move(lanes)](CPPContextData& ctx)
+                {
+                    return upscaleImages(lanes, *p.inputs, 0, count, p.factor, p.output, ctx.numThreads);
+                },
+                [](Napi::Env env, ImageBatch&& images)
+                {
+                    return images.WrapAll(env);
+                }, jobOptions);
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "upscaleBatchStream", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                Napi::Value tmp;
+                const auto options = info[2].IsUndefined() ? Napi::Object::New(info.Env()) : info[2].ToObject();
+                const auto p = UpscaleBatchParams::From(info, options);
+                auto lanes = cppContextData->upscalerLanes;
+                lanes.insert(lanes.begin(), cppContextData->upscalerCtx);
+
+                // Images are upscaled a chunk per job, kept native until asked for like img2vid frames
+                const auto chunkSize = size_t(std::max(1, (tmp = options.Get("chunkSize"), tmp.IsUndefined() ? std::max(4, int(lanes.size())) : tmp.ToNumber().Int32Value())));
+                const auto count = p.inputs->size();
+                auto chunks = std::make_shared<std::vector<Napi::ObjectReference>>((count + chunkSize - 1) / chunkSize);
+                return ImageStream::New(info.Env(), "upscale", int(count), options, [cppContextData, p, count, chunkSize, chunks, lanes = std::move(lanes)](Napi::Env env, int index, const JobOptions& options)
+                {
+                    const auto chunk = size_t(index) / chunkSize;
+                    const auto begin = chunk * chunkSize;
+                    const auto end = std::min(count, begin + chunkSize);
+                    auto& images = (*chunks)[chunk];
+                    if (images.IsEmpty())
+                    {
+                        images = Napi::Persistent(queueStableDiffusionWorker(env, cppContextData, [p, lanes, begin, end](CPPContextData& ctx)
+                        {
+                            return upscaleImages(lanes, *p.inputs, begin, end, p.factor, p.output, ctx.numThreads);
+                        },
+                        [](Napi::Env env, ImageBatch&& images)
+                        {
+                            return Napi::External<ImageBatch>::New(env, new ImageBatch(std::move(images)), [](Napi::Env, ImageBatch* batch) { delete batch; });
+                        }, options.WithWorkload(int(p.maxWidth * p.factor), int(p.maxHeight * p.factor), int(end - begin))).As<Napi::Object>());
+                    }
+
+                    const auto imagesPromise = images.Value();
+                    // the last image of a chunk hands the chunk over to the promise chain
+                    if (size_t(index) + 1 == end)
+                        images.Reset();
+
+                    auto onImages = Napi::Function::New(env, [i = int(index - begin)](const Napi::CallbackInfo& info)
+                    {
+                        return info[0].As<Napi::External<ImageBatch>>().Data()->Wrap(info.Env(), i);
+                    });
+                    return imagesPromise.Get("then").As<Napi::Function>().Call(imagesPromise, { onImages });
+                });
+            }),
+            Napi::PropertyDescriptor::Function(env, Napi::Object(), "upscaleStream", [cppContextData](const Napi::CallbackInfo& info)
+            {
+                if (!cppContextData->upscalerCtx)
+                    throw Napi::Error::New(info.Env(), "Context disposed");
+
+                Napi::Value tmp;
+                const auto options = info[2].IsUndefined() ? Napi::Object::New(info.Env()) : info[2].ToObject();
+                const auto copyInputs = (tmp = options.Get("copyInputs"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
+                auto inputImage = extractSdImage(info[0].ToObject(), copyInputs);
+                const auto upscaleFactor = info[1].ToNumber().Uint32Value();
+                auto tile = TileOptions::From(options);
+                if (tile.size == 0)
+                    tile.size = 256;
+
+                const auto bandWidth = int(inputImage->width * upscaleFactor);
+                const auto bandHeight = std::min(tile.size, int(inputImage->height)) * int(upscaleFactor);
+                auto lanes = cppContextData->upscalerLanes;
+                lanes.insert(lanes.begin(), cppContextData->upscalerCtx);
+                const auto tiled = std::make_shared<TiledUpscale>(std::move(inputImage), std::move(lanes), upscaleFactor, tile);
+                return ImageStream::New(info.Env(), "upscale", tiled->Bands(), options, [cppContextData, tiled, bandWidth, bandHeight](Napi::Env env, int index, const JobOptions& options)
+                {
+                    return queueStableDiffusionWorker(env, cppContextData, [tiled, index](CPPContextData&)
+                    {
+                        return tiled->RunBand(index);
+                    },
+                    [](Napi::Env env, TiledUpscale::Rows&& rows)
+                    {
+                        return wrapImageRows(env, rows);
+                    }, options.WithWorkload(bandWidth, bandHeight, 1));
+                });
+            }),
+        });
+        tagUpscaler(ctx, cppContextData);
+        ctx.Freeze();
+        return ctx;
+    }
+
+    struct AutotuneOptions
+    {
+        std::string profilePath = defaultThreadProfilePath;
+        std::string upscaler;
+        std::vector<int> threads;
+        int width = 256;
+        int height = 256;
+        int steps = 2;
+        int targetSteps = 20;
+
+        static AutotuneOptions From(Napi::Object params)
+        {
+            Napi::Value tmp;
+            AutotuneOptions o;
+            o.profilePath = (tmp = params.Get("autotuneProfile"), tmp.IsUndefined() ? defaultThreadProfilePath : tmp.ToString().Utf8Value());
+            o.upscaler = (tmp = params.Get("upscaler"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
+            o.width = (tmp = params.Get("width"), tmp.IsUndefined() ? 256 : tmp.ToNumber().Int32Value());
+            o.height = (tmp = params.Get("height"), tmp.IsUndefined() ? 256 : tmp.ToNumber().Int32Value());
+            o.steps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 2 : tmp.ToNumber().Int32Value());
+            o.targetSteps = (tmp = params.Get("targetSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
+
+            if (tmp = params.Get("threads"), !tmp.IsUndefined())
+            {
+                const auto threads = tmp.As<Napi::Array>();
+                for (uint32_t i = 0; i < threads.Length(); i++)
+                    o.threads.push_back(threads.Get(i).ToNumber().Int32Value());
+            }
+            else
+            {
+                // around the physical core count, hybrid parts often peak below it and SMT sometimes above it
+                const int physical = std::max(1, int(get_num_physical_cores()));
+                const int logical = std::max(physical, int(std::thread::hardware_concurrency()));
+                o.threads = { physical / 4, physical / 2, physical * 3 / 4, physical, logical };
+                std::erase_if(o.threads, [](int t) { return t <= 0; });
+            }
+            std::sort(o.threads.begin(), o.threads.end());
+            o.threads.erase(std::unique(o.threads.begin(), o.threads.end()), o.threads.end());
 
-        imgObj.Freeze();
-        return imgObj;
-    }
+            if (o.threads.empty() || o.threads.front() <= 0)
+                throw Napi::Error::New(params.Env(), "Invalid threads");
+
+            if (o.width <= 0 || o.height <= 0 || o.steps <= 0 || o.targetSteps <= 0)
+                throw Napi::Error::New(params.Env(), "Invalid calibration size");
+
+            return o;
+        }
+    };
 
-    SdImage extractSdImage(Napi::Object imgObj)
+    // One private context per thread count, each runs a short generation twice and only the second one counts
+    // since the first pays for allocating buffers. Stage times come from the job's own timing, reset per run.
+    ThreadProfile calibrateThreads(ContextParams params, const AutotuneOptions& options)
     {
-        const auto width = imgObj.Get("width").ToNumber().Int32Value();
-        const auto height = imgObj.Get("height").ToNumber().Int32Value();
-        const auto channel = imgObj.Get("channel").ToNumber().Int32Value();
-        Napi::Buffer<uint8_t>::CheckCast(imgObj.Env(), imgObj.Get("data"));
-        const auto data = imgObj.Get("data").As<Napi::Buffer<uint8_t>>();
+        auto& job = *tl_job;
+        struct TimingScope
+        {
+            JobState& job;
+            JobTiming saved;
+            ~TimingScope() { job.timing = std::move(saved); }
+        } scope{ job, job.timing };
 
-        if (width <= 0 || height <= 0 || channel <= 0)
+        Txt2ImgParams run;
+        run.prompt = "a photo of a cat";
+        run.width = options.width;
+        run.height = options.height;
+        run.sampleSteps = options.steps;
+
+        ThreadProfile profile{ .cpu = cpuModelName(), .weightType = sd_type_name(params.weightType) };
+        for (const auto threads : options.threads)
         {
-            throw Napi::Error::New(imgObj.Env(), "Invalid size");
+            params.numThreads = threads;
+            job.memory = MemoryAccounting::instance().Track(params.EstimateBytes());
+            const auto sdCtx = std::unique_ptr<sd_ctx_t, decltype(&free_sd_ctx)>(params.Create(), &free_sd_ctx);
+            if (!sdCtx)
+                throw std::runtime_error("Context creation failed");
+
+            for (int i = 0; i < 2; i++)
+            {
+                job.timing = {};
+                job.timing.Start(TimingStage::Setup);
+                run.Run(sdCtx.get(), run.seed, 1);
+                job.timing.Finish();
+            }
+
+            const auto& timing = job.timing;
+            auto& m = profile.measurements.emplace_back(ThreadMeasurement{ .threads = threads });
+            m.stepMs = timing.stepMs.empty()
+                ? timing.stageMs[size_t(TimingStage::Sampling)] / options.steps
+                : std::accumulate(timing.stepMs.begin(), timing.stepMs.end(), 0.0) / timing.stepMs.size();
+            m.decodeMs = timing.stageMs[size_t(TimingStage::Decode)];
         }
+        job.memory.reset();
 
-        const size_t expectedSize = size_t(width) * height * channel;
-        if (expectedSize != data.Length())
+        if (!options.upscaler.empty())
         {
-            throw Napi::Error::New(imgObj.Env(), "Invalid size");
-        }
+            std::vector<uint8_t> pixels(size_t(options.width) * options.height * 3, 128);
+            const sd_image_t input{ .width = uint32_t(options.width), .height = uint32_t(options.height), .channel = 3, .data = pixels.data() };
+            for (auto& m : profile.measurements)
+            {
+                const auto upscalerCtx = std::unique_ptr<upscaler_ctx_t, decltype(&free_upscaler_ctx)>(new_upscaler_ctx(options.upscaler.c_str(), m.threads, params.weightType), &free_upscaler_ctx);
+                if (!upscalerCtx)
+                    throw std::runtime_error("Context creation failed");
 
-        auto img = (sd_image_t*)calloc(1, sizeof(sd_image_t));
-        img->width = width;
-        img->height = height;
-        img->channel = channel;
-        img->data = (uint8_t*)malloc(expectedSize);
-        memcpy(img->data, data.Data(), data.Length());
+                for (int i = 0; i < 2; i++)
+                {
+                    const auto start = Clock::now();
+                    const auto output = upscale(upscalerCtx.get(), input, 4);
+                    m.upscaleMs = toMs(Clock::now() - start);
+                    if (!output.data)
+                        throw std::runtime_error("upscale failed");
+                    free(output.data);
+                }
+            }
+        }
 
-        return SdImage(img);
+        const auto fastest = [&](auto cost)
+        {
+            return std::min_element(profile.measurements.begin(), profile.measurements.end(), [&](const auto& a, const auto& b) { return cost(a) < cost(b); })->threads;
+        };
+        profile.samplingThreads = fastest([](const ThreadMeasurement& m) { return m.stepMs; });
+        profile.decodeThreads = fastest([](const ThreadMeasurement& m) { return m.decodeMs; });
+        profile.numThreads = fastest([&](const ThreadMeasurement& m) { return m.stepMs * options.targetSteps + m.decodeMs; });
+        profile.upscaleThreads = options.upscaler.empty() ? 0 : fastest([](const ThreadMeasurement& m) { return m.upscaleMs; });
+        return profile;
     }
 
-
-    template <typename T, typename C>
-    Napi::Promise queueStableDiffusionWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, T&& func, C&& convFunc)
+    Napi::Object threadProfileObject(Napi::Env env, const ThreadProfile& profile)
     {
-        class StableDiffusionWorker : public Napi::AsyncWorker
+        auto measurements = Napi::Array::New(env, profile.measurements.size());
+        for (size_t i = 0; i < profile.measurements.size(); i++)
         {
-            //copy this on purpose to snapshot it
-            std::shared_ptr<CPPContextData> ctx;
-            Napi::Promise::Deferred def;
-            std::decay_t<T> func;
-            std::decay_t<C> convFunc;
-            std::optional<std::invoke_result_t<decltype(func), CPPContextData&>> result;
-        public:
-            StableDiffusionWorker(Napi::Env env, const std::shared_ptr<CPPContextData>& ctx, T&& func, C&& convFunc) : Napi::AsyncWorker(env, "node-stable-diffusion-cpp-worker"),
-                ctx(ctx), def(env), func(std::forward<T>(func)), convFunc(std::forward<C>(convFunc))
-            {
-            }
+            const auto& m = profile.measurements[i];
+            auto measurement = Napi::Object::New(env);
+            measurement["threads"] = Napi::Number::From(env, m.threads);
+            measurement["stepMs"] = Napi::Number::From(env, m.stepMs);
+            measurement["decodeMs"] = Napi::Number::From(env, m.decodeMs);
+            measurement["upscaleMs"] = Napi::Number::From(env, m.upscaleMs);
+            measurements[i] = measurement;
+        }
 
-            void Execute() override
-            {
-                auto prev = std::exchange(tl_current, ctx.get());
-                result.emplace(func(*ctx));
-                tl_current = prev;
-            }
+        auto ret = Napi::Object::New(env);
+        ret["cpu"] = Napi::String::New(env, profile.cpu);
+        ret["weightType"] = Napi::String::New(env, profile.weightType);
+        ret["numThreads"] = Napi::Number::From(env, profile.numThreads);
+        ret["samplingThreads"] = Napi::Number::From(env, profile.samplingThreads);
+        ret["decodeThreads"] = Napi::Number::From(env, profile.decodeThreads);
+        ret["upscaleThreads"] = Napi::Number::From(env, profile.upscaleThreads);
+        ret["measurements"] = measurements;
+        return ret;
+    }
+
+    Napi::Object histogramObject(Napi::Env env, const LatencyHistogram::Snapshot& histogram)
+    {
+        auto ret = Napi::Object::New(env);
+        ret["count"] = Napi::Number::From(env, double(histogram.count));
+        ret["sumMs"] = Napi::Number::From(env, histogram.sumUs / 1000.0);
+        ret["meanMs"] = Napi::Number::From(env, histogram.count > 0 ? histogram.sumUs / 1000.0 / histogram.count : 0.0);
+        ret["p50"] = Napi::Number::From(env, histogram.QuantileMs(0.5));
+        ret["p90"] = Napi::Number::From(env, histogram.QuantileMs(0.9));
+        ret["p99"] = Napi::Number::From(env, histogram.QuantileMs(0.99));
+        ret["p999"] = Napi::Number::From(env, histogram.QuantileMs(0.999));
+        ret["maxMs"] = Napi::Number::From(env, histogram.maxUs / 1000.0);
+        return ret;
+    }
 
-            void OnOK() override
+    // Prometheus text exposition of the same counters, histogram buckets double from about 1ms to 18 minutes
+    std::string prometheusMetrics()
+    {
+        auto& metrics = Metrics::instance();
+        std::string out;
+        char line[256];
+        const auto counter = [&](const char* name, const char* help, uint64_t value)
+        {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+            out += line;
+        };
+        const auto histogram = [&](const char* name, const char* help, const LatencyHistogram::Snapshot& h)
+        {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+            out += line;
+            for (int exponent = 10; exponent <= 30; exponent++)
             {
-                def.Resolve(convFunc(Env(), std::move(result).value()));
-                ctx->nextTask();
+                const auto le = uint64_t(1) << exponent;
+                snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, le / 1e6, (unsigned long long)h.CountBelow(le));
+                out += line;
             }
+            snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n", name, (unsigned long long)h.count, name, h.sumUs / 1e6, name, (unsigned long long)h.count);
+            out += line;
+        };
 
-            void OnError(const Napi::Error& e) override
+        out += "# HELP sd_jobs_total Jobs settled by kind and outcome\n# TYPE sd_jobs_total counter\n";
+        for (size_t k = 0; k < std::size(metricJobKinds); k++)
+        {
+            for (size_t o = 0; o < std::size(metricJobOutcomes); o++)
             {
-                def.Reject(e.Value());
-                ctx->nextTask();
+                snprintf(line, sizeof(line), "sd_jobs_total{kind=\"%s\",outcome=\"%s\"} %llu\n", metricJobKinds[k], metricJobOutcomes[o], (unsigned long long)metrics.Jobs(k, o));
+                out += line;
             }
+        }
 
-            Napi::Promise Promise() const { return def.Promise(); }
+        histogram("sd_job_queue_wait_seconds", "Time from queueing a job until it started", metrics.queueWait.Read());
+        histogram("sd_job_run_seconds", "Time a job ran on a scheduler thread", metrics.run.Read());
+        histogram("sd_sampler_step_seconds", "Duration of a single sampling step", metrics.step.Read());
+        counter("sd_images_total", "Images produced", metrics.images.load(std::memory_order_relaxed));
+        counter("sd_pixels_total", "Pixels produced", metrics.pixels.load(std::memory_order_relaxed));
 
+        out += "# HELP sd_image_bytes_total Image bytes passed between JS and native code\n# TYPE sd_image_bytes_total counter\n";
+        const std::pair<const char*, const std::atomic<uint64_t>*> bytes[] = {
+            { "direction=\"input\",mode=\"copied\"", &metrics.inputBytesCopied },
+            { "direction=\"input\",mode=\"borrowed\"", &metrics.inputBytesBorrowed },
+            { "direction=\"output\",mode=\"copied\"", &metrics.outputBytesCopied },
+            { "direction=\"output\",mode=\"wrapped\"", &metrics.outputBytesWrapped },
         };
+        for (const auto& [labels, value] : bytes)
+        {
+            snprintf(line, sizeof(line), "sd_image_bytes_total{%s} %llu\n", labels, (unsigned long long)value->load(std::memory_order_relaxed));
+            out += line;
+        }
 
-        const bool isFirst = ctx->pendingTasks.empty();
-        auto worker = std::make_unique<StableDiffusionWorker>(env, ctx, std::forward<T>(func), std::forward<C>(convFunc));
-        const auto ret = worker->Promise();
-        ctx->pendingTasks.emplace_back(std::move(worker));
-
-        if (isFirst)
-            ctx->nextTask();
+        out += "# HELP sd_events_delivered_total Log and progress events delivered to JS callbacks\n# TYPE sd_events_delivered_total counter\n";
+        snprintf(line, sizeof(line), "sd_events_delivered_total{kind=\"log\"} %llu\nsd_events_delivered_total{kind=\"progress\"} %llu\n",
+            (unsigned long long)metrics.logsDelivered.load(std::memory_order_relaxed), (unsigned long long)metrics.progressDelivered.load(std::memory_order_relaxed));
+        out += line;
+        counter("sd_events_dropped_total", "Log and progress events dropped because a channel was full", metrics.eventsDropped.load(std::memory_order_relaxed));
 
-        return ret;
+        out += "# HELP sd_context_queued_jobs Jobs waiting on a context\n# TYPE sd_context_queued_jobs gauge\n";
+        const auto queues = metrics.Queues();
+        for (const auto& queue : queues)
+        {
+            snprintf(line, sizeof(line), "sd_context_queued_jobs{context=\"%llu\"} %zu\n", (unsigned long long)queue->id, queue->queued.load(std::memory_order_relaxed));
+            out += line;
+        }
+        out += "# HELP sd_context_running_jobs Jobs running on a context\n# TYPE sd_context_running_jobs gauge\n";
+        for (const auto& queue : queues)
+        {
+            snprintf(line, sizeof(line), "sd_context_running_jobs{context=\"%llu\"} %zu\n", (unsigned long long)queue->id, queue->running.load(std::memory_order_relaxed));
+            out += line;
+        }
+        return out;
     }
 
     class NodeStableDiffusionCpp : public Napi::Addon<NodeStableDiffusionCpp>
     {
+        std::shared_ptr<JobCompletionQueue> completionQueue;
+
     public:
-        NodeStableDiffusionCpp(Napi::Env env, Napi::Object exports)
+        NodeStableDiffusionCpp(Napi::Env env, Napi::Object exports) : completionQueue(std::make_shared<JobCompletionQueue>(env))
         {
-            sd_set_log_callback(&stableDiffusionLogFunc, nullptr);
-            sd_set_progress_callback(&stableDiffusionProgressFunc, nullptr);
+            // checked before ggml ever runs, index.js then falls back to the next slower tier
+            if (!cpuRunsVariant(NODE_SD_CPU_VARIANT))
+                throw Napi::Error::New(env, "This CPU can't run the " NODE_SD_CPU_VARIANT " build");
+
+            NativeHooks::Install(&stableDiffusionLogFunc, &stableDiffusionProgressFunc);
 
             auto sampleMethodEnum = Napi::Object::New(env);
             sampleMethodEnum.DefineProperties(
@@ -329,9 +6050,26 @@ namespace
                 InstanceValue("Type", typeEnum),
                 InstanceMethod("createContext", &NodeStableDiffusionCpp::createContext),
                 InstanceMethod("createUpscaler", &NodeStableDiffusionCpp::createUpscaler),
+                InstanceMethod("adoptContext", &NodeStableDiffusionCpp::adoptContext),
+                InstanceMethod("adoptUpscaler", &NodeStableDiffusionCpp::adoptUpscaler),
                 InstanceMethod("getSystemInfo", &NodeStableDiffusionCpp::getSystemInfo),
                 InstanceMethod("getNumPhysicalCores", &NodeStableDiffusionCpp::getNumPhysicalCores),
+                InstanceMethod("getCpuTopology", &NodeStableDiffusionCpp::getCpuTopology),
                 InstanceMethod("weightTypeName", &NodeStableDiffusionCpp::weightTypeName),
+                InstanceMethod("getSchedulerStats", &NodeStableDiffusionCpp::getSchedulerStats),
+                InstanceMethod("configureScheduler", &NodeStableDiffusionCpp::configureScheduler),
+                InstanceMethod("getMetrics", &NodeStableDiffusionCpp::getMetrics),
+                InstanceMethod("getPrometheusMetrics", &NodeStableDiffusionCpp::getPrometheusMetrics),
+                InstanceMethod("startTrace", &NodeStableDiffusionCpp::startTrace),
+                InstanceMethod("stopTrace", &NodeStableDiffusionCpp::stopTrace),
+                InstanceMethod("preloadModel", &NodeStableDiffusionCpp::preloadModel),
+                InstanceMethod("evictModel", &NodeStableDiffusionCpp::evictModel),
+                InstanceMethod("getModelCacheStats", &NodeStableDiffusionCpp::getModelCacheStats),
+                InstanceMethod("configureModelCache", &NodeStableDiffusionCpp::configureModelCache),
+                InstanceMethod("getMemoryStats", &NodeStableDiffusionCpp::getMemoryStats),
+                InstanceMethod("configureMemory", &NodeStableDiffusionCpp::configureMemory),
+                InstanceMethod("autotune", &NodeStableDiffusionCpp::autotune),
+                InstanceMethod("getThreadProfile", &NodeStableDiffusionCpp::getThreadProfile),
             });
         }
     protected:
@@ -339,271 +6077,56 @@ namespace
         {
             Napi::Value tmp;
             const auto params = info[0].ToObject();
-            const auto model = (tmp = params.Get("model"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto clipL = (tmp = params.Get("clipL"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto clipG = (tmp = params.Get("clipG"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto t5xxl = (tmp = params.Get("t5xxl"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto diffusionModel = (tmp = params.Get("diffusionModel"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto vae = (tmp = params.Get("vae"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto taesd = (tmp = params.Get("taesd"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto controlNet = (tmp = params.Get("controlNet"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto loraDir = (tmp = params.Get("loraDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto embedDir = (tmp = params.Get("embedDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto stackedIdEmbedDir = (tmp = params.Get("stackedIdEmbedDir"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-            const auto vaeDecodeOnly = (tmp = params.Get("vaeDecodeOnly"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto vaeTiling = (tmp = params.Get("vaeTiling"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto freeParamsImmediately = (tmp = params.Get("freeParamsImmediately"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto numThreads = (tmp = params.Get("numThreads"), tmp.IsUndefined() ? GGML_DEFAULT_N_THREADS : tmp.ToNumber().Int32Value());
-            const auto weightType = (tmp = params.Get("weightType"), tmp.IsUndefined() ? SD_TYPE_F32 : sd_type_t(tmp.ToNumber().Uint32Value()));
-            const auto cudaRng = (tmp = params.Get("cudaRng"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto schedule = (tmp = params.Get("schedule"), tmp.IsUndefined() ? DEFAULT : schedule_t(tmp.ToNumber().Uint32Value()));
-            const auto keepClipOnCpu = (tmp = params.Get("keepClipOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto keepControlNetOnCpu = (tmp = params.Get("keepControlNetOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-            const auto keepVaeOnCpu = (tmp = params.Get("keepVaeOnCpu"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-
-            if (weightType >= SD_TYPE_COUNT)
-                throw Napi::Error::New(info.Env(), "Invalid weightType");
-
-            if (schedule >= N_SCHEDULES)
-                throw Napi::Error::New(info.Env(), "Invalid schedule");
+            const auto contextParams = ContextParams::From(params);
+            const auto numThreads = contextParams.numThreads;
+            const auto eventOptions = EventChannelOptions::From(params);
+            const auto loraCache = LoraCacheOptions::From(params);
+            // the variants are copies of the weights, which freeParamsImmediately drops after the first run
+            if (loraCache.maxSets > 0 && contextParams.freeParamsImmediately)
+                throw Napi::Error::New(info.Env(), "loraCache can't be used with freeParamsImmediately");
 
             auto cppContextData = std::make_shared<CPPContextData>();
-            if (!info[1].IsUndefined())
-            {
-                Napi::Function::CheckCast(info.Env(), info[1]);
-                cppContextData->logCallback = decltype(CPPContextData::logCallback)::New(info.Env(), info[1].As<Napi::Function>(), "node-stable-diffusion-cpp-log-callback", 1, 1);
-            }
-
-            if (!info[2].IsUndefined())
+            cppContextData->numThreads = numThreads > 0 ? numThreads : get_num_physical_cores();
+            cppContextData->placement = contextParams.placement;
+            cppContextData->coalesceWindowMs = std::max(0, (tmp = params.Get("coalesceWindow"), tmp.IsUndefined() ? 0 : tmp.ToNumber().Int32Value()));
+            cppContextData->completion = completionQueue;
+            cppContextData->events = EventChannel::Create(info.Env(), info[1], info[2], eventOptions);
+            if (tmp = params.Get("onTiming"), !tmp.IsUndefined())
             {
-                Napi::Function::CheckCast(info.Env(), info[2]);
-                cppContextData->logCallback = decltype(CPPContextData::logCallback)::New(info.Env(), info[2].As<Napi::Function>(), "node-stable-diffusion-cpp-progress-callback", 1, 1);
+                Napi::Function::CheckCast(info.Env(), tmp);
+                cppContextData->onTiming = Napi::Persistent(tmp.As<Napi::Function>());
             }
 
-            return queueStableDiffusionWorker(info.Env(), cppContextData, [=](CPPContextData& ctx)
+            const auto loadBytes = contextParams.Cacheable() && ModelCache::instance().Contains(contextParams.Key()) ? 0 : contextParams.EstimateBytes();
+            return queueStableDiffusionWorker(info.Env(), cppContextData, [p = std::move(contextParams), loraCache](CPPContextData& ctx)
             {
-                ctx.sdCtx = {
-                    new_sd_ctx(
-                        model.c_str(),
-                        clipL.c_str(),
-                        clipG.c_str(),
-                        t5xxl.c_str(),
-                        diffusionModel.c_str(),
-                        vae.c_str(),
-                        taesd.c_str(),
-                        controlNet.c_str(),
-                        loraDir.c_str(),
-                        embedDir.c_str(),
-                        stackedIdEmbedDir.c_str(),
-                        vaeDecodeOnly,
-                        vaeTiling,
-                        freeParamsImmediately,
-                        numThreads,
-                        weightType,
-                        cudaRng ? CUDA_RNG : STD_DEFAULT_RNG,
-                        schedule,
-                        keepClipOnCpu,
-                        keepControlNetOnCpu,
-                        keepVaeOnCpu
-                    ),
-                    [](sd_ctx_t* c) {
-                        if (c) free_sd_ctx(c);
-                    }
-                };
+                if (p.Cacheable())
+                {
+                    ctx.sdCtx = ModelCache::instance().Acquire(p, false, &ctx.memory);
+                }
+                else
+                {
+                    ctx.memory = tl_job->memory = MemoryAccounting::instance().Track(p.EstimateBytes());
+                    ctx.sdCtx = { p.Create(), [](sd_ctx_t* c) { if (c) free_sd_ctx(c); } };
+                }
 
                 if (!ctx.sdCtx)
                     throw std::runtime_error("Context creation failed");
 
+                if (loraCache.maxSets > 0)
+                    ctx.loras = std::make_shared<LoraVariants>(p, loraCache, ctx.memory);
+
                 return ctx.shared_from_this();
             },
             [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
             {
-                auto ctx = Napi::Object::New(env);
-                ctx.DefineProperties({
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "dispose", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->sdCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        cppContextData->sdCtx.reset();
-
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [](CPPContextData& ctx)
-                        {
-                           return ctx.shared_from_this();
-                        },
-                        [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
-                        {
-                            cppContextData->reset();
-                            return env.Undefined();
-                        });
-                    }),
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "txt2img", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->sdCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        Napi::Value tmp;
-                        const auto params = info[0].ToObject();
-                        const auto prompt = params.Get("prompt").ToString().Utf8Value();
-                        const auto negativePrompt = (tmp = params.Get("negativePrompt"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-                        const auto clipSkip = (tmp = params.Get("clipSkip"), tmp.IsUndefined() ? -1 : tmp.ToNumber().Int32Value());
-                        const auto cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
-                        const auto width = (tmp = params.Get("width"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
-                        const auto height = (tmp = params.Get("height"), tmp.IsUndefined() ? 512 : tmp.ToNumber().Int32Value());
-                        const auto sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
-                        const auto sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
-                        const auto seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
-                        const auto batchCount = (tmp = params.Get("batchCount"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value());
-                        auto controlCond = (tmp = params.Get("controlCond"), tmp.IsUndefined() ? SdImage() : extractSdImage(tmp.ToObject()));
-                        const auto controlStrength = (tmp = params.Get("controlStrength"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
-                        const auto styleRatio = (tmp = params.Get("styleRatio"), tmp.IsUndefined() ? 20.0f : tmp.ToNumber().FloatValue());
-                        const auto normalizeInput = (tmp = params.Get("normalizeInput"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-                        const auto inputIdImagesPath = (tmp = params.Get("inputIdImagesPath"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-                        const auto guidance = (tmp = params.Get("guidance"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
-
-                        if (sampleMethod >= N_SAMPLE_METHODS)
-                            throw Napi::Error::New(info.Env(), "Invalid sampleMethod");
-
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [=, sdCtx = cppContextData->sdCtx, controlCond = std::move(controlCond)](CPPContextData& ctx)
-                        {
-                            return SdImageList(txt2img(
-                                sdCtx.get(),
-                                prompt.c_str(),
-                                negativePrompt.c_str(),
-                                clipSkip,
-                                cfgScale,
-                                guidance,
-                                width,
-                                height,
-                                sampleMethod,
-                                sampleSteps,
-                                seed,
-                                batchCount,
-                                controlCond.get(),
-                                controlStrength,
-                                styleRatio,
-                                normalizeInput,
-                                inputIdImagesPath.c_str()
-                            ), batchCount);
-                        },
-                        [batchCount](Napi::Env env, SdImageList&& images)
-                        {
-                            auto arr = Napi::Array::New(env, batchCount);
-                            for (int b = 0; b < batchCount; b++)
-                            {
-                                arr[b] = wrapSdImage(env, images[b]);
-                            }
-                            return arr;
-                        });
-                    }),
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2img", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->sdCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        Napi::Value tmp;
-                        const auto params = info[0].ToObject();
-                        auto initImage = (tmp = params.Get("initImage"), tmp.IsUndefined() ? SdImage() : extractSdImage(tmp.ToObject()));
-                        const auto prompt = params.Get("prompt").ToString().Utf8Value();
-                        const auto negativePrompt = (tmp = params.Get("negativePrompt"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-                        const auto clipSkip = (tmp = params.Get("clipSkip"), tmp.IsUndefined() ? -1 : tmp.ToNumber().Int32Value());
-                        const auto cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
-                        const auto width = (tmp = params.Get("width"), tmp.IsUndefined() ? initImage->width : tmp.ToNumber().Int32Value());
-                        const auto height = (tmp = params.Get("height"), tmp.IsUndefined() ? initImage->height : tmp.ToNumber().Int32Value());
-                        const auto sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
-                        const auto sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
-                        const auto strength = (tmp = params.Get("strength"), tmp.IsUndefined() ? 0.75f : tmp.ToNumber().FloatValue());
-                        const auto seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
-                        const auto batchCount = (tmp = params.Get("batchCount"), tmp.IsUndefined() ? 1 : tmp.ToNumber().Int32Value());
-                        auto controlCond = (tmp = params.Get("controlCond"), tmp.IsUndefined() ? SdImage() : extractSdImage(tmp.ToObject()));
-                        const auto controlStrength = (tmp = params.Get("controlStrength"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
-                        const auto styleRatio = (tmp = params.Get("styleRatio"), tmp.IsUndefined() ? 20.0f : tmp.ToNumber().FloatValue());
-                        const auto normalizeInput = (tmp = params.Get("normalizeInput"), tmp.IsUndefined() ? false : tmp.ToBoolean().Value());
-                        const auto inputIdImagesPath = (tmp = params.Get("inputIdImagesPath"), tmp.IsUndefined() ? "" : tmp.ToString().Utf8Value());
-                        const auto guidance = (tmp = params.Get("guidance"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
-                        if (sampleMethod >= N_SAMPLE_METHODS)
-                            throw Napi::Error::New(info.Env(), "Invalid sampleMethod");
-
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [=, sdCtx = cppContextData->sdCtx, initImage = std::move(initImage), controlCond = std::move(controlCond)](CPPContextData& ctx)
-                        {
-                            return SdImageList(img2img(
-                                sdCtx.get(),
-                                *initImage,
-                                prompt.c_str(),
-                                negativePrompt.c_str(),
-                                clipSkip,
-                                cfgScale,
-                                guidance,
-                                width,
-                                height,
-                                sampleMethod,
-                                sampleSteps,
-                                strength,
-                                seed,
-                                batchCount,
-                                controlCond.get(),
-                                controlStrength,
-                                styleRatio,
-                                normalizeInput,
-                                inputIdImagesPath.c_str()
-                            ), batchCount);
-                        },
-                        [batchCount](Napi::Env env, SdImageList&& images)
-                        {
-                            auto arr = Napi::Array::New(env, batchCount);
-                            for (int b = 0; b < batchCount; b++)
-                            {
-                                arr[b] = wrapSdImage(env, images[b]);
-                            }
-                            return arr;
-                        });
-                    }),
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "img2vid", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->sdCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        Napi::Value tmp;
-                        const auto params = info[0].ToObject();
-                        auto initImage = (tmp = params.Get("initImage"), tmp.IsUndefined() ? SdImage() : extractSdImage(tmp.ToObject()));
-                        const auto width = (tmp = params.Get("width"), tmp.IsUndefined() ? initImage->width : tmp.ToNumber().Int32Value());
-                        const auto height = (tmp = params.Get("height"), tmp.IsUndefined() ? initImage->height : tmp.ToNumber().Int32Value());
-                        const auto videoFrames = (tmp = params.Get("videoFrames"), tmp.IsUndefined() ? 6 : tmp.ToNumber().Int32Value());
-                        const auto motionBucketId = (tmp = params.Get("motionBucketId"), tmp.IsUndefined() ? 127 : tmp.ToNumber().Int32Value());
-                        const auto fps = (tmp = params.Get("fps"), tmp.IsUndefined() ? 6 : tmp.ToNumber().Int32Value());
-                        const auto augmentationLevel = (tmp = params.Get("augmentationLevel"), tmp.IsUndefined() ? 0.0f : tmp.ToNumber().FloatValue());
-                        const auto minCfg = (tmp = params.Get("minCfg"), tmp.IsUndefined() ? 1.0f : tmp.ToNumber().FloatValue());
-                        const auto cfgScale = (tmp = params.Get("cfgScale"), tmp.IsUndefined() ? 7.0f : tmp.ToNumber().FloatValue());
-                        const auto sampleMethod = (tmp = params.Get("sampleMethod"), tmp.IsUndefined() ? EULER_A : sample_method_t(tmp.ToNumber().Uint32Value()));
-                        const auto sampleSteps = (tmp = params.Get("sampleSteps"), tmp.IsUndefined() ? 20 : tmp.ToNumber().Int32Value());
-                        const auto strength = (tmp = params.Get("strength"), tmp.IsUndefined() ? 0.75f : tmp.ToNumber().FloatValue());
-                        const auto seed = (tmp = params.Get("seed"), tmp.IsUndefined() ? 42 : tmp.ToNumber().Int64Value());
-                        if (sampleMethod >= N_SAMPLE_METHODS)
-                            throw Napi::Error::New(info.Env(), "Invalid sampleMethod");
-
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [=, sdCtx = cppContextData->sdCtx, initImage = std::move(initImage)](CPPContextData& ctx)
-                        {
-                            return SdImageList(img2vid(sdCtx.get(), *initImage, width, height, videoFrames, motionBucketId, fps, augmentationLevel, minCfg, cfgScale, sampleMethod, sampleSteps, strength, seed), videoFrames);
-                        },
-                        [videoFrames](Napi::Env env, SdImageList&& images)
-                        {
-                            auto arr = Napi::Array::New(env, videoFrames);
-                            for (int b = 0; b < videoFrames; b++)
-                            {
-                                arr[b] = wrapSdImage(env, images[b]);
-                            }
-                            return arr;
-                        });
-                    }),
-                });
-                ctx.Freeze();
-                return ctx;
-            });
+                return wrapContext(env, cppContextData);
+            }, { .kind = "createContext", .loadBytes = loadBytes });
         }
 
         Napi::Value getSystemInfo(const Napi::CallbackInfo& info)
         {
-            return Napi::String::New(info.Env(), sd_get_system_info());
+            return Napi::String::New(info.Env(), std::string(sd_get_system_info()) + "    CPU_VARIANT = " NODE_SD_CPU_VARIANT "\n");
         }
 
         Napi::Value getNumPhysicalCores(const Napi::CallbackInfo& info)
@@ -611,6 +6134,64 @@ namespace
             return Napi::Number::New(info.Env(), get_num_physical_cores());
         }
 
+        Napi::Value getCpuTopology(const Napi::CallbackInfo& info)
+        {
+            const auto env = info.Env();
+            const auto& topology = cpuTopology();
+            const auto cpuArray = [&](const std::vector<int>& cpus)
+            {
+                auto ret = Napi::Array::New(env, cpus.size());
+                for (size_t i = 0; i < cpus.size(); i++)
+                    ret[i] = Napi::Number::From(env, cpus[i]);
+                return ret;
+            };
+
+            std::map<int, std::vector<int>> socketCpus;
+            auto cores = Napi::Array::New(env, topology.cores.size());
+            for (size_t i = 0; i < topology.cores.size(); i++)
+            {
+                const auto& core = topology.cores[i];
+                auto& cpus = socketCpus[core.socket];
+                cpus.insert(cpus.end(), core.cpus.begin(), core.cpus.end());
+
+                auto coreObj = Napi::Object::New(env);
+                coreObj["socket"] = Napi::Number::From(env, core.socket);
+                coreObj["numaNode"] = Napi::Number::From(env, core.numaNode);
+                coreObj["cpus"] = cpuArray(core.cpus);
+                cores[i] = coreObj;
+            }
+
+            auto sockets = Napi::Array::New(env, socketCpus.size());
+            for (uint32_t i = 0; auto& [id, cpus] : socketCpus)
+            {
+                std::sort(cpus.begin(), cpus.end());
+                auto socket = Napi::Object::New(env);
+                socket["id"] = Napi::Number::From(env, id);
+                socket["cpus"] = cpuArray(cpus);
+                sockets[i++] = socket;
+            }
+
+            auto numaNodes = Napi::Array::New(env, topology.numaNodes.size());
+            for (size_t i = 0; i < topology.numaNodes.size(); i++)
+            {
+                const auto& node = topology.numaNodes[i];
+                auto nodeObj = Napi::Object::New(env);
+                nodeObj["id"] = Napi::Number::From(env, node.id);
+                nodeObj["cpus"] = cpuArray(node.cpus);
+                nodeObj["memoryBytes"] = Napi::Number::From(env, node.memoryBytes);
+                numaNodes[i] = nodeObj;
+            }
+
+            auto ret = Napi::Object::New(env);
+            ret["cpu"] = Napi::String::New(env, cpuModelName());
+            ret["logicalCpus"] = Napi::Number::From(env, topology.logicalCpus);
+            ret["physicalCores"] = Napi::Number::From(env, topology.cores.size());
+            ret["sockets"] = sockets;
+            ret["numaNodes"] = numaNodes;
+            ret["cores"] = cores;
+            return ret;
+        }
+
         Napi::Value weightTypeName(const Napi::CallbackInfo& info)
         {
             const auto weightType = sd_type_t(info[0].ToNumber().Uint32Value());
@@ -620,81 +6201,370 @@ namespace
             return Napi::String::New(info.Env(), sd_type_name(weightType));
         }
 
+        // Takes over a context another env transferred, with callbacks and options of its own
+        std::shared_ptr<CPPContextData> adopt(const Napi::CallbackInfo& info, bool upscaler)
+        {
+            Napi::Value tmp;
+            const auto token = info[0].ToNumber().Uint32Value();
+            const auto options = info[3].IsUndefined() ? Napi::Object::New(info.Env()) : info[3].ToObject();
+            const auto eventOptions = EventChannelOptions::From(options);
+            if (tmp = options.Get("onTiming"), !tmp.IsUndefined())
+                Napi::Function::CheckCast(info.Env(), tmp);
+
+            auto handoff = ContextHandoffs::instance().Take(token, upscaler);
+            if (!handoff)
+                throw Napi::Error::New(info.Env(), "Invalid context token");
+
+            auto cppContextData = std::make_shared<CPPContextData>();
+            cppContextData->sdCtx = std::move(handoff->sdCtx);
+            cppContextData->upscalerCtx = std::move(handoff->upscalerCtx);
+            cppContextData->upscalerLanes = std::move(handoff->upscalerLanes);
+            cppContextData->memory = std::move(handoff->memory);
+            cppContextData->loras = std::move(handoff->loras);
+            cppContextData->numThreads = handoff->numThreads;
+            cppContextData->placement = std::move(handoff->placement);
+            cppContextData->coalesceWindowMs = std::max(0, (tmp = options.Get("coalesceWindow"), tmp.IsUndefined() ? 0 : tmp.ToNumber().Int32Value()));
+            cppContextData->completion = completionQueue;
+            cppContextData->events = EventChannel::Create(info.Env(), info[1], info[2], eventOptions);
+            if (tmp = options.Get("onTiming"), !tmp.IsUndefined())
+                cppContextData->onTiming = Napi::Persistent(tmp.As<Napi::Function>());
+            return cppContextData;
+        }
+
+        Napi::Value adoptContext(const Napi::CallbackInfo& info)
+        {
+            return wrapContext(info.Env(), adopt(info, false));
+        }
+
+        Napi::Value adoptUpscaler(const Napi::CallbackInfo& info)
+        {
+            return wrapUpscaler(info.Env(), adopt(info, true));
+        }
+
+        Napi::Value getSchedulerStats(const Napi::CallbackInfo& info)
+        {
+            const auto stats = JobScheduler::instance().stats();
+            auto ret = Napi::Object::New(info.Env());
+            ret["workerThreads"] = Napi::Number::From(info.Env(), stats.workerThreads);
+            ret["threadBudget"] = Napi::Number::From(info.Env(), stats.threadBudget);
+            ret["threadsInUse"] = Napi::Number::From(info.Env(), stats.threadsInUse);
+            ret["running"] = Napi::Number::From(info.Env(), stats.running);
+            ret["queued"] = Napi::Number::From(info.Env(), stats.queued);
+            ret["ready"] = Napi::Number::From(info.Env(), stats.ready);
+            ret["maxQueueDepth"] = Napi::Number::From(info.Env(), stats.maxQueueDepth);
+            ret["started"] = Napi::Number::From(info.Env(), stats.started);
+            ret["rejected"] = Napi::Number::From(info.Env(), stats.rejected);
+            ret["lastWaitMs"] = Napi::Number::From(info.Env(), stats.lastWaitMs);
+            ret["meanWaitMs"] = Napi::Number::From(info.Env(), stats.meanWaitMs);
+            ret["maxWaitMs"] = Napi::Number::From(info.Env(), stats.maxWaitMs);
+            return ret;
+        }
+
+        Napi::Value configureScheduler(const Napi::CallbackInfo& info)
+        {
+            Napi::Value tmp;
+            const auto params = info[0].ToObject();
+            const auto workerThreads = (tmp = params.Get("workerThreads"), tmp.IsUndefined() ? std::optional<size_t>() : size_t(tmp.ToNumber().Uint32Value()));
+            const auto threadBudget = (tmp = params.Get("threadBudget"), tmp.IsUndefined() ? std::optional<int>() : tmp.ToNumber().Int32Value());
+            const auto maxQueueDepth = (tmp = params.Get("maxQueueDepth"), tmp.IsUndefined() ? std::optional<size_t>() : size_t(tmp.ToNumber().Uint32Value()));
+
+            if (workerThreads && *workerThreads == 0)
+                throw Napi::Error::New(info.Env(), "Invalid workerThreads");
+
+            if (threadBudget && *threadBudget <= 0)
+                throw Napi::Error::New(info.Env(), "Invalid threadBudget");
+
+            JobScheduler::instance().configure(workerThreads, threadBudget, maxQueueDepth);
+            return getSchedulerStats(info);
+        }
+
+        Napi::Value getMetrics(const Napi::CallbackInfo& info)
+        {
+            const auto env = info.Env();
+            auto& metrics = Metrics::instance();
+            const auto count = [&](const std::atomic<uint64_t>& value) { return Napi::Number::From(env, double(value.load(std::memory_order_relaxed))); };
+
+            auto jobs = Napi::Object::New(env);
+            for (size_t k = 0; k < std::size(metricJobKinds); k++)
+            {
+                auto outcomes = Napi::Object::New(env);
+                for (size_t o = 0; o < std::size(metricJobOutcomes); o++)
+                    outcomes[metricJobOutcomes[o]] = Napi::Number::From(env, double(metrics.Jobs(k, o)));
+                jobs[metricJobKinds[k]] = outcomes;
+            }
+
+            auto imageBytes = Napi::Object::New(env);
+            imageBytes["inputCopied"] = count(metrics.inputBytesCopied);
+            imageBytes["inputBorrowed"] = count(metrics.inputBytesBorrowed);
+            imageBytes["outputCopied"] = count(metrics.outputBytesCopied);
+            imageBytes["outputWrapped"] = count(metrics.outputBytesWrapped);
+
+            auto events = Napi::Object::New(env);
+            events["logDelivered"] = count(metrics.logsDelivered);
+            events["progressDelivered"] = count(metrics.progressDelivered);
+            events["dropped"] = count(metrics.eventsDropped);
+
+            const auto queues = metrics.Queues();
+            auto contexts = Napi::Array::New(env, queues.size());
+            for (size_t i = 0; i < queues.size(); i++)
+            {
+                auto context = Napi::Object::New(env);
+                context["id"] = Napi::Number::From(env, double(queues[i]->id));
+                context["queued"] = Napi::Number::From(env, queues[i]->queued.load(std::memory_order_relaxed));
+                context["running"] = Napi::Number::From(env, queues[i]->running.load(std::memory_order_relaxed));
+                contexts[i] = context;
+            }
+
+            auto ret = Napi::Object::New(env);
+            ret["jobs"] = jobs;
+            ret["queueWaitMs"] = histogramObject(env, metrics.queueWait.Read());
+            ret["runMs"] = histogramObject(env, metrics.run.Read());
+            ret["stepMs"] = histogramObject(env, metrics.step.Read());
+            ret["images"] = count(metrics.images);
+            ret["pixels"] = count(metrics.pixels);
+            ret["imageBytes"] = imageBytes;
+            ret["events"] = events;
+            ret["contexts"] = contexts;
+            return ret;
+        }
+
+        Napi::Value getPrometheusMetrics(const Napi::CallbackInfo& info)
+        {
+            return Napi::String::New(info.Env(), prometheusMetrics());
+        }
+
+        Napi::Value startTrace(const Napi::CallbackInfo& info)
+        {
+            Napi::Value tmp;
+            const auto options = info[0].IsUndefined() ? Napi::Object::New(info.Env()) : info[0].ToObject();
+            const auto maxEvents = (tmp = options.Get("maxEventsPerThread"), tmp.IsUndefined() ? 1u << 18 : tmp.ToNumber().Uint32Value());
+
+            Tracer::instance().NameThread("node-js");
+            if (!Tracer::instance().Start(maxEvents))
+                throw Napi::Error::New(info.Env(), "A trace is already running");
+
+            return info.Env().Undefined();
+        }
+
+        Napi::Value stopTrace(const Napi::CallbackInfo& info)
+        {
+            const auto trace = Tracer::instance().Stop();
+            if (!trace)
+                throw Napi::Error::New(info.Env(), "No trace is running");
+
+            return Napi::String::New(info.Env(), *trace);
+        }
+
+        Napi::Value preloadModel(const Napi::CallbackInfo& info)
+        {
+            auto contextParams = ContextParams::From(info[0].ToObject());
+            if (!contextParams.Cacheable())
+                throw Napi::Error::New(info.Env(), "Only shared contexts without freeParamsImmediately can be preloaded");
+
+            auto cppContextData = std::make_shared<CPPContextData>();
+            cppContextData->numThreads = contextParams.numThreads > 0 ? contextParams.numThreads : get_num_physical_cores();
+            cppContextData->placement = contextParams.placement;
+            cppContextData->completion = completionQueue;
+
+            const auto loadBytes = ModelCache::instance().Contains(contextParams.Key()) ? 0 : contextParams.EstimateBytes();
+            return queueStableDiffusionWorker(info.Env(), cppContextData, [p = std::move(contextParams)](CPPContextData& ctx)
+            {
+                if (!ModelCache::instance().Acquire(p, true))
+                    throw std::runtime_error("Context creation failed");
+
+                return true;
+            },
+            [](Napi::Env env, bool)
+            {
+                return env.Undefined();
+            }, { .kind = "preload", .loadBytes = loadBytes });
+        }
+
+        Napi::Value evictModel(const Napi::CallbackInfo& info)
+        {
+            const auto key = info[0].IsUndefined() ? std::optional<std::string>() : ContextParams::From(info[0].ToObject()).Key();
+            return Napi::Number::From(info.Env(), ModelCache::instance().Evict(key));
+        }
+
+        Napi::Value getModelCacheStats(const Napi::CallbackInfo& info)
+        {
+            const auto stats = ModelCache::instance().Stats();
+            auto ret = Napi::Object::New(info.Env());
+            ret["entries"] = Napi::Number::From(info.Env(), stats.entries);
+            ret["inUse"] = Napi::Number::From(info.Env(), stats.inUse);
+            ret["pinned"] = Napi::Number::From(info.Env(), stats.pinned);
+            ret["bytes"] = Napi::Number::From(info.Env(), stats.bytes);
+            ret["memoryBudget"] = Napi::Number::From(info.Env(), stats.memoryBudget);
+            ret["hits"] = Napi::Number::From(info.Env(), stats.hits);
+            ret["misses"] = Napi::Number::From(info.Env(), stats.misses);
+            ret["evictions"] = Napi::Number::From(info.Env(), stats.evictions);
+            return ret;
+        }
+
+        Napi::Value configureModelCache(const Napi::CallbackInfo& info)
+        {
+            Napi::Value tmp;
+            const auto params = info[0].ToObject();
+            if (tmp = params.Get("memoryBudget"), !tmp.IsUndefined())
+            {
+                const auto memoryBudget = tmp.ToNumber().DoubleValue();
+                if (!(memoryBudget >= 0))
+                    throw Napi::Error::New(info.Env(), "Invalid memoryBudget");
+
+                ModelCache::instance().Configure(size_t(memoryBudget));
+            }
+            return getModelCacheStats(info);
+        }
+
+        Napi::Value getMemoryStats(const Napi::CallbackInfo& info)
+        {
+            const auto stats = JobScheduler::instance().memoryStats();
+            auto ret = Napi::Object::New(info.Env());
+            ret["weightBytes"] = Napi::Number::From(info.Env(), stats.weightBytes);
+            ret["resultBytes"] = Napi::Number::From(info.Env(), stats.resultBytes);
+            ret["reservedBytes"] = Napi::Number::From(info.Env(), stats.reservedBytes);
+            ret["budget"] = Napi::Number::From(info.Env(), stats.budget);
+            ret["overBudget"] = Napi::String::New(info.Env(), stats.rejectOverBudget ? "reject" : "wait");
+            ret["contexts"] = Napi::Number::From(info.Env(), stats.contexts);
+            ret["delayed"] = Napi::Number::From(info.Env(), stats.delayed);
+            ret["rejected"] = Napi::Number::From(info.Env(), stats.rejected);
+            return ret;
+        }
+
+        Napi::Value configureMemory(const Napi::CallbackInfo& info)
+        {
+            Napi::Value tmp;
+            const auto params = info[0].ToObject();
+            std::optional<size_t> budget;
+            if (tmp = params.Get("budget"), !tmp.IsUndefined())
+            {
+                const auto value = tmp.ToNumber().DoubleValue();
+                if (!(value >= 0))
+                    throw Napi::Error::New(info.Env(), "Invalid budget");
+                budget = size_t(value);
+            }
+
+            std::optional<bool> rejectOverBudget;
+            if (tmp = params.Get("overBudget"), !tmp.IsUndefined())
+            {
+                const auto policy = tmp.ToString().Utf8Value();
+                if (policy != "wait" && policy != "reject")
+                    throw Napi::Error::New(info.Env(), "Invalid overBudget");
+                rejectOverBudget = policy == "reject";
+            }
+
+            JobScheduler::instance().configureMemory(budget, rejectOverBudget);
+            return getMemoryStats(info);
+        }
+
+        Napi::Value autotune(const Napi::CallbackInfo& info)
+        {
+            const auto params = info[0].ToObject();
+            auto contextParams = ContextParams::From(params);
+            const auto options = AutotuneOptions::From(params);
+            const auto eventOptions = EventChannelOptions::From(params);
+
+            auto cppContextData = std::make_shared<CPPContextData>();
+            cppContextData->numThreads = options.threads.back();
+            cppContextData->placement = contextParams.placement;
+            cppContextData->completion = completionQueue;
+            cppContextData->events = EventChannel::Create(info.Env(), info[1], info[2], eventOptions);
+
+            const auto loadBytes = contextParams.EstimateBytes();
+            return queueStableDiffusionWorker(info.Env(), cppContextData, [p = std::move(contextParams), options](CPPContextData&)
+            {
+                auto profile = calibrateThreads(p, options);
+                ThreadProfiles::instance().Save(options.profilePath, profile);
+                return profile;
+            },
+            [](Napi::Env env, const ThreadProfile& profile)
+            {
+                return threadProfileObject(env, profile);
+            }, { .kind = "autotune", .loadBytes = loadBytes });
+        }
+
+        Napi::Value getThreadProfile(const Napi::CallbackInfo& info)
+        {
+            const auto weightType = sd_type_t(info[0].ToNumber().Uint32Value());
+            if (weightType >= SD_TYPE_COUNT)
+                throw Napi::Error::New(info.Env(), "Invalid weightType");
+
+            const auto profilePath = info[1].IsUndefined() ? defaultThreadProfilePath : info[1].ToString().Utf8Value();
+            const auto profile = ThreadProfiles::instance().Find(profilePath, weightType);
+            return profile ? threadProfileObject(info.Env(), *profile) : info.Env().Undefined();
+        }
+
         Napi::Value createUpscaler(const Napi::CallbackInfo& info)
         {
             const auto esrganPath = info[0].ToString().Utf8Value();
-            const auto numThreads = info[1].IsUndefined() ? GGML_DEFAULT_N_THREADS : info[1].ToNumber().Int32Value();
             const auto weightType = info[2].IsUndefined() ? SD_TYPE_F32 : sd_type_t(info[2].ToNumber().Uint32Value());
+            const auto eventOptions = info[5].IsUndefined() ? EventChannelOptions() : EventChannelOptions::From(info[5].ToObject());
             if (weightType >= SD_TYPE_COUNT)
                 throw Napi::Error::New(info.Env(), "Invalid weightType");
 
-            auto cppContextData = std::make_shared<CPPContextData>();
-            if (!info[3].IsUndefined())
-            {
-                Napi::Function::CheckCast(info.Env(), info[3]);
-                cppContextData->logCallback = decltype(CPPContextData::logCallback)::New(info.Env(), info[3].As<Napi::Function>(), "node-stable-diffusion-cpp-log-callback", 1, 1);
-            }
+            Napi::Value tmp;
+            const auto profilePath = info[5].IsUndefined() || (tmp = info[5].ToObject().Get("autotuneProfile"), tmp.IsUndefined()) ? std::string(defaultThreadProfilePath) : tmp.ToString().Utf8Value();
+            const auto numThreads = resolveNumThreads(info[1], profilePath, weightType, true);
+            const auto lanes = info[5].IsUndefined() || (tmp = info[5].ToObject().Get("lanes"), tmp.IsUndefined()) ? 1 : tmp.ToNumber().Int32Value();
+            if (lanes < 1)
+                throw Napi::Error::New(info.Env(), "Invalid lanes");
 
-            if (!info[4].IsUndefined())
+            auto cppContextData = std::make_shared<CPPContextData>();
+            cppContextData->numThreads = numThreads > 0 ? numThreads : get_num_physical_cores();
+            cppContextData->placement = info[5].IsUndefined() ? Placement() : Placement::From(info[5].ToObject());
+            cppContextData->completion = completionQueue;
+            cppContextData->events = EventChannel::Create(info.Env(), info[3], info[4], eventOptions);
+            if (const auto onTiming = info[5].IsUndefined() ? info[5] : info[5].ToObject().Get("onTiming"); !onTiming.IsUndefined())
             {
-                Napi::Function::CheckCast(info.Env(), info[4]);
-                cppContextData->logCallback = decltype(CPPContextData::logCallback)::New(info.Env(), info[4].As<Napi::Function>(), "node-stable-diffusion-cpp-progress-callback", 1, 1);
+                Napi::Function::CheckCast(info.Env(), onTiming);
+                cppContextData->onTiming = Napi::Persistent(onTiming.As<Napi::Function>());
             }
 
+            std::error_code ec;
+            const auto fileSize = std::filesystem::file_size(esrganPath, ec);
+            const auto loadBytes = ec ? 0 : size_t(fileSize) * lanes;
             return queueStableDiffusionWorker(info.Env(), cppContextData, [=](CPPContextData& ctx)
             {
-                ctx.upscalerCtx = { new_upscaler_ctx(esrganPath.c_str(), numThreads, weightType), [](upscaler_ctx_t* c) { if (c) free_upscaler_ctx(c); } };
+                ctx.memory = tl_job->memory = MemoryAccounting::instance().Track(loadBytes);
+                // lanes split the threads between them, they run side by side in tiled upscales
+                const auto laneThreads = lanes > 1 ? std::max(1, ctx.numThreads / lanes) : numThreads;
+                ctx.upscalerCtx = { new_upscaler_ctx(esrganPath.c_str(), laneThreads, weightType), [](upscaler_ctx_t* c) { if (c) free_upscaler_ctx(c); } };
 
                 if (!ctx.upscalerCtx)
                     throw std::runtime_error("Context creation failed");
 
+                for (int l = 1; l < lanes; l++)
+                {
+                    auto& lane = ctx.upscalerLanes.emplace_back(new_upscaler_ctx(esrganPath.c_str(), laneThreads, weightType), [](upscaler_ctx_t* c) { if (c) free_upscaler_ctx(c); });
+                    if (!lane)
+                        throw std::runtime_error("Context creation failed");
+                }
+
                 return ctx.shared_from_this();
             },
             [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
             {
-                auto ctx = Napi::Object::New(env);
-                ctx.DefineProperties({
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "dispose", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->upscalerCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        cppContextData->upscalerCtx.reset();
-
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [](CPPContextData& ctx)
-                        {
-                            return ctx.shared_from_this();
-                        },
-                        [](Napi::Env env, const std::shared_ptr<CPPContextData>& cppContextData)
-                        {
-                            cppContextData->reset();
-                            return env.Undefined();
-                        });
-                    }),
-                    Napi::PropertyDescriptor::Function(env, Napi::Object(), "upscale", [cppContextData](const Napi::CallbackInfo& info)
-                    {
-                        if (!cppContextData->upscalerCtx)
-                            throw Napi::Error::New(info.Env(), "Context disposed");
-
-                        auto inputImage = extractSdImage(info[0].ToObject());
-                        const auto upscaleFactor = info[1].ToNumber().Uint32Value();
-                        return queueStableDiffusionWorker(info.Env(), cppContextData, [=, upscalerCtx = cppContextData->upscalerCtx, inputImage = std::move(inputImage)](CPPContextData& ctx)
-                        {
-                            auto img = (sd_image_t*)calloc(1, sizeof(sd_image_t));
-                            *img = upscale(upscalerCtx.get(), *inputImage, upscaleFactor);
-                            return SdImage(img);
-                        },
-                        [](Napi::Env env, SdImage&& image)
-                        {
-                            return wrapSdImage(env, *image);
-                        });
-                    }),
-                });
-                ctx.Freeze();
-                return ctx;
-            });
+                return wrapUpscaler(env, cppContextData);
+            }, { .kind = "createUpscaler", .loadBytes = loadBytes });
         }
     };
 }
 
+#ifdef NODE_SD_WRAP_GGML_INIT
+extern "C" ggml_context* __wrap_ggml_init(ggml_init_params params)
+{
+    const auto ctx = __real_ggml_init(params);
+    if (tl_job && tl_job->trackWorkCtx && !tl_job->workCtx)
+        tl_job->workCtx = ctx;
+    return ctx;
+}
+
+extern "C" void __wrap_ggml_free(ggml_context* ctx)
+{
+    if (tl_job && ctx && tl_job->workCtx == ctx)
+        tl_job->workCtx = nullptr;
+    __real_ggml_free(ctx);
+}
+#endif
+
 NODE_API_ADDON(NodeStableDiffusionCpp)